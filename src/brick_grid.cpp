@@ -0,0 +1,136 @@
+﻿#include "brick_grid.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <limits>
+
+BrickGrid::BrickGrid(const VolumeData* volumeData, int brickSize) : brickSize(brickSize), volumeDim(volumeData->dim) {
+    dim = (volumeDim + brickSize - 1) / brickSize;
+    size_t size = (size_t)dim[0] * dim[1] * dim[2];
+    minValue.resize(size);
+    maxValue.resize(size);
+    dispatchVoxelType(volumeData->type, [&](auto zero) {
+        computeRanges<decltype(zero)>(volumeData);
+    });
+}
+
+BrickGrid::BrickGrid(glm::ivec3 volumeDim, int brickSize, const float* minValue, const float* maxValue)
+    : brickSize(brickSize), volumeDim(volumeDim) {
+    dim = (volumeDim + brickSize - 1) / brickSize;
+    size_t size = (size_t)dim[0] * dim[1] * dim[2];
+    this->minValue.assign(minValue, minValue + size);
+    this->maxValue.assign(maxValue, maxValue + size);
+}
+
+template <typename T>
+void BrickGrid::computeRanges(const VolumeData* volumeData) {
+#pragma omp parallel for
+    for (int i = 0; i < dim[0]; i++) {
+        for (int j = 0; j < dim[1]; j++) {
+            for (int k = 0; k < dim[2]; k++) {
+                float lo = std::numeric_limits<float>::max(), hi = std::numeric_limits<float>::lowest();
+                for (int z = i * brickSize; z <= std::min((i + 1) * brickSize, volumeDim[0] - 1); z++) {
+                    for (int y = j * brickSize; y <= std::min((j + 1) * brickSize, volumeDim[1] - 1); y++) {
+                        for (int x = k * brickSize; x <= std::min((k + 1) * brickSize, volumeDim[2] - 1); x++) {
+                            float value = volumeData->value<T>(z, y, x);
+                            lo = std::min(lo, value);
+                            hi = std::max(hi, value);
+                        }
+                    }
+                }
+                minValue[index(i, j, k)] = lo;
+                maxValue[index(i, j, k)] = hi;
+            }
+        }
+    }
+}
+
+std::vector<unsigned char> BrickGrid::occupancy(const TransferFunction& transferFunction) const {
+    std::vector<unsigned char> occupied(minValue.size());
+    for (size_t n = 0; n < occupied.size(); n++) {
+        occupied[n] = !transferFunction.isTransparent(minValue[n], maxValue[n]);
+    }
+    return occupied;
+}
+
+void BrickGrid::buildProxyMesh(const std::vector<unsigned char>& occupancy, std::vector<float>& vertices, std::vector<unsigned int>& indices) const {
+    vertices.clear();
+    indices.clear();
+    // 砖块 b 在某个轴上的范围，换算到 [-1, 1]；采样点的体素坐标为 texCoord * n - 0.5，边界上的砖块延伸到包围盒
+    auto bound = [&](int b, int axis) {
+        int n = volumeDim[axis];
+        float lo = b == 0 ? 0.f : (b * brickSize + 0.5f) / n;
+        float hi = b == dim[axis] - 1 ? 1.f : ((b + 1) * brickSize + 0.5f) / n;
+        return glm::vec2(lo, hi) * 2.f - 1.f;
+    };
+    for (int i = 0; i < dim[0]; i++) {
+        for (int j = 0; j < dim[1]; j++) {
+            for (int k = 0; k < dim[2]; k++) {
+                if (!occupancy[index(i, j, k)]) continue;
+                // 包围盒的 x, y, z 分别对应体数据的 dim[2], dim[1], dim[0]
+                glm::vec2 bx = bound(k, 2), by = bound(j, 1), bz = bound(i, 0);
+                glm::vec3 lo{bx[0], by[0], bz[0]}, hi{bx[1], by[1], bz[1]};
+                glm::ivec3 brick{k, j, i};
+                glm::ivec3 brickDim{dim[2], dim[1], dim[0]};
+                for (int a = 0; a < 3; a++) {
+                    for (int s = -1; s <= 1; s += 2) {
+                        // 相邻的砖块也不透明时这个面在内部，不需要画
+                        glm::ivec3 neighbor = brick;
+                        neighbor[a] += s;
+                        if (neighbor[a] >= 0 && neighbor[a] < brickDim[a] && occupancy[index(neighbor.z, neighbor.y, neighbor.x)]) continue;
+
+                        // (u, v, a) 为右手系时，按 (lo, lo), (hi, lo), (hi, hi), (lo, hi) 的顺序从 +a 方向看是逆时针的
+                        int u = (a + 1) % 3, v = (a + 2) % 3;
+                        unsigned int base = (unsigned int)(vertices.size() / 3);
+                        for (int q = 0; q < 4; q++) {
+                            glm::vec3 corner;
+                            corner[a] = s > 0 ? hi[a] : lo[a];
+                            corner[u] = q == 1 || q == 2 ? hi[u] : lo[u];
+                            corner[v] = q >= 2 ? hi[v] : lo[v];
+                            vertices.insert(vertices.end(), {corner.x, corner.y, corner.z});
+                        }
+                        if (s > 0) {
+                            indices.insert(indices.end(), {base, base + 1, base + 2, base, base + 2, base + 3});
+                        } else {
+                            indices.insert(indices.end(), {base, base + 2, base + 1, base, base + 3, base + 2});
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+int BrickGrid::skipEmpty(const std::vector<unsigned char>& occupancy, glm::vec3 voxelStart, glm::vec3 voxelStep, int n) const {
+    glm::ivec3 b = brickOf(voxelStart + (float)n * voxelStep);
+    if (occupancy[index(b.x, b.y, b.z)]) return n;
+
+    // 每个轴上离开这个砖块的第一步，边界上的砖块向外延伸到无穷远
+    long long next = LLONG_MAX;
+    for (int axis = 0; axis < 3; axis++) {
+        if (voxelStep[axis] > 0 && b[axis] < dim[axis] - 1) {
+            float exit = ((b[axis] + 1) * brickSize - voxelStart[axis]) / voxelStep[axis];
+            next = std::min(next, (long long)std::ceil(exit));
+        } else if (voxelStep[axis] < 0 && b[axis] > 0) {
+            float exit = (b[axis] * brickSize - voxelStart[axis]) / voxelStep[axis];
+            next = std::min(next, (long long)std::floor(exit) + 1);
+        }
+    }
+    return (int)std::min<long long>(std::max<long long>(next, n + 1), INT_MAX);
+}
+
+void BrickGrid::restrictTo(std::vector<unsigned char>& occupancy, glm::ivec3 voxelMin, glm::ivec3 voxelMax) const {
+    // 砖块包含下一个砖块的第一层体素，所以范围的起点向前多算一个体素
+    glm::ivec3 first = glm::max(voxelMin - 1, 0) / brickSize;
+    glm::ivec3 last = glm::min((voxelMax - 1) / brickSize, dim - 1);
+    for (int i = 0; i < dim[0]; i++) {
+        for (int j = 0; j < dim[1]; j++) {
+            for (int k = 0; k < dim[2]; k++) {
+                if (i < first[0] || i > last[0] || j < first[1] || j > last[1] || k < first[2] || k > last[2]) {
+                    occupancy[index(i, j, k)] = 0;
+                }
+            }
+        }
+    }
+}
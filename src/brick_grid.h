@@ -0,0 +1,59 @@
+﻿#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "transfer_function.h"
+#include "volume_data.h"
+
+/**
+ * 把体数据分成 brickSize^3 的砖块，记录每个砖块内体素的最小值和最大值
+ * 传输函数变化时只需要用 min/max 判断哪些砖块完全透明，不需要重新扫描体数据
+ * GPU 上用不透明砖块的外表面作为代理几何体，CPU 上用来跳过光线经过的空砖块
+ */
+class BrickGrid {
+   public:
+    static constexpr int BRICK_SIZE = 16;
+
+    explicit BrickGrid(const VolumeData* volumeData, int brickSize = BRICK_SIZE);
+    /**
+     * 使用已经算好的 min/max（例如从缓存中读出来的），不扫描体数据
+     */
+    BrickGrid(glm::ivec3 volumeDim, int brickSize, const float* minValue, const float* maxValue);
+
+    /**
+     * 每个砖块在这个传输函数下是否有不透明度大于 0 的部分
+     */
+    std::vector<unsigned char> occupancy(const TransferFunction& transferFunction) const;
+    /**
+     * 生成所有不透明砖块合起来的外表面（只保留和空砖块相邻的面）
+     * 坐标在 [-1, 1] 的立方体中，和 RayCasting 里面的包围盒一样；从外面看三角形是逆时针的
+     */
+    void buildProxyMesh(const std::vector<unsigned char>& occupancy, std::vector<float>& vertices, std::vector<unsigned int>& indices) const;
+    /**
+     * 光线在体素坐标下为 voxelStart + n * voxelStep，第 n 步落在空砖块中时返回离开这个砖块之后的第一步，否则返回 n
+     */
+    int skipEmpty(const std::vector<unsigned char>& occupancy, glm::vec3 voxelStart, glm::vec3 voxelStep, int n) const;
+    /**
+     * 把和体素范围 [voxelMin, voxelMax) 不相交的砖块标记为空，用于裁剪盒
+     */
+    void restrictTo(std::vector<unsigned char>& occupancy, glm::ivec3 voxelMin, glm::ivec3 voxelMax) const;
+
+    inline glm::ivec3 brickOf(glm::vec3 voxelPos) const {
+        voxelPos = glm::clamp(voxelPos, glm::vec3(0.f), glm::vec3(volumeDim - 1));
+        return glm::min(glm::ivec3(voxelPos) / brickSize, dim - 1);
+    }
+    inline size_t index(int i, int j, int k) const {
+        return ((size_t)i * dim[1] + j) * dim[2] + k;
+    }
+
+    int brickSize;
+    // 砖块的数量 (z, y, x)
+    glm::ivec3 dim;
+    glm::ivec3 volumeDim;
+    // 每个砖块多包含下一个砖块的第一层体素，保证三线性插值用到的 8 个体素都在同一个砖块里
+    std::vector<float> minValue, maxValue;
+
+   private:
+    template <typename T>
+    void computeRanges(const VolumeData* volumeData);
+};
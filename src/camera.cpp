@@ -0,0 +1,23 @@
+﻿#include "camera.h"
+
+#include <cmath>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "trackball.h"
+
+float Camera::focalLength() const {
+    return 1.0f / std::tan(glm::radians(fov) / 2.0f);
+}
+
+glm::mat4 Camera::viewMatrix() const {
+    float m[4][4];
+    build_rotmatrix(m, quat);
+    // build_rotmatrix 得到的是行主序矩阵，按 glm 的列主序读进来相当于转置，正好是共轭四元数（逆旋转）对应的矩阵
+    glm::mat4 rotation;
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            rotation[i][j] = m[i][j];
+        }
+    }
+    return glm::lookAt(eye, lookat, up) * rotation;
+}
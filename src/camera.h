@@ -0,0 +1,28 @@
+﻿#pragma once
+#include <glm/glm.hpp>
+
+/**
+ * 相机参数，RayCasting（GPU）和 VolumeRendering（CPU）共用同一份
+ * model 放在原点并且缩放到 [-0.5, 0.5] 区间，我们从 z=1.2 往 -z 方向看，确保能够看到 model 整体全貌，不管它有多大
+ */
+struct Camera {
+    // trackball 累积的旋转四元数 (x, y, z, w)
+    float quat[4] = {0, 0, 0, 1};
+    glm::vec3 eye = {0, 0, 1.2},
+              lookat = {0, 0, 0}, up = {0, 1, 0};
+    float zNear = 0.1f, zFar = 100.0f, fov = 60.0f;
+
+    // 眼睛到投射平面的距离
+    float focalLength() const;
+    // 在 shader 里面 texture 采样的时候用的索引是没有旋转的，因此 model 的旋转通过 view 的逆旋转表示
+    glm::mat4 viewMatrix() const;
+
+    inline bool operator==(const Camera& other) const {
+        return quat[0] == other.quat[0] && quat[1] == other.quat[1] && quat[2] == other.quat[2] && quat[3] == other.quat[3] &&
+               eye == other.eye && lookat == other.lookat && up == other.up &&
+               zNear == other.zNear && zFar == other.zFar && fov == other.fov;
+    }
+    inline bool operator!=(const Camera& other) const {
+        return !(*this == other);
+    }
+};
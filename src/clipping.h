@@ -0,0 +1,84 @@
+﻿#pragma once
+#include <algorithm>
+#include <cmath>
+#include <glm/glm.hpp>
+#include <vector>
+
+/**
+ * 感兴趣区域 (ROI) 的裁剪盒和任意裁剪平面，都在 [0, 1] 的纹理坐标下表示
+ * 光线的区间直接和它们解析求交，裁剪掉的部分不会产生任何采样
+ */
+struct Clipping {
+    // shader 中 uniform 数组的大小
+    static constexpr int MAX_PLANES = 6;
+
+    glm::vec3 boxMin{0.f}, boxMax{1.f};
+    // (n, d)，保留 dot(n, p) + d >= 0 的一侧
+    std::vector<glm::vec4> planes;
+
+    inline bool isCropped() const {
+        return boxMin != glm::vec3(0.f) || boxMax != glm::vec3(1.f);
+    }
+
+    /**
+     * 纹理坐标下的光线 origin + t * direction 和裁剪盒、裁剪平面求交，缩小 [t0, t1]，返回区间是否非空
+     */
+    inline bool clipRay(glm::vec3 origin, glm::vec3 direction, float& t0, float& t1) const {
+        // Slab method
+        glm::vec3 directionInv = 1.f / direction;
+        glm::vec3 tMax = directionInv * (boxMax - origin);
+        glm::vec3 tMin = directionInv * (boxMin - origin);
+        glm::vec3 tEnter = glm::min(tMax, tMin), tExit = glm::max(tMax, tMin);
+        t0 = std::max({t0, tEnter.x, tEnter.y, tEnter.z});
+        t1 = std::min({t1, tExit.x, tExit.y, tExit.z});
+        for (size_t i = 0; i < planes.size() && (int)i < MAX_PLANES; i++) {
+            glm::vec3 n = glm::vec3(planes[i]);
+            float num = glm::dot(n, origin) + planes[i].w;
+            float denom = glm::dot(n, direction);
+            if (denom == 0) {
+                // 光线和平面平行，整条光线都在外面或者都在里面
+                if (num < 0) return false;
+            } else if (denom > 0) {
+                t0 = std::max(t0, -num / denom);
+            } else {
+                t1 = std::min(t1, -num / denom);
+            }
+        }
+        return t1 > t0;
+    }
+
+    /**
+     * 纹理坐标下的一个点是否在裁剪盒里面、并且在所有裁剪平面保留的一侧
+     */
+    inline bool contains(glm::vec3 p) const {
+        for (int axis = 0; axis < 3; axis++) {
+            if (p[axis] < boxMin[axis] || p[axis] > boxMax[axis]) return false;
+        }
+        for (size_t i = 0; i < planes.size() && (int)i < MAX_PLANES; i++) {
+            if (glm::dot(glm::vec3(planes[i]), p) + planes[i].w < 0) return false;
+        }
+        return true;
+    }
+
+    /**
+     * 裁剪盒覆盖的体素范围 [voxelMin, voxelMax)，顺序为 (z, y, x)
+     * 多包含一层体素保证三线性插值，再向外对齐到 alignment 的整数倍（例如砖块大小）
+     */
+    inline void voxelRegion(glm::ivec3 dim, int alignment, glm::ivec3& voxelMin, glm::ivec3& voxelMax) const {
+        glm::vec3 lo{boxMin.z, boxMin.y, boxMin.x}, hi{boxMax.z, boxMax.y, boxMax.x};
+        for (int axis = 0; axis < 3; axis++) {
+            int first = (int)std::floor(lo[axis] * dim[axis] - 0.5f);
+            int last = (int)std::ceil(hi[axis] * dim[axis] - 0.5f);
+            voxelMin[axis] = std::max(0, first / alignment * alignment);
+            voxelMax[axis] = std::min(dim[axis], (last + alignment) / alignment * alignment);
+            voxelMax[axis] = std::max(voxelMax[axis], std::min(dim[axis], voxelMin[axis] + 1));
+        }
+    }
+
+    inline bool operator==(const Clipping& other) const {
+        return boxMin == other.boxMin && boxMax == other.boxMax && planes == other.planes;
+    }
+    inline bool operator!=(const Clipping& other) const {
+        return !(*this == other);
+    }
+};
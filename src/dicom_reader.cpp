@@ -0,0 +1,351 @@
+﻿#include "dicom_reader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+
+#include "memory_budget.h"
+
+static constexpr uint32_t UNDEFINED_LENGTH = 0xFFFFFFFF;
+static const char* IMPLICIT_VR_LITTLE_ENDIAN = "1.2.840.10008.1.2";
+static const char* EXPLICIT_VR_LITTLE_ENDIAN = "1.2.840.10008.1.2.1";
+
+template <typename T>
+static inline bool readValue(std::istream& file, T& value) {
+    return (bool)file.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+
+/**
+ * 读取一个数据元素的标签和长度，文件停在值的开头
+ * 条目和结束标记 (FFFE,xxxx) 在显式 VR 下也没有 VR 字段
+ */
+static bool readElementHeader(std::istream& file, bool explicitVR, uint16_t& group, uint16_t& element, uint32_t& length) {
+    if (!readValue(file, group) || !readValue(file, element)) return false;
+    // 文件元信息 (0002) 总是显式 VR
+    if ((!explicitVR && group != 0x0002) || group == 0xFFFE) return readValue(file, length);
+    char vr[2];
+    if (!file.read(vr, 2)) return false;
+    // 这些 VR 后面有 2 个保留字节和 4 字节的长度，其他的是 2 字节的长度
+    static const char* longVRs[] = {"OB", "OD", "OF", "OL", "OV", "OW", "SQ", "SV", "UC", "UN", "UR", "UT", "UV"};
+    for (const char* longVR : longVRs) {
+        if (vr[0] == longVR[0] && vr[1] == longVR[1]) {
+            file.ignore(2);
+            return readValue(file, length);
+        }
+    }
+    uint16_t shortLength;
+    if (!readValue(file, shortLength)) return false;
+    length = shortLength;
+    return true;
+}
+
+/**
+ * 跳过长度未定义的序列或者条目，直到遇到对应的结束标记：条目为 (FFFE,E00D)，序列为 (FFFE,E0DD)
+ */
+static bool skipUndefinedLength(std::istream& file, bool explicitVR, uint16_t endElement) {
+    uint16_t group, element;
+    uint32_t length;
+    while (readElementHeader(file, explicitVR, group, element, length)) {
+        if (group == 0xFFFE && element == endElement) return true;
+        if (length == UNDEFINED_LENGTH) {
+            bool item = group == 0xFFFE && element == 0xE000;
+            if (!skipUndefinedLength(file, explicitVR, item ? 0xE00D : 0xE0DD)) return false;
+        } else {
+            file.seekg(length, std::ios::cur);
+        }
+    }
+    return false;
+}
+
+// DS、IS 等多值的字符串用 '\' 分隔
+static std::vector<double> parseNumbers(const std::string& value) {
+    std::vector<double> numbers;
+    const char* p = value.c_str();
+    while (*p) {
+        char* end;
+        double number = std::strtod(p, &end);
+        if (end == p) break;
+        numbers.push_back(number);
+        p = end;
+        while (*p == ' ' || *p == '\\') p++;
+    }
+    return numbers;
+}
+
+static std::string trim(std::string value) {
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\0')) value.pop_back();
+    return value;
+}
+
+bool DicomReader::parseHeader(const std::string& path, Slice& slice) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (!file.is_open()) return false;
+    slice.path = path;
+    // 元素的长度来自文件本身，超过剩下的字节数说明文件已损坏
+    file.seekg(0, std::ios::end);
+    const int64_t fileSize = (int64_t)file.tellg();
+    file.seekg(0, std::ios::beg);
+    auto fits = [&](uint32_t length) { return (int64_t)length <= fileSize - (int64_t)file.tellg(); };
+    // 128 字节的前导和 "DICM"，没有的文件直接从数据元素开始
+    char preamble[132];
+    if (!file.read(preamble, 132) || std::memcmp(preamble + 128, "DICM", 4) != 0) {
+        file.clear();
+        file.seekg(0, std::ios::beg);
+    }
+    // 没有文件元信息时默认是隐式 VR，否则按传输语法
+    bool explicitVR = false;
+    uint16_t group, element;
+    uint32_t length;
+    while (readElementHeader(file, explicitVR, group, element, length)) {
+        uint32_t tag = (uint32_t)group << 16 | element;
+        if (tag == 0x7FE00010) {
+            // 压缩的像素数据是长度未定义的封装格式
+            if (length == UNDEFINED_LENGTH) return false;
+            slice.pixelOffset = (int64_t)file.tellg();
+            return slice.rows > 0 && slice.columns > 0;
+        }
+        if (length == UNDEFINED_LENGTH) {
+            if (!skipUndefinedLength(file, explicitVR, 0xE0DD)) return false;
+            continue;
+        }
+        switch (tag) {
+            case 0x00020010:  // Transfer Syntax UID
+            case 0x0020000E:  // Series Instance UID
+            case 0x00180050:  // Slice Thickness
+            case 0x00200013:  // Instance Number
+            case 0x00200032:  // Image Position (Patient)
+            case 0x00200037:  // Image Orientation (Patient)
+            case 0x00280030:  // Pixel Spacing
+            case 0x00281052:  // Rescale Intercept
+            case 0x00281053:  // Rescale Slope
+            {
+                if (!fits(length)) return false;
+                std::string value(length, '\0');
+                file.read(&value[0], length);
+                value = trim(value);
+                std::vector<double> numbers = parseNumbers(value);
+                if (tag == 0x00020010) {
+                    if (value != IMPLICIT_VR_LITTLE_ENDIAN && value != EXPLICIT_VR_LITTLE_ENDIAN) {
+                        std::cout << path << ": unsupported transfer syntax " << value << std::endl;
+                        return false;
+                    }
+                    explicitVR = value == EXPLICIT_VR_LITTLE_ENDIAN;
+                } else if (tag == 0x0020000E) {
+                    slice.seriesUid = value;
+                } else if (tag == 0x00180050 && numbers.size() >= 1) {
+                    slice.sliceThickness = (float)numbers[0];
+                } else if (tag == 0x00200013 && numbers.size() >= 1) {
+                    slice.instanceNumber = (int)numbers[0];
+                } else if (tag == 0x00200032 && numbers.size() >= 3) {
+                    slice.position = {numbers[0], numbers[1], numbers[2]};
+                    slice.hasPosition = true;
+                } else if (tag == 0x00200037 && numbers.size() >= 6) {
+                    slice.rowDirection = {numbers[0], numbers[1], numbers[2]};
+                    slice.columnDirection = {numbers[3], numbers[4], numbers[5]};
+                } else if (tag == 0x00280030 && numbers.size() >= 2) {
+                    slice.pixelSpacing = {(float)numbers[0], (float)numbers[1]};
+                } else if (tag == 0x00281052 && numbers.size() >= 1) {
+                    slice.rescaleIntercept = (float)numbers[0];
+                } else if (tag == 0x00281053 && numbers.size() >= 1) {
+                    slice.rescaleSlope = (float)numbers[0];
+                }
+                break;
+            }
+            case 0x00280002:  // Samples per Pixel
+            case 0x00280010:  // Rows
+            case 0x00280011:  // Columns
+            case 0x00280100:  // Bits Allocated
+            case 0x00280103:  // Pixel Representation
+            {
+                uint16_t value = 0;
+                if (length < sizeof(value) || !fits(length)) return false;
+                readValue(file, value);
+                file.seekg(length - sizeof(value), std::ios::cur);
+                if (tag == 0x00280002) slice.samplesPerPixel = value;
+                if (tag == 0x00280010) slice.rows = value;
+                if (tag == 0x00280011) slice.columns = value;
+                if (tag == 0x00280100) slice.bitsAllocated = value;
+                if (tag == 0x00280103) slice.pixelRepresentation = value;
+                break;
+            }
+            default:
+                file.seekg(length, std::ios::cur);
+        }
+    }
+    return false;
+}
+
+DicomReader::DicomReader(const std::string& directory) {
+    read(directory, true, glm::ivec3(0), glm::ivec3(0));
+}
+
+DicomReader::DicomReader(const std::string& directory, glm::ivec3 regionMin, glm::ivec3 regionMax) {
+    read(directory, false, regionMin, regionMax);
+}
+
+DicomReader::~DicomReader() {
+    MemoryBudget::instance().release(m_data);
+}
+
+void* DicomReader::data() const {
+    return m_data;
+}
+
+/**
+ * 从 src 开始的 count 个 T 转换为 float 写到 dst，dst 可以和 src 重叠，只要 dst 不超过当前读取的位置
+ * 用 memcpy 读写，避免编译器按不同类型不会别名的假设重排读写顺序
+ */
+template <typename T>
+static void rescaleToFloat(const char* src, char* dst, size_t count, float slope, float intercept) {
+    for (size_t i = 0; i < count; i++) {
+        T value;
+        std::memcpy(&value, src + i * sizeof(T), sizeof(T));
+        float rescaled = value * slope + intercept;
+        std::memcpy(dst + i * sizeof(float), &rescaled, sizeof(float));
+    }
+}
+
+void DicomReader::read(const std::string& directory, bool fullVolume, glm::ivec3 regionMin, glm::ivec3 regionMax) {
+    std::vector<std::string> paths;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+        if (entry.is_regular_file()) paths.push_back(entry.path().string());
+    }
+    if (error || paths.empty()) {
+        std::cout << "Unable to open DICOM directory " << directory << std::endl;
+        return;
+    }
+
+    // 每个文件只读到像素数据之前，多个线程同时解析
+    std::vector<Slice> headers(paths.size());
+    std::vector<unsigned char> valid(paths.size());
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int)paths.size(); i++) {
+        valid[i] = parseHeader(paths[i], headers[i]);
+    }
+    // 文件夹中有多个序列时只读取层数最多的那个
+    std::map<std::string, int> seriesCount;
+    for (size_t i = 0; i < headers.size(); i++) {
+        if (valid[i]) seriesCount[headers[i].seriesUid]++;
+    }
+    if (seriesCount.empty()) {
+        std::cout << "No uncompressed DICOM image found in " << directory << std::endl;
+        return;
+    }
+    auto series = std::max_element(seriesCount.begin(), seriesCount.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+    std::vector<Slice> slices;
+    for (size_t i = 0; i < headers.size(); i++) {
+        if (valid[i] && headers[i].seriesUid == series->first) slices.push_back(std::move(headers[i]));
+    }
+
+    const Slice& first = slices.front();
+    for (const Slice& slice : slices) {
+        if (slice.rows != first.rows || slice.columns != first.columns || slice.bitsAllocated != first.bitsAllocated ||
+            slice.pixelRepresentation != first.pixelRepresentation || slice.samplesPerPixel != 1) {
+            std::cout << slice.path << ": slices of the series have different formats" << std::endl;
+            return;
+        }
+    }
+    if (first.bitsAllocated == 8) {
+        m_type = VoxelType::UInt8;
+    } else if (first.bitsAllocated == 16) {
+        m_type = first.pixelRepresentation ? VoxelType::Int16 : VoxelType::UInt16;
+    } else {
+        std::cout << "Unsupported bits allocated " << first.bitsAllocated << std::endl;
+        return;
+    }
+
+    // 沿层的法向量排序，没有位置信息时按 Instance Number
+    glm::dvec3 normal = glm::cross(first.rowDirection, first.columnDirection);
+    bool hasPosition = std::all_of(slices.begin(), slices.end(), [](const Slice& slice) { return slice.hasPosition; });
+    auto sliceLocation = [&](const Slice& slice) {
+        return hasPosition ? glm::dot(slice.position, normal) : (double)slice.instanceNumber;
+    };
+    std::sort(slices.begin(), slices.end(), [&](const Slice& a, const Slice& b) { return sliceLocation(a) < sliceLocation(b); });
+
+    m_dim = {(int)slices.size(), first.rows, first.columns};
+    float sliceSpacing = first.sliceThickness > 0 ? first.sliceThickness : 1.f;
+    if (hasPosition && slices.size() > 1) {
+        sliceSpacing = (float)((sliceLocation(slices.back()) - sliceLocation(slices.front())) / (slices.size() - 1));
+        for (size_t i = 1; i < slices.size(); i++) {
+            if (std::abs(sliceLocation(slices[i]) - sliceLocation(slices[i - 1]) - sliceSpacing) > 0.01 * sliceSpacing) {
+                std::cout << "Warning: DICOM slices are not evenly spaced, using the average spacing " << sliceSpacing << std::endl;
+                break;
+            }
+        }
+    }
+    m_spacing = {sliceSpacing, first.pixelSpacing[0], first.pixelSpacing[1]};
+
+    // 各层的 rescale 一样时保持原始类型，通过 rescaleSlope/rescaleIntercept 映射回原始值，否则转换成 float
+    bool uniformRescale = std::all_of(slices.begin(), slices.end(), [&](const Slice& slice) {
+        return slice.rescaleSlope == first.rescaleSlope && slice.rescaleIntercept == first.rescaleIntercept;
+    });
+    const VoxelType storedType = m_type;
+    const size_t storedBytes = voxelSize(storedType);
+    if (uniformRescale) {
+        m_rescaleSlope = first.rescaleSlope;
+        m_rescaleIntercept = first.rescaleIntercept;
+    } else {
+        m_type = VoxelType::Float32;
+    }
+    const size_t bytes = voxelSize(m_type);
+
+    if (fullVolume) {
+        regionMin = glm::ivec3(0);
+        regionMax = m_dim;
+    }
+    regionMin = glm::clamp(regionMin, glm::ivec3(0), m_dim);
+    regionMax = glm::clamp(regionMax, regionMin, m_dim);
+    glm::ivec3 size = regionMax - regionMin;
+    const size_t sliceVoxels = (size_t)size[1] * size[2];
+    m_data = MemoryBudget::instance().allocate(sliceVoxels * size[0] * bytes, MemoryCategory::SourceVolume);
+    if (!m_data) {
+        std::cout << "Unable to allocate memory for " << directory << std::endl;
+        return;
+    }
+
+    // 每一层直接读到最终的位置，需要转换成 float 时先读到这一层的末尾，再从前往后原地转换
+    bool failed = false;
+#pragma omp parallel for schedule(dynamic)
+    for (int z = 0; z < size[0]; z++) {
+        const Slice& slice = slices[regionMin[0] + z];
+        std::ifstream file(slice.path, std::ios::in | std::ios::binary);
+        char* sliceData = (char*)m_data + z * sliceVoxels * bytes;
+        char* dst = sliceData + sliceVoxels * (bytes - storedBytes);
+        // x 覆盖整行时这一层需要的数据是连续的，一次读完
+        bool fullRows = size[2] == first.columns;
+        for (int y = regionMin[1]; y < regionMax[1] && file; y += fullRows ? size[1] : 1) {
+            size_t count = fullRows ? sliceVoxels : size[2];
+            file.seekg(slice.pixelOffset + ((int64_t)y * first.columns + regionMin[2]) * storedBytes, std::ios::beg);
+            file.read(dst, count * storedBytes);
+            dst += count * storedBytes;
+        }
+        if (!file) {
+#pragma omp critical
+            {
+                std::cout << slice.path << ": pixel data is truncated" << std::endl;
+                failed = true;
+            }
+            continue;
+        }
+        if (!uniformRescale) {
+            const char* src = sliceData + sliceVoxels * (bytes - storedBytes);
+            dispatchVoxelType(storedType, [&](auto zero) {
+                rescaleToFloat<decltype(zero)>(src, sliceData, sliceVoxels, slice.rescaleSlope, slice.rescaleIntercept);
+            });
+        }
+    }
+    if (failed) {
+        MemoryBudget::instance().release(m_data);
+        m_data = nullptr;
+        return;
+    }
+
+    std::cout << "DICOM series " << m_dim.x << " x " << m_dim.y << " x " << m_dim.z << " (" << voxelTypeName(m_type) << "), spacing "
+              << m_spacing.x << ", " << m_spacing.y << ", " << m_spacing.z << " is read" << std::endl;
+}
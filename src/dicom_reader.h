@@ -0,0 +1,71 @@
+﻿#pragma once
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+#include "voxel_type.h"
+
+/**
+ * 读取一个文件夹中未压缩的 DICOM 序列（隐式或者显式 VR，小端），每个文件是一层
+ * 只解析需要的几个标签：大小、像素间距、rescale slope/intercept 和层的位置，按位置排序之后
+ * 多个线程同时把每一层的像素直接读到最终的体数据中，不经过中间的缓冲
+ */
+class DicomReader {
+   public:
+    explicit DicomReader(const std::string& directory);
+    /**
+     * 只读取 [regionMin, regionMax) 范围内的体素，顺序为 (z, y, x)，和 RawReader 一样
+     */
+    DicomReader(const std::string& directory, glm::ivec3 regionMin, glm::ivec3 regionMax);
+    ~DicomReader();
+
+    // 读取失败时为 nullptr
+    void* data() const;
+    inline VoxelType voxelType() const {
+        return m_type;
+    }
+    // 整个序列的大小和间距 (z, y, x)，data() 的大小为读取的范围
+    inline glm::ivec3 dim() const {
+        return m_dim;
+    }
+    inline glm::vec3 spacing() const {
+        return m_spacing;
+    }
+    /**
+     * 原始值 = 像素值 * rescaleSlope + rescaleIntercept，可以直接传给 VolumeData::setValueMapping
+     * 各层的 rescale 不一样时已经转换成了 float，这里为 1 和 0
+     */
+    inline float rescaleSlope() const {
+        return m_rescaleSlope;
+    }
+    inline float rescaleIntercept() const {
+        return m_rescaleIntercept;
+    }
+
+   private:
+    struct Slice {
+        std::string path;
+        std::string seriesUid;
+        int rows = 0, columns = 0;
+        int bitsAllocated = 0, pixelRepresentation = 0, samplesPerPixel = 1;
+        // (行间距, 列间距)
+        glm::vec2 pixelSpacing{1.f, 1.f};
+        float sliceThickness = 0;
+        glm::dvec3 position{0.};
+        bool hasPosition = false;
+        glm::dvec3 rowDirection{1., 0., 0.}, columnDirection{0., 1., 0.};
+        int instanceNumber = 0;
+        float rescaleSlope = 1, rescaleIntercept = 0;
+        // 像素数据在文件中的位置，-1 表示没有找到或者是压缩的
+        int64_t pixelOffset = -1;
+    };
+    static bool parseHeader(const std::string& path, Slice& slice);
+    void read(const std::string& directory, bool fullVolume, glm::ivec3 regionMin, glm::ivec3 regionMax);
+
+    void* m_data = nullptr;
+    VoxelType m_type = VoxelType::UInt16;
+    glm::ivec3 m_dim{0};
+    glm::vec3 m_spacing{1.f, 1.f, 1.f};
+    float m_rescaleSlope = 1, m_rescaleIntercept = 0;
+};
@@ -0,0 +1,192 @@
+﻿#include "illumination_volume.h"
+
+#include <algorithm>
+#include <cmath>
+
+// 光源方向变化小于约 1° 时不重新扫描阴影
+static constexpr float LIGHT_DIRECTION_TOLERANCE = 0.9998f;
+
+IlluminationVolume::IlluminationVolume(const VolumeData* volumeData, int downsample) : downsample(downsample) {
+    const glm::ivec3 src = volumeData->dim;
+    dim = (src + downsample - 1) / downsample;
+    size_t size = (size_t)dim[0] * dim[1] * dim[2];
+    cellIntensity.resize(size);
+    opacity.resize(size);
+    occlusion.resize(size);
+    transmittance.resize(size);
+    illumination.resize(size * 2);
+    dispatchVoxelType(volumeData->type, [&](auto zero) {
+        averageCells<decltype(zero)>(volumeData);
+    });
+}
+
+template <typename T>
+void IlluminationVolume::averageCells(const VolumeData* volumeData) {
+    const glm::ivec3 src = volumeData->dim;
+    // 每个格子取对应的 downsample^3 个体素的平均值，传输函数变化时只需要对格子重新分类
+#pragma omp parallel for
+    for (int i = 0; i < dim[0]; i++) {
+        for (int j = 0; j < dim[1]; j++) {
+            for (int k = 0; k < dim[2]; k++) {
+                double sum = 0;
+                unsigned int count = 0;
+                for (int z = i * downsample; z < std::min((i + 1) * downsample, src[0]); z++) {
+                    for (int y = j * downsample; y < std::min((j + 1) * downsample, src[1]); y++) {
+                        for (int x = k * downsample; x < std::min((k + 1) * downsample, src[2]); x++) {
+                            sum += volumeData->value<T>(z, y, x);
+                            count++;
+                        }
+                    }
+                }
+                cellIntensity[index(i, j, k)] = (float)(sum / count);
+            }
+        }
+    }
+}
+
+glm::vec3 IlluminationVolume::lightDirection(const Camera& camera, const Lighting& lighting) {
+    // shader 中光源位置变换到 model 空间之后直接和纹理坐标相减，这里同样以体数据中心 (0.5, 0.5, 0.5) 为起点
+    glm::vec3 position = glm::vec3(glm::inverse(camera.viewMatrix()) * glm::vec4(lighting.position, 0));
+    return glm::normalize(position - glm::vec3(0.5f));
+}
+
+bool IlluminationVolume::update(const TransferFunction& transferFunction, glm::vec3 lightDirection) {
+    bool transferFunctionChanged = !classified || transferFunction != lastTransferFunction;
+    bool lightChanged = transferFunctionChanged || glm::dot(lightDirection, lastLightDirection) < LIGHT_DIRECTION_TOLERANCE;
+    if (!lightChanged) return false;
+
+    if (transferFunctionChanged) {
+        classify(transferFunction);
+        computeAmbientOcclusion();
+        lastTransferFunction = transferFunction;
+        classified = true;
+    }
+    sweepShadows(lightDirection);
+    lastLightDirection = lightDirection;
+
+    size_t size = transmittance.size();
+#pragma omp parallel for
+    for (long long n = 0; n < (long long)size; n++) {
+        illumination[n * 2] = (unsigned char)(transmittance[n] * 255 + 0.5f);
+        illumination[n * 2 + 1] = (unsigned char)(occlusion[n] * 255 + 0.5f);
+    }
+    return true;
+}
+
+void IlluminationVolume::classify(const TransferFunction& transferFunction) {
+    size_t size = cellIntensity.size();
+#pragma omp parallel for
+    for (long long n = 0; n < (long long)size; n++) {
+        opacity[n] = transferFunction(cellIntensity[n]).a;
+    }
+}
+
+/**
+ * 沿某一个轴做半径为 radius 的盒式滤波，体数据外面当作完全透明
+ */
+static void boxFilter(std::vector<float>& values, glm::ivec3 dim, int axis, int radius) {
+    // 这个轴之后的所有轴的格子数，也就是沿这个轴走一格的跨度
+    size_t stride = axis == 0 ? (size_t)dim[1] * dim[2] : axis == 1 ? dim[2] : 1;
+    long long lines = (long long)(values.size() / dim[axis]);
+    int n = dim[axis];
+    float norm = 1.f / (2 * radius + 1);
+
+#pragma omp parallel
+    {
+        std::vector<float> line(n);
+#pragma omp for
+        for (long long l = 0; l < lines; l++) {
+            size_t base = (l / stride) * stride * n + l % stride;
+            for (int i = 0; i < n; i++) line[i] = values[base + i * stride];
+            // 滑动窗口求和
+            float sum = 0;
+            for (int i = 0; i < std::min(radius, n); i++) sum += line[i];
+            for (int i = 0; i < n; i++) {
+                if (i + radius < n) sum += line[i + radius];
+                if (i - radius - 1 >= 0) sum -= line[i - radius - 1];
+                values[base + i * stride] = sum * norm;
+            }
+        }
+    }
+}
+
+void IlluminationVolume::computeAmbientOcclusion() {
+    // 邻域内平均不透明度越高，能照到这里的环境光越少
+    occlusion = opacity;
+    for (int axis = 0; axis < 3; axis++) {
+        boxFilter(occlusion, dim, axis, occlusionRadius);
+    }
+    size_t size = occlusion.size();
+#pragma omp parallel for
+    for (long long n = 0; n < (long long)size; n++) {
+        occlusion[n] = 1.f - std::min(occlusion[n], 1.f);
+    }
+}
+
+void IlluminationVolume::sweepShadows(glm::vec3 lightDirection) {
+    // 纹理坐标下的方向换算到格子坐标 (z, y, x)
+    glm::vec3 l{lightDirection.z * dim[0], lightDirection.y * dim[1], lightDirection.x * dim[2]};
+    // 沿光源方向分量最大的轴逐层扫描，每一层只依赖离光源更近的上一层，层内所有格子可以并行
+    int a = 0;
+    for (int axis = 1; axis < 3; axis++) {
+        if (std::abs(l[axis]) > std::abs(l[a])) a = axis;
+    }
+    int b = (a + 1) % 3, c = (a + 2) % 3;
+    if (l[a] == 0) {
+        std::fill(transmittance.begin(), transmittance.end(), 1.f);
+        return;
+    }
+    // 从当前格子走到上一层时在另外两个轴上的偏移
+    glm::vec3 offset = l / std::abs(l[a]);
+    // 两层之间的光线长度（体素数）决定了这一段的不透明度
+    float exponent = glm::length(offset) * downsample * shadowDensity;
+    int first = l[a] > 0 ? dim[a] - 1 : 0;
+    int step = l[a] > 0 ? -1 : 1;
+
+    int nb = dim[b], nc = dim[c];
+    // 上一层每个格子穿过之后剩下的光，体数据外面没有遮挡
+    std::vector<float> prev(nb * nc, 1.f), curr(nb * nc);
+    for (int s = first; s >= 0 && s < dim[a]; s += step) {
+#pragma omp parallel for
+        for (int ib = 0; ib < nb; ib++) {
+            for (int ic = 0; ic < nc; ic++) {
+                // 在上一层双线性插值
+                float qb = ib + offset[b], qc = ic + offset[c];
+                int b0 = (int)std::floor(qb), c0 = (int)std::floor(qc);
+                float fb = qb - b0, fc = qc - c0;
+                auto fetch = [&](int x, int y) {
+                    return x < 0 || y < 0 || x >= nb || y >= nc ? 1.f : prev[x * nc + y];
+                };
+                float t = (fetch(b0, c0) * (1 - fc) + fetch(b0, c0 + 1) * fc) * (1 - fb) +
+                          (fetch(b0 + 1, c0) * (1 - fc) + fetch(b0 + 1, c0 + 1) * fc) * fb;
+
+                glm::ivec3 p;
+                p[a] = s;
+                p[b] = ib;
+                p[c] = ic;
+                size_t n = index(p[0], p[1], p[2]);
+                // 到达这个格子的光不包括格子本身的遮挡，表面不会被自己挡住
+                transmittance[n] = t;
+                curr[ib * nc + ic] = t * std::pow(1 - opacity[n], exponent);
+            }
+        }
+        std::swap(prev, curr);
+    }
+}
+
+glm::vec2 IlluminationVolume::sample(glm::vec3 texCoord) const {
+    // 和 GL_LINEAR 一样以格子中心为采样点，越界的部分 clamp 到边界
+    glm::vec3 pos{texCoord.z * dim[0] - 0.5f, texCoord.y * dim[1] - 0.5f, texCoord.x * dim[2] - 0.5f};
+    pos = glm::clamp(pos, glm::vec3(0.f), glm::vec3(dim - 1));
+    glm::ivec3 p0 = glm::ivec3(pos);
+    glm::ivec3 p1 = glm::min(p0 + 1, dim - 1);
+    glm::vec3 f = pos - glm::vec3(p0);
+    glm::vec2 result{0.f};
+    for (int corner = 0; corner < 8; corner++) {
+        glm::ivec3 p{corner & 4 ? p1.x : p0.x, corner & 2 ? p1.y : p0.y, corner & 1 ? p1.z : p0.z};
+        float w = (corner & 4 ? f.x : 1 - f.x) * (corner & 2 ? f.y : 1 - f.y) * (corner & 1 ? f.z : 1 - f.z);
+        size_t n = index(p.x, p.y, p.z);
+        result += w * glm::vec2(transmittance[n], occlusion[n]);
+    }
+    return result;
+}
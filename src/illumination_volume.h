@@ -0,0 +1,66 @@
+﻿#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "camera.h"
+#include "lighting.h"
+#include "transfer_function.h"
+#include "volume_data.h"
+
+/**
+ * 预计算的低分辨率光照体，每个格子保存两个值：
+ * - 光源方向上的透过率（阴影），通过沿光源方向逐层扫描得到
+ * - 局部环境光遮蔽 (ambient occlusion)，由邻域内的平均不透明度得到
+ * 渲染时每个采样点只需要额外采样一次，代价和不开阴影时基本一样
+ */
+class IlluminationVolume {
+   public:
+    IlluminationVolume(const VolumeData* volumeData, int downsample = 4);
+
+    /**
+     * 传输函数变化时重新计算不透明度、环境光遮蔽和阴影；只有光源方向变化时只重新扫描阴影
+     * 返回结果是否有变化（GPU 上需要重新上传纹理）
+     */
+    bool update(const TransferFunction& transferFunction, glm::vec3 lightDirection);
+    /**
+     * 纹理坐标下的光源方向（从体数据中心指向光源），和 shader 中 lightPosition 的计算方式一致
+     */
+    static glm::vec3 lightDirection(const Camera& camera, const Lighting& lighting);
+
+    /**
+     * 按纹理坐标三线性插值采样，返回 (透过率, 环境光遮蔽)，都在 [0, 1] 之间
+     */
+    glm::vec2 sample(glm::vec3 texCoord) const;
+    // RG8 交错存储，可以直接作为 GL_RG8 的 3D 纹理上传
+    inline const unsigned char* data() const {
+        return illumination.data();
+    }
+
+    // 格子的数量 (z, y, x)
+    glm::ivec3 dim;
+    // 每个体素的不透明度对透过率的影响程度，越大阴影越深
+    float shadowDensity = 0.5f;
+    // 环境光遮蔽的邻域半径（格子数）
+    int occlusionRadius = 2;
+
+   private:
+    void classify(const TransferFunction& transferFunction);
+    void computeAmbientOcclusion();
+    void sweepShadows(glm::vec3 lightDirection);
+    template <typename T>
+    void averageCells(const VolumeData* volumeData);
+
+    inline size_t index(int i, int j, int k) const {
+        return ((size_t)i * dim[1] + j) * dim[2] + k;
+    }
+
+    int downsample;
+    // 每个格子内体素的平均值，只在构造时计算一次
+    std::vector<float> cellIntensity;
+    std::vector<float> opacity, occlusion, transmittance;
+    std::vector<unsigned char> illumination;
+
+    bool classified = false;
+    TransferFunction lastTransferFunction;
+    glm::vec3 lastLightDirection{0.f};
+};
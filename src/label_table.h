@@ -0,0 +1,75 @@
+﻿#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+/**
+ * 分割标签（牙齿、神经管、种植体等）的颜色、不透明度和是否显示，和 LabelVolume 一起使用
+ * 标签 0 表示没有分割的体素，仍然使用传输函数，只有 visible 有作用；其他标签使用自己的颜色和不透明度，不经过传输函数
+ * 为空时不使用标签，和没有加载 LabelVolume 一样
+ */
+struct LabelTable {
+    // 每个砖块用一个 64 位的掩码记录出现过的标签
+    static constexpr int MAX_LABELS = 64;
+
+    struct Label {
+        glm::vec3 color{1.f};
+        // 和传输函数的不透明度一样，是按 RenderParams::baseStepLength 定义的
+        float opacity = 0.5f;
+        bool visible = true;
+
+        inline bool operator==(const Label& other) const {
+            return color == other.color && opacity == other.opacity && visible == other.visible;
+        }
+    };
+    std::vector<Label> labels;
+
+    /**
+     * labelCount 个标签（包括标签 0），颜色从固定的调色板中依次选取
+     */
+    static LabelTable withDefaultColors(int labelCount) {
+        static const glm::vec3 palette[8] = {
+            {0.95f, 0.90f, 0.75f}, {0.90f, 0.25f, 0.20f}, {0.20f, 0.70f, 0.30f}, {0.95f, 0.75f, 0.10f},
+            {0.60f, 0.35f, 0.85f}, {0.10f, 0.75f, 0.85f}, {0.95f, 0.45f, 0.70f}, {0.55f, 0.55f, 0.60f},
+        };
+        LabelTable table;
+        table.labels.resize(std::min(labelCount, MAX_LABELS));
+        for (size_t i = 1; i < table.labels.size(); i++) {
+            table.labels[i].color = palette[(i - 1) % 8];
+        }
+        return table;
+    }
+
+    inline bool empty() const {
+        return labels.empty();
+    }
+    // 没有分割的体素是否按传输函数显示
+    inline bool unlabeledVisible() const {
+        return labels.empty() || labels[0].visible;
+    }
+    /**
+     * 标签 label (>= 1) 的 RGBA，隐藏的或者超出表的范围的标签完全透明
+     */
+    inline glm::vec4 operator()(int label) const {
+        if (label <= 0 || label >= (int)labels.size() || !labels[label].visible) return glm::vec4(0.f);
+        return {labels[label].color, labels[label].opacity};
+    }
+    /**
+     * 显示出来并且不透明度大于 0 的标签 (>= 1) 的掩码，用来判断砖块是否为空
+     */
+    inline uint64_t visibleMask() const {
+        uint64_t mask = 0;
+        for (size_t i = 1; i < labels.size(); i++) {
+            if (labels[i].visible && labels[i].opacity > 0) mask |= uint64_t(1) << i;
+        }
+        return mask;
+    }
+
+    inline bool operator==(const LabelTable& other) const {
+        return labels == other.labels;
+    }
+    inline bool operator!=(const LabelTable& other) const {
+        return !(*this == other);
+    }
+};
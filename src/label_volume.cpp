@@ -0,0 +1,80 @@
+﻿#include "label_volume.h"
+
+#include <algorithm>
+#include <iostream>
+
+LabelVolume::LabelVolume(const unsigned char* labels, glm::ivec3 sourceDim, glm::ivec3 dim, int brickSize) : dim(dim), brickSize(brickSize) {
+    // 每个轴上目标体素对应的源体素，大小相同时就是恒等映射
+    std::vector<int> sourceIndex[3];
+    for (int axis = 0; axis < 3; axis++) {
+        sourceIndex[axis].resize(dim[axis]);
+        for (int i = 0; i < dim[axis]; i++) {
+            sourceIndex[axis][i] = std::min((int)((i + 0.5f) * sourceDim[axis] / dim[axis]), sourceDim[axis] - 1);
+        }
+    }
+    auto sourceLabel = [&](int i, int j, int k) {
+        unsigned char label = labels[((size_t)sourceIndex[0][i] * sourceDim[1] + sourceIndex[1][j]) * sourceDim[2] + sourceIndex[2][k]];
+        return label < LabelTable::MAX_LABELS ? label : 0;
+    };
+
+    int maxLabel = 0;
+    // MSVC 的 OpenMP 不支持 min/max reduction，每个线程先算自己的部分
+#pragma omp parallel
+    {
+        int threadMax = 0;
+#pragma omp for nowait
+        for (int i = 0; i < dim[0]; i++) {
+            for (int j = 0; j < dim[1]; j++) {
+                for (int k = 0; k < dim[2]; k++) {
+                    threadMax = std::max(threadMax, sourceLabel(i, j, k));
+                }
+            }
+        }
+#pragma omp critical
+        maxLabel = std::max(maxLabel, threadMax);
+    }
+    labelCount = maxLabel + 1;
+    // 位数取 2 的幂，一个体素不会跨两个字节
+    while ((1 << bits) < labelCount) bits *= 2;
+    rowBytes = ((size_t)dim[2] * bits + 7) / 8;
+    data.assign(rowBytes * dim[1] * dim[0], 0);
+#pragma omp parallel for
+    for (int i = 0; i < dim[0]; i++) {
+        for (int j = 0; j < dim[1]; j++) {
+            unsigned char* row = data.data() + ((size_t)i * dim[1] + j) * rowBytes;
+            for (int k = 0; k < dim[2]; k++) {
+                size_t bit = (size_t)k * bits;
+                row[bit / 8] |= (unsigned char)(sourceLabel(i, j, k) << (bit % 8));
+            }
+        }
+    }
+
+    brickDim = (dim + brickSize - 1) / brickSize;
+    brickLabels.assign((size_t)brickDim[0] * brickDim[1] * brickDim[2], 0);
+#pragma omp parallel for
+    for (int bi = 0; bi < brickDim[0]; bi++) {
+        for (int bj = 0; bj < brickDim[1]; bj++) {
+            for (int bk = 0; bk < brickDim[2]; bk++) {
+                uint64_t mask = 0;
+                for (int i = bi * brickSize; i <= std::min((bi + 1) * brickSize, dim[0] - 1); i++) {
+                    for (int j = bj * brickSize; j <= std::min((bj + 1) * brickSize, dim[1] - 1); j++) {
+                        for (int k = bk * brickSize; k <= std::min((bk + 1) * brickSize, dim[2] - 1); k++) {
+                            mask |= uint64_t(1) << label(i, j, k);
+                        }
+                    }
+                }
+                brickLabels[((size_t)bi * brickDim[1] + bj) * brickDim[2] + bk] = mask;
+            }
+        }
+    }
+    std::cout << "Label volume " << dim[2] << " x " << dim[1] << " x " << dim[0] << ": " << labelCount << " labels, " << bits << " bits per voxel, "
+              << data.size() / (1024.0 * 1024.0) << " MB" << std::endl;
+}
+
+void LabelVolume::applyTo(std::vector<unsigned char>& occupancy, const LabelTable& table) const {
+    const uint64_t visible = table.visibleMask();
+    const bool unlabeled = table.unlabeledVisible();
+    for (size_t n = 0; n < occupancy.size(); n++) {
+        occupancy[n] = (occupancy[n] && unlabeled && (brickLabels[n] & 1)) || (brickLabels[n] & visible);
+    }
+}
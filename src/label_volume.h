@@ -0,0 +1,53 @@
+﻿#pragma once
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "brick_grid.h"
+#include "label_table.h"
+#include "memory_budget.h"
+
+/**
+ * 和体数据对齐的分割标签体，每个体素只占 bits (1, 2, 4 或 8) 位，按行打包，每一行从新的字节开始
+ * 标签只能取最近邻，CPU 上直接按位读取，GPU 上把打包的字节作为整数纹理上传，在 shader 中按位拆开
+ * 另外记录每个砖块中出现过的标签，隐藏某个标签之后只含有它的砖块直接当作空砖块跳过
+ */
+class LabelVolume {
+   public:
+    /**
+     * labels 为每个体素一个字节的标签，大小为 sourceDim (z, y, x)
+     * dim 和 sourceDim 不同时（例如重采样之后）按体素中心取最近邻；>= MAX_LABELS 的标签当作 0
+     * brickSize 需要和体数据的 BrickGrid 一致
+     */
+    LabelVolume(const unsigned char* labels, glm::ivec3 sourceDim, glm::ivec3 dim, int brickSize = BrickGrid::BRICK_SIZE);
+
+    inline int label(int i, int j, int k) const {
+        size_t bit = (size_t)k * bits;
+        unsigned char byte = data[((size_t)i * dim[1] + j) * rowBytes + bit / 8];
+        return (byte >> (bit % 8)) & ((1 << bits) - 1);
+    }
+    /**
+     * 体素坐标 (i, j, k) 处最近的体素的标签，越界的部分 clamp 到边界
+     */
+    inline int labelAt(glm::vec3 pos) const {
+        glm::ivec3 p = glm::clamp(glm::ivec3(glm::floor(pos + 0.5f)), glm::ivec3(0), dim - 1);
+        return label(p.x, p.y, p.z);
+    }
+    /**
+     * 在传输函数得到的砖块占用情况上加入标签：砖块中有显示的标签时不为空，
+     * 没有分割的体素只在 table 显示标签 0 时才按传输函数的结果算；需要在 BrickGrid::restrictTo 之前调用
+     */
+    void applyTo(std::vector<unsigned char>& occupancy, const LabelTable& table) const;
+
+    // 出现过的最大标签 + 1
+    int labelCount = 1;
+    int bits = 1;
+    glm::ivec3 dim;
+    // 每一行 (dim[2] 个体素) 打包之后的字节数
+    size_t rowBytes;
+    HostBuffer data{MemoryCategory::Labels};
+    int brickSize;
+    glm::ivec3 brickDim;
+    // 每个砖块（和 BrickGrid 一样多包含下一个砖块的第一层体素）中出现过的标签
+    std::vector<uint64_t> brickLabels;
+};
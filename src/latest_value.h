@@ -0,0 +1,38 @@
+﻿#pragma once
+#include <atomic>
+
+/**
+ * 单生产者、单消费者的“最新值”槽：生产者随时写入，消费者只取到最新的一个，中间被覆盖的值直接丢弃
+ * 三缓冲实现，publish 和 consume 都不加锁、不等待，生产者（界面线程）永远不会被消费者（渲染线程）阻塞
+ */
+template <typename T>
+class LatestValue {
+   public:
+    /**
+     * 生产者线程调用，返回是否覆盖了一个还没有被取走的值
+     */
+    bool publish(const T& value) {
+        slots[back] = value;
+        // 写好的缓冲和中间的缓冲交换，同时标记中间有新值
+        int old = middle.exchange(back | FRESH, std::memory_order_acq_rel);
+        back = old & INDEX;
+        return old & FRESH;
+    }
+    /**
+     * 消费者线程调用，有新值时取出最新的一个并返回 true
+     */
+    bool consume(T& value) {
+        if (!(middle.load(std::memory_order_acquire) & FRESH)) return false;
+        int old = middle.exchange(front, std::memory_order_acq_rel);
+        front = old & INDEX;
+        value = slots[front];
+        return true;
+    }
+
+   private:
+    static constexpr int INDEX = 3, FRESH = 4;
+    T slots[3];
+    // back 只被生产者使用，front 只被消费者使用，middle 是两者交换的缓冲
+    int back = 0, front = 1;
+    std::atomic<int> middle{2};
+};
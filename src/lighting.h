@@ -0,0 +1,24 @@
+﻿#pragma once
+#include <glm/glm.hpp>
+
+/**
+ * Phong 光照参数，对应 alpha_blending.fs 中的 Light 和 Material
+ * 传输函数的颜色作为材质的 ambient 和 diffuse 属性
+ */
+struct Lighting {
+    glm::vec3 position{1.2f, 1.0f, 2.0f};
+    glm::vec4 ambient{0.2f, 0.2f, 0.2f, 1.f};
+    glm::vec4 diffuse{0.5f, 0.5f, 0.5f, 1.f};
+    glm::vec4 specular{1.0f, 1.0f, 1.0f, 1.f};
+    // material properties
+    glm::vec4 materialSpecular{1.f, 1.f, 1.f, 0.f};
+    float shininess = 32.0f;
+
+    inline bool operator==(const Lighting& other) const {
+        return position == other.position && ambient == other.ambient && diffuse == other.diffuse && specular == other.specular &&
+               materialSpecular == other.materialSpecular && shininess == other.shininess;
+    }
+    inline bool operator!=(const Lighting& other) const {
+        return !(*this == other);
+    }
+};
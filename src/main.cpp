@@ -1,13 +1,82 @@
 #include <QApplication>
+#include <QCommandLineParser>
 #include <array>
+#include <cstring>
 #include <glm/glm.hpp>
 #include <iostream>
 
 #include "main_window.h"
+#include "memory_budget.h"
 #include "raw_reader.h"
+#include "render_client.h"
+#include "render_server.h"
 #include "volume_rendering.h"
 
+/**
+ * 不需要窗口的渲染服务器 (--server) 和测试客户端 (--client) 模式
+ */
+static int runRenderService(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setOrganizationName("upupming");
+    app.setApplicationName("Volume Rendering (levoy1988)");
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption serverOption("server", "Run as render server listening on <address> (TCP port number or local socket name).", "address");
+    QCommandLineOption clientOption("client", "Run the test client against the render server at <address>.", "address");
+    QCommandLineOption dataOption("data", "Raw volume file for the test client to load.", "path", "../../data/cbct_sample_z=507_y=512_x=512.raw");
+    QCommandLineOption dimOption("dim", "Volume dimensions as Z,Y,X.", "dim", "507,512,512");
+    QCommandLineOption spacingOption("spacing", "Voxel spacing as Z,Y,X.", "spacing", "0.3,0.3,0.3");
+    QCommandLineOption voxelTypeOption("voxel-type", "Voxel type of the raw volume: uint8, uint16, int16 or float.", "type", "uint16");
+    QCommandLineOption framesOption("frames", "Number of camera updates the test client sends.", "n", "120");
+    QCommandLineOption rateOption("rate", "Camera updates per second the test client sends.", "n", "30");
+    QCommandLineOption sizeOption("size", "Frame width and height.", "n", "512");
+    QCommandLineOption qualityOption("quality", "JPEG quality, PNG is used when out of [0, 100].", "n", "80");
+    QCommandLineOption shadowsOption("shadows", "Render with the precomputed shadow and ambient occlusion volume.");
+    QCommandLineOption shearWarpOption("shear-warp", "Render alpha blending frames with the shear-warp algorithm instead of ray casting.");
+    QCommandLineOption memoryBudgetOption("memory-budget", "Host memory budget of the render server in MB, idle volumes are evicted when it is exceeded (0 for unlimited).", "mb", "0");
+    parser.addOptions({serverOption, clientOption, dataOption, dimOption, spacingOption, voxelTypeOption, framesOption, rateOption, sizeOption, qualityOption, shadowsOption, shearWarpOption, memoryBudgetOption});
+    parser.process(app);
+
+    if (parser.isSet(serverOption)) {
+        MemoryBudget::instance().setHostBudget((size_t)parser.value(memoryBudgetOption).toULongLong() << 20);
+        RenderServer server;
+        if (!server.listen(parser.value(serverOption))) return 1;
+        return app.exec();
+    }
+
+    auto dimList = parser.value(dimOption).split(',');
+    auto spacingList = parser.value(spacingOption).split(',');
+    if (dimList.size() != 3 || spacingList.size() != 3) {
+        std::cout << "--dim and --spacing need 3 comma separated values" << std::endl;
+        return 1;
+    }
+    glm::ivec3 dim{dimList[0].toInt(), dimList[1].toInt(), dimList[2].toInt()};
+    glm::vec3 spacing{spacingList[0].toFloat(), spacingList[1].toFloat(), spacingList[2].toFloat()};
+    VoxelType voxelType;
+    if (!parseVoxelType(parser.value(voxelTypeOption).toStdString(), voxelType)) {
+        std::cout << "--voxel-type must be one of uint8, uint16, int16, float" << std::endl;
+        return 1;
+    }
+
+    RenderClient client(parser.value(dataOption), dim, spacing);
+    client.params.width = client.params.height = parser.value(sizeOption).toInt();
+    client.quality = parser.value(qualityOption).toInt();
+    client.params.shadows = parser.isSet(shadowsOption);
+    client.params.shearWarp = parser.isSet(shearWarpOption);
+    client.voxelType = voxelType;
+    QObject::connect(&client, &RenderClient::finished, &app, &QCoreApplication::quit, Qt::QueuedConnection);
+    client.start(parser.value(clientOption), parser.value(framesOption).toInt(), parser.value(rateOption).toInt());
+    return app.exec();
+}
+
 int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--server", 8) == 0 || strncmp(argv[i], "--client", 8) == 0) {
+            return runRenderService(argc, argv);
+        }
+    }
+
     QApplication app(argc, argv);
 
     QCoreApplication::setOrganizationName("upupming");
@@ -6,11 +6,17 @@ MainWindow::MainWindow() {
     QWidget *mWidget = new QWidget;
 
     QVBoxLayout *vBoxLayout = new QVBoxLayout;
+    QHBoxLayout *hBoxLayout0 = new QHBoxLayout;
     QHBoxLayout *hBoxLayout1 = new QHBoxLayout;
     QHBoxLayout *hBoxLayout2 = new QHBoxLayout;
 
     rayCasting = new RayCasting;
-    vBoxLayout->addWidget(rayCasting, 10);
+    sliceView = new SliceView;
+    hBoxLayout0->addWidget(rayCasting, 2);
+    hBoxLayout0->addWidget(sliceView, 1);
+    vBoxLayout->addLayout(hBoxLayout0, 10);
+    connect(rayCasting, &RayCasting::cameraChanged, sliceView, &SliceView::setCamera);
+    connect(rayCasting, &RayCasting::volumeReleased, this, &MainWindow::releaseVolume);
 
     opacityThresholdSlider = createThresholdSlider(
         [=](int value) {
@@ -22,13 +28,171 @@ MainWindow::MainWindow() {
             rayCasting->setColorThreshold(value);
         },
         rayCasting->getColorThreshold());
+    isoValueSlider = createThresholdSlider(
+        [=](int value) {
+            rayCasting->setIsoValue(value);
+        },
+        rayCasting->getIsoValue());
+    // 光源绕 y 轴旋转，保持和默认光源位置相同的高度和距离
+    lightAzimuthSlider = createThresholdSlider(
+        [=](int value) {
+            Lighting lighting = rayCasting->getLighting();
+            float radius = glm::length(glm::vec2(lighting.position.x, lighting.position.z));
+            lighting.position.x = radius * qSin(qDegreesToRadians((float)value));
+            lighting.position.z = radius * qCos(qDegreesToRadians((float)value));
+            rayCasting->setLighting(lighting);
+        },
+        qRadiansToDegrees(qAtan2(rayCasting->getLighting().position.x, rayCasting->getLighting().position.z)), 360);
+    renderModeBox = new QComboBox;
+    renderModeBox->addItems({"Alpha blending", "Isosurface"});
+    connect(renderModeBox, QOverload<int>::of(&QComboBox::currentIndexChanged), this, [=](int index) {
+        rayCasting->setRenderMode((RenderMode)index);
+    });
+    shadowsCheckBox = new QCheckBox("Shadows && AO");
+    connect(shadowsCheckBox, &QCheckBox::toggled, this, [=](bool checked) {
+        rayCasting->setShadows(checked);
+    });
+    adaptiveQualityCheckBox = new QCheckBox("Adaptive quality");
+    adaptiveQualityCheckBox->setChecked(rayCasting->getAdaptiveQuality());
+    connect(adaptiveQualityCheckBox, &QCheckBox::toggled, this, [=](bool checked) {
+        rayCasting->setAdaptiveQuality(checked);
+    });
+    accumulationCheckBox = new QCheckBox("Temporal accumulation");
+    connect(accumulationCheckBox, &QCheckBox::toggled, this, [=](bool checked) {
+        rayCasting->setTemporalAccumulation(checked);
+    });
+    renderThreadCheckBox = new QCheckBox("CPU render thread");
+    connect(renderThreadCheckBox, &QCheckBox::toggled, this, [=](bool checked) {
+        rayCasting->setThreadedRendering(checked);
+    });
+    shearWarpCheckBox = new QCheckBox("Shear-warp preview");
+    connect(shearWarpCheckBox, &QCheckBox::toggled, this, [=](bool checked) {
+        rayCasting->setShearWarp(checked);
+    });
+
+    // 量化之后的数据只有原来的一半（8 位）大小，阈值仍然使用原始数据的单位
+    quantizationBox = new QComboBox;
+    quantizationBox->addItem("Full precision", 0);
+    quantizationBox->addItem("Quantize 12-bit", 12);
+    quantizationBox->addItem("Quantize 8-bit", 8);
+    connect(quantizationBox, QOverload<int>::of(&QComboBox::currentIndexChanged), this, &MainWindow::updatePreprocessing);
+    // 各向异性的数据重采样成各向同性的，或者把太大的数据缩小到体素预算之内
+    resampleBox = new QComboBox;
+    resampleBox->addItem("Original grid", 0);
+    resampleBox->addItem("Isotropic", 1);
+    resampleBox->addItem("Isotropic, 256^3 budget", 2);
+    connect(resampleBox, QOverload<int>::of(&QComboBox::currentIndexChanged), this, &MainWindow::updatePreprocessing);
+    resampleFilterBox = new QComboBox;
+    resampleFilterBox->addItem("Lanczos", (int)ResampleFilter::Lanczos3);
+    resampleFilterBox->addItem("Tent", (int)ResampleFilter::Tent);
+    resampleFilterBox->addItem("Box", (int)ResampleFilter::Box);
+    connect(resampleFilterBox, QOverload<int>::of(&QComboBox::currentIndexChanged), this, &MainWindow::updatePreprocessing);
+    // 噪声大的 CBCT 数据先降噪，再做重采样、量化和梯度
+    denoiseBox = new QComboBox;
+    denoiseBox->addItem("No denoising", 0);
+    denoiseBox->addItem("Gaussian denoising", 1);
+    denoiseBox->addItem("Bilateral denoising", 2);
+    connect(denoiseBox, QOverload<int>::of(&QComboBox::currentIndexChanged), this, &MainWindow::updatePreprocessing);
+
+    const char *cropLabels[6] = {"x min ", "x max ", "y min ", "y max ", "z min ", "z max "};
+    for (int i = 0; i < 6; i++) {
+        cropSpinBoxes[i] = new QDoubleSpinBox;
+        cropSpinBoxes[i]->setRange(0, 1);
+        cropSpinBoxes[i]->setSingleStep(0.05);
+        cropSpinBoxes[i]->setValue(i % 2);
+        cropSpinBoxes[i]->setPrefix(cropLabels[i]);
+        connect(cropSpinBoxes[i], QOverload<double>::of(&QDoubleSpinBox::valueChanged), this, &MainWindow::updateClipping);
+    }
+    clipPlaneCheckBox = new QCheckBox("View clip plane");
+    connect(clipPlaneCheckBox, &QCheckBox::toggled, this, &MainWindow::updateClipping);
+    clipPlaneSlider = new QSlider(Qt::Orientation::Horizontal);
+    clipPlaneSlider->setRange(-100, 100);
+    clipPlaneSlider->setValue(0);
+    connect(clipPlaneSlider, &QSlider::valueChanged, this, &MainWindow::updateClipping);
+    // 重新从文件中只读取 ROI 覆盖的砖块，读完之后 ROI 就是整个体数据
+    QPushButton *loadRoiButton = new QPushButton("Load ROI only");
+    connect(loadRoiButton, &QPushButton::clicked, this, [=]() {
+        if (readDataProcess.isRunning()) return;
+        glm::ivec3 voxelMin, voxelMax;
+        rayCasting->getClipping().voxelRegion(regionMax - regionMin, BrickGrid::BRICK_SIZE, voxelMin, voxelMax);
+        readDataProcess = QtConcurrent::run(this, &MainWindow::readData, regionMin + voxelMin, regionMin + voxelMax);
+    });
+    QPushButton *openDicomButton = new QPushButton("Open DICOM...");
+    connect(openDicomButton, &QPushButton::clicked, this, [=]() {
+        if (readDataProcess.isRunning()) return;
+        QString directory = QFileDialog::getExistingDirectory(this, "Open DICOM series", dicomDirectory);
+        if (directory.isEmpty()) return;
+        dicomDirectory = directory;
+        readDataProcess = QtConcurrent::run(this, &MainWindow::readData, glm::ivec3(0), glm::ivec3(0));
+    });
+    // 分割标签为每个体素一个字节的 raw 文件，大小和体数据的文件（或者整个 DICOM 序列）相同
+    QPushButton *openLabelsButton = new QPushButton("Open labels...");
+    connect(openLabelsButton, &QPushButton::clicked, this, [=]() {
+        if (readDataProcess.isRunning()) return;
+        QString file = QFileDialog::getOpenFileName(this, "Open label volume", labelFile, "Raw labels (*.raw)");
+        if (file.isEmpty()) return;
+        labelFile = file;
+        readDataProcess = QtConcurrent::run(this, &MainWindow::readData, regionMin, regionMax);
+    });
+    labelBox = new QComboBox;
+    connect(labelBox, QOverload<int>::of(&QComboBox::currentIndexChanged), this, [=](int index) {
+        const LabelTable &table = rayCasting->getLabelTable();
+        if (index < 0 || index >= (int)table.labels.size()) return;
+        QSignalBlocker visibleBlocker(labelVisibleCheckBox), opacityBlocker(labelOpacitySlider);
+        labelVisibleCheckBox->setChecked(table.labels[index].visible);
+        labelOpacitySlider->setValue(qRound(table.labels[index].opacity * 100));
+    });
+    labelVisibleCheckBox = new QCheckBox("Visible");
+    connect(labelVisibleCheckBox, &QCheckBox::toggled, this, &MainWindow::updateLabelTable);
+    labelOpacitySlider = new QSlider(Qt::Orientation::Horizontal);
+    labelOpacitySlider->setRange(0, 100);
+    connect(labelOpacitySlider, &QSlider::valueChanged, this, &MainWindow::updateLabelTable);
+    QPushButton *loadFullButton = new QPushButton("Load full volume");
+    connect(loadFullButton, &QPushButton::clicked, this, [=]() {
+        if (readDataProcess.isRunning()) return;
+        readDataProcess = QtConcurrent::run(this, &MainWindow::readData, glm::ivec3(0), dim);
+    });
+
+    QHBoxLayout *hBoxLayout3 = new QHBoxLayout;
+    QHBoxLayout *hBoxLayout4 = new QHBoxLayout;
+    QHBoxLayout *hBoxLayout5 = new QHBoxLayout;
     hBoxLayout1->addWidget(new QLabel("Opacity threshold (transfer function)"));
     hBoxLayout1->addWidget(opacityThresholdSlider);
     hBoxLayout2->addWidget(new QLabel("Color threshold   (transfer function)"));
     hBoxLayout2->addWidget(colorThresholdSlider);
+    hBoxLayout3->addWidget(renderModeBox);
+    hBoxLayout3->addWidget(new QLabel("Iso value"));
+    hBoxLayout3->addWidget(isoValueSlider);
+    hBoxLayout4->addWidget(new QLabel("Light azimuth"));
+    hBoxLayout4->addWidget(lightAzimuthSlider);
+    hBoxLayout4->addWidget(shadowsCheckBox);
+    hBoxLayout4->addWidget(adaptiveQualityCheckBox);
+    hBoxLayout4->addWidget(accumulationCheckBox);
+    hBoxLayout4->addWidget(renderThreadCheckBox);
+    hBoxLayout4->addWidget(shearWarpCheckBox);
+    hBoxLayout4->addWidget(denoiseBox);
+    hBoxLayout4->addWidget(resampleBox);
+    hBoxLayout4->addWidget(resampleFilterBox);
+    hBoxLayout4->addWidget(quantizationBox);
+    hBoxLayout5->addWidget(openDicomButton);
+    hBoxLayout5->addWidget(openLabelsButton);
+    hBoxLayout5->addWidget(labelBox);
+    hBoxLayout5->addWidget(labelVisibleCheckBox);
+    hBoxLayout5->addWidget(labelOpacitySlider);
+    hBoxLayout5->addWidget(new QLabel("ROI"));
+    for (auto spinBox : cropSpinBoxes) {
+        hBoxLayout5->addWidget(spinBox);
+    }
+    hBoxLayout5->addWidget(loadRoiButton);
+    hBoxLayout5->addWidget(loadFullButton);
+    hBoxLayout5->addWidget(clipPlaneCheckBox);
+    hBoxLayout5->addWidget(clipPlaneSlider);
 
     vBoxLayout->addLayout(hBoxLayout1, 1);
     vBoxLayout->addLayout(hBoxLayout2, 1);
+    vBoxLayout->addLayout(hBoxLayout3, 1);
+    vBoxLayout->addLayout(hBoxLayout4, 1);
+    vBoxLayout->addLayout(hBoxLayout5, 1);
 
     mWidget->setLayout(vBoxLayout);
     setCentralWidget(mWidget);
@@ -37,7 +201,7 @@ MainWindow::MainWindow() {
             this, &MainWindow::updateRayCasting);
 
     // 在后面一点执行，避免出现多线程执行完了，但是还没有初始化完 slots 的情况
-    readDataProcess = QtConcurrent::run(this, &MainWindow::readData);
+    readDataProcess = QtConcurrent::run(this, &MainWindow::readData, regionMin, regionMax);
 }
 
 QSlider *MainWindow::createThresholdSlider(std::function<void(int)> callback, int initVal, int maxThreshold) {
@@ -55,12 +219,33 @@ QSlider *MainWindow::createThresholdSlider(std::function<void(int)> callback, in
 }
 
 MainWindow::~MainWindow() {
-    delete rawReader;
+    // 后台还在读取的数据等它读完，没有交给 rayCasting 的部分也在这里释放
+    readDataProcess.waitForFinished();
+    // 先删除还在使用体数据的渲染器，再释放 VolumeData 和它指向的数据
     delete rayCasting;
+    delete volumeData;
+    delete rawReader;
+    delete dicomReader;
+    delete resampledVolume;
+    delete quantizedVolume;
+    delete volumeCache;
+    delete labelVolume;
+    delete loadedVolumeData;
+    delete loadedRawReader;
+    delete loadedDicomReader;
+    delete loadedResampledVolume;
+    delete loadedQuantizedVolume;
+    delete loadedVolumeCache;
+    delete loadedLabelVolume;
+    while (!retiredVolumes.empty()) releaseVolume(retiredVolumes.back().volumeData);
+    MemoryBudget::instance().printUsage();
 }
 
 void MainWindow::readSettings() {
     QSettings settings(QCoreApplication::organizationName(), QCoreApplication::applicationName());
+    // 内存和显存的预算 (MB)，0 表示没有限制；超过显存预算时上传缩小的体数据
+    MemoryBudget::instance().setHostBudget(settings.value("hostMemoryBudgetMB", 0).toULongLong() << 20);
+    MemoryBudget::instance().setGpuBudget(settings.value("gpuMemoryBudgetMB", 0).toULongLong() << 20);
     const QByteArray geometry = settings.value("geometry", QByteArray()).toByteArray();
     if (geometry.isEmpty()) {
         const QRect availableGeometry = screen()->availableGeometry();
@@ -76,17 +261,232 @@ void MainWindow::writeSettings() {
     settings.setValue("geometry", saveGeometry());
 }
 
-void MainWindow::readData() {
-    rawReader = new RawReader("../../data/cbct_sample_z=507_y=512_x=512.raw", Z, Y, X);
-    volumeData = new VolumeData(rawReader->data(), dim, spacing, true);
+void MainWindow::readData(glm::ivec3 voxelMin, glm::ivec3 voxelMax) {
+    const std::string source = dicomDirectory.isEmpty() ? RAW_FILE : dicomDirectory.toStdString();
+    // 只缓存整个体数据，ROI 每次都重新读取，不会覆盖整个体数据的缓存
+    // voxelMax 为 0 表示整个体数据（刚打开 DICOM 序列时还不知道大小）；读过 DICOM 序列之后 dim 就是整个序列的大小
+    const bool fullVolume = voxelMax == glm::ivec3(0) || (voxelMin == glm::ivec3(0) && voxelMax == dim);
+    VolumeCache::Settings cacheSettings;
+    if (dicomDirectory.isEmpty()) {
+        cacheSettings.voxelType = (int32_t)voxelType;
+        cacheSettings.dim = dim;
+        cacheSettings.spacing = spacing;
+    }
+    cacheSettings.denoiseMode = denoiseMode;
+    cacheSettings.resampleMode = resampleMode;
+    cacheSettings.resampleFilter = (int32_t)resampleFilter;
+    cacheSettings.quantizationBits = quantizationBits;
+    if (fullVolume && (loadedVolumeCache = VolumeCache::open(source, cacheSettings))) {
+        // 预处理的结果和砖块都在缓存里，映射之后就可以直接渲染
+        dim = loadedVolumeCache->sourceDim();
+        spacing = loadedVolumeCache->sourceSpacing();
+        voxelType = loadedVolumeCache->sourceType();
+        loadedVolumeData = loadedVolumeCache->createVolumeData();
+        regionMin = glm::ivec3(0);
+        regionMax = dim;
+        readLabels(regionMin, regionMax);
+        emit readVolumeDataFinished();
+        return;
+    }
+
+    void *voxels;
+    if (!dicomDirectory.isEmpty()) {
+        if (fullVolume) {
+            loadedDicomReader = new DicomReader(dicomDirectory.toStdString());
+            voxelMin = glm::ivec3(0);
+            voxelMax = loadedDicomReader->dim();
+        } else {
+            loadedDicomReader = new DicomReader(dicomDirectory.toStdString(), voxelMin, voxelMax);
+        }
+        if (!loadedDicomReader->data()) {
+            delete loadedDicomReader;
+            loadedDicomReader = nullptr;
+            return;
+        }
+        // 大小、间距和体素类型都来自序列本身
+        dim = loadedDicomReader->dim();
+        spacing = loadedDicomReader->spacing();
+        voxelType = loadedDicomReader->voxelType();
+        voxels = loadedDicomReader->data();
+    } else if (fullVolume) {
+        loadedRawReader = new RawReader(source, Z, Y, X, voxelType);
+        voxelMin = glm::ivec3(0);
+        voxelMax = dim;
+        voxels = loadedRawReader->data();
+    } else {
+        loadedRawReader = new RawReader(source, Z, Y, X, voxelMin, voxelMax, voxelType);
+        voxels = loadedRawReader->data();
+    }
+    if (!voxels) {
+        // 文件不存在或者大小不符，保留之前的数据
+        delete loadedRawReader;
+        loadedRawReader = nullptr;
+        return;
+    }
+    if (denoiseMode) {
+        // 直接在读入的数据上滤波，只多用几层的内存
+        DenoiseFilter filter = denoiseMode == 2 ? DenoiseFilter::Bilateral : DenoiseFilter::Gaussian;
+        VolumeFilter(filter).apply(voxels, voxelType, voxelMax - voxelMin, spacing);
+    }
+    loadedVolumeData = new VolumeData(voxels, voxelType, voxelMax - voxelMin, spacing, true);
+    if (loadedDicomReader) {
+        // 保持原始单位，例如 CT 的 Hounsfield 值
+        loadedVolumeData->setValueMapping(loadedDicomReader->rescaleSlope(), loadedDicomReader->rescaleIntercept());
+    }
+    if (resampleMode) {
+        // 重采样之后原始数据就不需要了，内存中只保留重采样后的一份
+        glm::vec3 targetSpacing = ResampledVolume::isotropicSpacing(loadedVolumeData, resampleMode == 2 ? RESAMPLE_VOXEL_BUDGET : 0);
+        loadedResampledVolume = new ResampledVolume(loadedVolumeData, targetSpacing, resampleFilter);
+        delete loadedVolumeData;
+        delete loadedRawReader;
+        delete loadedDicomReader;
+        loadedRawReader = nullptr;
+        loadedDicomReader = nullptr;
+        loadedVolumeData = loadedResampledVolume->createVolumeData();
+    }
+    if (quantizationBits) {
+        // 量化之后原始数据就不需要了，内存中只保留量化后的一份
+        loadedQuantizedVolume = new QuantizedVolume(loadedVolumeData, quantizationBits);
+        loadedQuantizedVolume->printReport();
+        delete loadedVolumeData;
+        delete loadedRawReader;
+        delete loadedDicomReader;
+        delete loadedResampledVolume;
+        loadedRawReader = nullptr;
+        loadedDicomReader = nullptr;
+        loadedResampledVolume = nullptr;
+        loadedVolumeData = loadedQuantizedVolume->createVolumeData();
+    }
+    if (fullVolume) {
+        // 写入缓存之后改为映射缓存文件，计算出来的数据就可以释放了，砖块也不需要再计算一次
+        BrickGrid brickGrid(loadedVolumeData);
+        if (VolumeCache::write(source, cacheSettings, voxelType, dim, spacing, loadedVolumeData, brickGrid) &&
+            (loadedVolumeCache = VolumeCache::open(source, cacheSettings))) {
+            delete loadedVolumeData;
+            delete loadedRawReader;
+            delete loadedDicomReader;
+            delete loadedResampledVolume;
+            delete loadedQuantizedVolume;
+            loadedRawReader = nullptr;
+            loadedDicomReader = nullptr;
+            loadedResampledVolume = nullptr;
+            loadedQuantizedVolume = nullptr;
+            loadedVolumeData = loadedVolumeCache->createVolumeData();
+        }
+    }
+    regionMin = voxelMin;
+    regionMax = voxelMax;
+    readLabels(voxelMin, voxelMax);
     emit readVolumeDataFinished();
 }
 
+void MainWindow::readLabels(glm::ivec3 voxelMin, glm::ivec3 voxelMax) {
+    if (labelFile.isEmpty()) return;
+    if (QFileInfo(labelFile).size() != (qint64)dim[0] * dim[1] * dim[2]) {
+        std::cout << "Label volume " << labelFile.toStdString() << " does not match the volume size " << dim[2] << " x " << dim[1] << " x " << dim[0]
+                  << std::endl;
+        return;
+    }
+    RawReader reader(labelFile.toStdString(), dim[0], dim[1], dim[2], voxelMin, voxelMax, VoxelType::UInt8);
+    if (!reader.data()) return;
+    // 重采样之后按最近邻对齐到新的网格，打包之后读入的字节就可以释放了
+    loadedLabelVolume = new LabelVolume(static_cast<const unsigned char *>(reader.data()), voxelMax - voxelMin, loadedVolumeData->dim);
+    loadedVolumeData->labels = loadedLabelVolume;
+}
+
+void MainWindow::updateLabelTable() {
+    LabelTable table = rayCasting->getLabelTable();
+    int index = labelBox->currentIndex();
+    if (index < 0 || index >= (int)table.labels.size()) return;
+    table.labels[index].visible = labelVisibleCheckBox->isChecked();
+    table.labels[index].opacity = labelOpacitySlider->value() / 100.f;
+    rayCasting->setLabelTable(table);
+}
+
+void MainWindow::updatePreprocessing() {
+    // 后台还在读取时不能改变设置，恢复成正在使用的
+    if (readDataProcess.isRunning()) {
+        QSignalBlocker quantizationBlocker(quantizationBox), resampleBlocker(resampleBox), filterBlocker(resampleFilterBox), denoiseBlocker(denoiseBox);
+        quantizationBox->setCurrentIndex(quantizationBox->findData(quantizationBits));
+        resampleBox->setCurrentIndex(resampleBox->findData(resampleMode));
+        resampleFilterBox->setCurrentIndex(resampleFilterBox->findData((int)resampleFilter));
+        denoiseBox->setCurrentIndex(denoiseBox->findData(denoiseMode));
+        return;
+    }
+    quantizationBits = quantizationBox->currentData().toInt();
+    resampleMode = resampleBox->currentData().toInt();
+    resampleFilter = (ResampleFilter)resampleFilterBox->currentData().toInt();
+    denoiseMode = denoiseBox->currentData().toInt();
+    readDataProcess = QtConcurrent::run(this, &MainWindow::readData, regionMin, regionMax);
+}
+
+void MainWindow::updateClipping() {
+    Clipping clipping;
+    for (int axis = 0; axis < 3; axis++) {
+        clipping.boxMin[axis] = std::min(cropSpinBoxes[axis * 2]->value(), cropSpinBoxes[axis * 2 + 1]->value());
+        clipping.boxMax[axis] = std::max(cropSpinBoxes[axis * 2]->value(), cropSpinBoxes[axis * 2 + 1]->value());
+    }
+    rayCasting->setClipping(clipping);
+    rayCasting->setViewClipPlane(clipPlaneCheckBox->isChecked(), clipPlaneSlider->value() / 100.f);
+}
+
 void MainWindow::closeEvent(QCloseEvent *event) {
     writeSettings();
     event->accept();
 }
 
 void MainWindow::updateRayCasting() {
+    std::swap(rawReader, loadedRawReader);
+    std::swap(volumeData, loadedVolumeData);
+    std::swap(quantizedVolume, loadedQuantizedVolume);
+    std::swap(dicomReader, loadedDicomReader);
+    std::swap(resampledVolume, loadedResampledVolume);
+    std::swap(volumeCache, loadedVolumeCache);
+    std::swap(labelVolume, loadedLabelVolume);
+    // 标签的个数变了才换成默认的颜色，否则保留之前的设置
+    int labelCount = labelVolume ? labelVolume->labelCount : 0;
+    if ((int)rayCasting->getLabelTable().labels.size() != labelCount) {
+        rayCasting->setLabelTable(labelVolume ? LabelTable::withDefaultColors(labelCount) : LabelTable());
+        QSignalBlocker blocker(labelBox);
+        labelBox->clear();
+        for (int i = 0; i < labelCount; i++) {
+            labelBox->addItem(i == 0 ? QString("Unlabeled") : QString("Label %1").arg(i));
+        }
+        labelBox->setCurrentIndex(-1);
+        if (labelCount > 0) labelBox->setCurrentIndex(0);
+    }
+    // 新加载的数据就是之前的 ROI，裁剪盒恢复成整个体数据
+    for (int i = 0; i < 6; i++) {
+        QSignalBlocker blocker(cropSpinBoxes[i]);
+        cropSpinBoxes[i]->setValue(i % 2);
+    }
+    rayCasting->setClipping(Clipping());
+    // 旧的数据等 rayCasting 和它的渲染线程都不再使用之后 (volumeReleased) 才释放，切片视图先换成新的
+    if (loadedVolumeData) {
+        retiredVolumes.push_back({loadedVolumeData, loadedRawReader, loadedDicomReader, loadedQuantizedVolume, loadedResampledVolume,
+                                  loadedVolumeCache, loadedLabelVolume});
+    }
+    sliceView->setVolumeData(volumeData);
     rayCasting->setVolumeData(volumeData);
+    loadedVolumeData = nullptr;
+    loadedRawReader = nullptr;
+    loadedQuantizedVolume = nullptr;
+    loadedDicomReader = nullptr;
+    loadedResampledVolume = nullptr;
+    loadedVolumeCache = nullptr;
+    loadedLabelVolume = nullptr;
+}
+
+void MainWindow::releaseVolume(const VolumeData *volumeData) {
+    auto it = std::find_if(retiredVolumes.begin(), retiredVolumes.end(), [=](const RetiredVolume &retired) { return retired.volumeData == volumeData; });
+    if (it == retiredVolumes.end()) return;
+    delete it->volumeData;
+    delete it->rawReader;
+    delete it->quantizedVolume;
+    delete it->dicomReader;
+    delete it->resampledVolume;
+    delete it->volumeCache;
+    delete it->labelVolume;
+    retiredVolumes.erase(it);
+    MemoryBudget::instance().printUsage();
 }
@@ -6,9 +6,18 @@
 #include <QtWidgets>
 #include <functional>
 #include <glm/glm.hpp>
+#include <vector>
 
+#include "dicom_reader.h"
+#include "label_volume.h"
+#include "memory_budget.h"
+#include "quantized_volume.h"
 #include "raw_reader.h"
 #include "ray_casting.h"
+#include "resampled_volume.h"
+#include "slice_view.h"
+#include "volume_cache.h"
+#include "volume_filter.h"
 
 class MainWindow : public QMainWindow {
     Q_OBJECT
@@ -20,19 +29,82 @@ class MainWindow : public QMainWindow {
     void closeEvent(QCloseEvent *event) override;
 
    private:
-    void readData();
+    // 只读取文件中 [regionMin, regionMax) 范围内的体素，顺序为 (z, y, x)
+    // 打开了 DICOM 序列时从序列中读取，voxelMax 为 0 表示还不知道大小，读取整个序列
+    void readData(glm::ivec3 voxelMin, glm::ivec3 voxelMax);
+    // 降噪、重采样或者量化的设置变化时重新读取当前范围的数据
+    void updatePreprocessing();
+    // 读取 labelFile 中 [voxelMin, voxelMax) 的标签，对齐到 loadedVolumeData（可能已经重采样）
+    void readLabels(glm::ivec3 voxelMin, glm::ivec3 voxelMax);
+    // 把选中标签的显示和不透明度设置到 rayCasting 的标签表中
+    void updateLabelTable();
+    void updateClipping();
     void readSettings();
     void writeSettings();
+    // 释放 rayCasting 不再使用的那一份旧数据
+    void releaseVolume(const VolumeData *volumeData);
     QSlider *createThresholdSlider(std::function<void(int)> callback, int initVal, int maxThreshold = 4946);
 
     QFuture<void> readDataProcess;
-    QSlider *opacityThresholdSlider, *colorThresholdSlider;
-    RawReader *rawReader;
+    QSlider *opacityThresholdSlider, *colorThresholdSlider, *isoValueSlider, *lightAzimuthSlider;
+    QComboBox *renderModeBox, *quantizationBox, *resampleBox, *resampleFilterBox, *denoiseBox;
+    QCheckBox *shadowsCheckBox, *adaptiveQualityCheckBox, *clipPlaneCheckBox, *renderThreadCheckBox, *accumulationCheckBox, *shearWarpCheckBox;
+    // ROI 裁剪盒，按 x, y, z 的 min, max 排列，在 [0, 1] 之间
+    QDoubleSpinBox *cropSpinBoxes[6];
+    QSlider *clipPlaneSlider;
+    QComboBox *labelBox;
+    QCheckBox *labelVisibleCheckBox;
+    QSlider *labelOpacitySlider;
+    RawReader *rawReader = nullptr;
     RayCasting *rayCasting;
-    VolumeData *volumeData;
+    SliceView *sliceView;
+    VolumeData *volumeData = nullptr;
+    // 后台线程读完、还没有交给 rayCasting 的数据
+    RawReader *loadedRawReader = nullptr;
+    VolumeData *loadedVolumeData = nullptr;
+    // 为空时读取默认的 raw 文件
+    QString dicomDirectory;
+    DicomReader *dicomReader = nullptr;
+    DicomReader *loadedDicomReader = nullptr;
+    // 量化之后 volumeData 的数据属于 quantizedVolume，rawReader 已经释放
+    QuantizedVolume *quantizedVolume = nullptr;
+    QuantizedVolume *loadedQuantizedVolume = nullptr;
+    // 重采样之后 volumeData 的数据属于 resampledVolume
+    ResampledVolume *resampledVolume = nullptr;
+    ResampledVolume *loadedResampledVolume = nullptr;
+    // 从缓存中打开时 volumeData 的数据和砖块属于 volumeCache，其他的都为空
+    VolumeCache *volumeCache = nullptr;
+    VolumeCache *loadedVolumeCache = nullptr;
+    // 分割标签，不进入缓存，每次读完体数据之后单独读取；labelFile 为空时没有标签
+    QString labelFile;
+    LabelVolume *labelVolume = nullptr;
+    LabelVolume *loadedLabelVolume = nullptr;
+    // 已经换下来、渲染线程可能还在使用的数据，收到 volumeReleased 之后释放
+    struct RetiredVolume {
+        VolumeData *volumeData;
+        RawReader *rawReader;
+        DicomReader *dicomReader;
+        QuantizedVolume *quantizedVolume;
+        ResampledVolume *resampledVolume;
+        VolumeCache *volumeCache;
+        LabelVolume *labelVolume;
+    };
+    std::vector<RetiredVolume> retiredVolumes;
+    const std::string RAW_FILE = "../../data/cbct_sample_z=507_y=512_x=512.raw";
     const int Z = 507, Y = 512, X = 512;
     glm::ivec3 dim{Z, Y, X};
     glm::vec3 spacing{0.3f, 0.3f, 0.3f};
+    VoxelType voxelType = VoxelType::UInt16;
+    // 0 表示不量化，否则为 8 或 12
+    int quantizationBits = 0;
+    // 0 表示不重采样，1 为各向同性，2 为各向同性并且不超过 RESAMPLE_VOXEL_BUDGET 个体素
+    int resampleMode = 0;
+    ResampleFilter resampleFilter = ResampleFilter::Lanczos3;
+    static constexpr size_t RESAMPLE_VOXEL_BUDGET = 256 * 256 * 256;
+    // 0 表示不降噪，1 为高斯滤波，2 为双边滤波
+    int denoiseMode = 0;
+    // 当前加载的体素范围在整个文件（或者 DICOM 序列）中的位置
+    glm::ivec3 regionMin{0}, regionMax{Z, Y, X};
    signals:
     void readVolumeDataFinished();
    private slots:
@@ -0,0 +1,210 @@
+﻿#include "memory_budget.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+static void* alignedAlloc(size_t bytes, size_t alignment) {
+#ifdef _WIN32
+    return _aligned_malloc(bytes, alignment);
+#else
+    void* ptr = nullptr;
+    return posix_memalign(&ptr, alignment, bytes) == 0 ? ptr : nullptr;
+#endif
+}
+
+static void alignedFree(void* ptr) {
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+static double megabytes(size_t bytes) {
+    return bytes / (1024.0 * 1024.0);
+}
+
+const char* memoryCategoryName(MemoryCategory category) {
+    switch (category) {
+        case MemoryCategory::SourceVolume:
+            return "source volume";
+        case MemoryCategory::DerivedVolume:
+            return "derived volume";
+        case MemoryCategory::Labels:
+            return "labels";
+        case MemoryCategory::MappedCache:
+            return "mapped cache";
+        case MemoryCategory::GpuVolume:
+            return "GPU volume";
+        case MemoryCategory::GpuLabels:
+            return "GPU labels";
+        case MemoryCategory::GpuIllumination:
+            return "GPU illumination";
+        case MemoryCategory::GpuFramebuffers:
+            return "GPU framebuffers";
+        default:
+            return "unknown";
+    }
+}
+
+MemoryBudget& MemoryBudget::instance() {
+    static MemoryBudget budget;
+    return budget;
+}
+
+MemoryBudget::~MemoryBudget() {
+    trim();
+}
+
+void MemoryBudget::setHostBudget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    counters.hostBudget = bytes;
+    if (bytes) trimPool(bytes > counters.hostBytes ? bytes - counters.hostBytes : 0);
+}
+
+void MemoryBudget::setGpuBudget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    counters.gpuBudget = bytes;
+}
+
+MemoryBudget::Usage MemoryBudget::usage() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+void MemoryBudget::printUsage() const {
+    Usage current = usage();
+    std::cout << "Memory: host " << megabytes(current.hostBytes) << " MB (peak " << megabytes(current.peakHostBytes) << " MB, pooled "
+              << megabytes(current.pooledBytes) << " MB), GPU " << megabytes(current.gpuBytes) << " MB (peak " << megabytes(current.peakGpuBytes)
+              << " MB)" << std::endl;
+    for (size_t i = 0; i < (size_t)MemoryCategory::Count; i++) {
+        if (current.bytes[i]) std::cout << "  " << memoryCategoryName((MemoryCategory)i) << ": " << megabytes(current.bytes[i]) << " MB" << std::endl;
+    }
+}
+
+void* MemoryBudget::allocate(size_t bytes, MemoryCategory category) {
+    const bool large = bytes >= LARGE_ALLOCATION;
+    // 大块按 2 MB 取整，同样大小的数据总是落在同一个尺寸上，释放之后可以复用
+    size_t capacity = large ? (bytes + LARGE_ALLOCATION - 1) / LARGE_ALLOCATION * LARGE_ALLOCATION : std::max<size_t>(bytes, 1);
+    void* ptr = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (large) {
+            // 最多浪费 1/8，否则一个很大的空闲块会被小的数据长期占着
+            auto it = pool.lower_bound(capacity);
+            if (it != pool.end() && it->first <= capacity + capacity / 8) {
+                capacity = it->first;
+                ptr = it->second;
+                counters.pooledBytes -= capacity;
+                pool.erase(it);
+            }
+        }
+        if (!ptr && counters.hostBudget && counters.hostBytes + counters.pooledBytes + capacity > counters.hostBudget) trimPool(0);
+    }
+    if (!ptr) {
+        ptr = alignedAlloc(capacity, large ? LARGE_ALLOCATION : ALIGNMENT);
+        if (!ptr) {
+            std::cout << "Failed to allocate " << megabytes(capacity) << " MB for " << memoryCategoryName(category) << std::endl;
+            return nullptr;
+        }
+#ifdef MADV_HUGEPAGE
+        // 体数据按行连续访问，用大页可以减少 TLB miss；内核没有开启透明大页时没有影响
+        if (large) madvise(ptr, capacity, MADV_HUGEPAGE);
+#endif
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    blocks[ptr] = {capacity, category};
+    addUsage(category, (ptrdiff_t)capacity);
+    return ptr;
+}
+
+void MemoryBudget::release(void* ptr) {
+    if (!ptr) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = blocks.find(ptr);
+    if (it == blocks.end()) {
+        std::cout << "Releasing memory that was not allocated by MemoryBudget" << std::endl;
+        return;
+    }
+    Block block = it->second;
+    blocks.erase(it);
+    addUsage(block.category, -(ptrdiff_t)block.bytes);
+    if (block.bytes < LARGE_ALLOCATION) {
+        alignedFree(ptr);
+        return;
+    }
+    pool.emplace(block.bytes, ptr);
+    counters.pooledBytes += block.bytes;
+    // 有预算时池子和正在使用的内存加起来不超过预算
+    size_t maxPooled = DEFAULT_POOL_LIMIT;
+    if (counters.hostBudget) maxPooled = std::min(maxPooled, counters.hostBudget > counters.hostBytes ? counters.hostBudget - counters.hostBytes : 0);
+    trimPool(maxPooled);
+}
+
+void MemoryBudget::track(MemoryCategory category, ptrdiff_t bytes) {
+    if (bytes == 0) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    addUsage(category, bytes);
+}
+
+bool MemoryBudget::overHostBudget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!counters.hostBudget) return false;
+    if (counters.hostBytes + counters.pooledBytes + bytes > counters.hostBudget) trimPool(0);
+    return counters.hostBytes + bytes > counters.hostBudget;
+}
+
+size_t MemoryBudget::gpuAvailable(MemoryCategory category) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!counters.gpuBudget) return SIZE_MAX;
+    size_t others = counters.gpuBytes - counters.bytes[(size_t)category];
+    return counters.gpuBudget > others ? counters.gpuBudget - others : 0;
+}
+
+size_t MemoryBudget::trim() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return trimPool(0);
+}
+
+size_t MemoryBudget::trimPool(size_t maxPooled) {
+    size_t freed = 0;
+    while (counters.pooledBytes > maxPooled && !pool.empty()) {
+        auto largest = std::prev(pool.end());
+        alignedFree(largest->second);
+        counters.pooledBytes -= largest->first;
+        freed += largest->first;
+        pool.erase(largest);
+    }
+    return freed;
+}
+
+void MemoryBudget::addUsage(MemoryCategory category, ptrdiff_t bytes) {
+    counters.bytes[(size_t)category] += bytes;
+    if (isGpuMemory(category)) {
+        counters.gpuBytes += bytes;
+        counters.peakGpuBytes = std::max(counters.peakGpuBytes, counters.gpuBytes);
+    } else {
+        counters.hostBytes += bytes;
+        counters.peakHostBytes = std::max(counters.peakHostBytes, counters.hostBytes);
+    }
+}
+
+void HostBuffer::resize(size_t newBytes) {
+    MemoryBudget::instance().release(ptr);
+    ptr = static_cast<unsigned char*>(MemoryBudget::instance().allocate(newBytes, category));
+    bytes = ptr ? newBytes : 0;
+}
+
+void HostBuffer::assign(size_t newBytes, unsigned char value) {
+    resize(newBytes);
+    if (ptr) memset(ptr, value, bytes);
+}
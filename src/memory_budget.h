@@ -0,0 +1,167 @@
+﻿#pragma once
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+/**
+ * 体数据相关内存的类别，主机内存和显存分开统计
+ */
+enum class MemoryCategory {
+    // RawReader、DicomReader 读入的原始体数据
+    SourceVolume,
+    // 重采样、量化之后的体数据，以及为了放进显存缩小的体数据
+    DerivedVolume,
+    // 分割标签
+    Labels,
+    // 映射的预处理缓存文件，页面由操作系统按需换入，内存紧张时可以直接丢弃
+    MappedCache,
+    // 以下为显存，只记账，不由 MemoryBudget 分配
+    GpuVolume,
+    GpuLabels,
+    GpuIllumination,
+    GpuFramebuffers,
+    Count,
+};
+const char* memoryCategoryName(MemoryCategory category);
+inline bool isGpuMemory(MemoryCategory category) {
+    return category >= MemoryCategory::GpuVolume && category < MemoryCategory::Count;
+}
+
+/**
+ * 体数据相关的主机内存和显存的统一记账和预算，整个进程只有一个 (MemoryBudget::instance())，可以在任意线程中使用
+ * 大块的主机内存从这里分配：按 2 MB 对齐并且建议内核使用透明大页，释放之后先留在池子里，
+ * 反复打开同样大小的数据时直接复用，不会每次都向操作系统申请；超过预算时先把池子里的空闲块还给操作系统
+ * 派生的数据由持有者通过 overHostBudget、gpuAvailable 判断，自己丢弃或者缩小
+ */
+class MemoryBudget {
+   public:
+    // 小于这个大小的分配只按缓存行对齐，不进入池子
+    static constexpr size_t LARGE_ALLOCATION = 2 * 1024 * 1024;
+    static constexpr size_t ALIGNMENT = 64;
+    // 没有设置主机内存预算时，池子里最多保留的空闲内存
+    static constexpr size_t DEFAULT_POOL_LIMIT = 512 * 1024 * 1024;
+
+    struct Usage {
+        size_t bytes[(size_t)MemoryCategory::Count] = {};
+        size_t hostBytes = 0, gpuBytes = 0;
+        size_t peakHostBytes = 0, peakGpuBytes = 0;
+        // 池子里的空闲块，不计入 hostBytes
+        size_t pooledBytes = 0;
+        // 0 表示没有限制
+        size_t hostBudget = 0, gpuBudget = 0;
+    };
+
+    static MemoryBudget& instance();
+
+    void setHostBudget(size_t bytes);
+    void setGpuBudget(size_t bytes);
+    Usage usage() const;
+    void printUsage() const;
+
+    /**
+     * 分配主机内存，内容未初始化，失败时返回 nullptr；超过预算时仍然分配，只是先释放池子里的空闲块
+     */
+    void* allocate(size_t bytes, MemoryCategory category);
+    // 释放 allocate 返回的指针，nullptr 什么都不做
+    void release(void* ptr);
+    /**
+     * 不由这里分配的内存（显存、映射的文件）的记账，bytes 为变化量，可以为负
+     */
+    void track(MemoryCategory category, ptrdiff_t bytes);
+
+    /**
+     * 再使用 bytes 的主机内存之后是否超过预算，需要时先释放池子里的空闲块
+     */
+    bool overHostBudget(size_t bytes = 0);
+    /**
+     * 显存预算内还能给 category 使用的字节数，这一类现在占用的部分（例如即将被替换的纹理）也算作可用
+     */
+    size_t gpuAvailable(MemoryCategory category) const;
+    // 把池子里的空闲块全部还给操作系统，返回释放的字节数
+    size_t trim();
+
+   private:
+    MemoryBudget() = default;
+    ~MemoryBudget();
+    MemoryBudget(const MemoryBudget&) = delete;
+    MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+    // 池子里的空闲块超过 maxPooled 时从最大的开始释放，需要持有 mutex
+    size_t trimPool(size_t maxPooled);
+    void addUsage(MemoryCategory category, ptrdiff_t bytes);
+
+    struct Block {
+        size_t bytes;
+        MemoryCategory category;
+    };
+    mutable std::mutex mutex;
+    std::unordered_map<void*, Block> blocks;
+    // 按大小排序的空闲块
+    std::multimap<size_t, void*> pool;
+    Usage counters;
+};
+
+/**
+ * 记账用的一份显存（或者其他不由 MemoryBudget 分配的内存），set 为新的大小，析构时自动清零
+ */
+class TrackedMemory {
+   public:
+    explicit TrackedMemory(MemoryCategory category) : category(category) {}
+    ~TrackedMemory() {
+        set(0);
+    }
+    TrackedMemory(const TrackedMemory&) = delete;
+    TrackedMemory& operator=(const TrackedMemory&) = delete;
+
+    inline void set(size_t newBytes) {
+        MemoryBudget::instance().track(category, (ptrdiff_t)newBytes - (ptrdiff_t)bytes);
+        bytes = newBytes;
+    }
+    inline size_t get() const {
+        return bytes;
+    }
+
+   private:
+    MemoryCategory category;
+    size_t bytes = 0;
+};
+
+/**
+ * 从 MemoryBudget 分配的一块主机内存，代替 std::vector<unsigned char> 保存体数据
+ */
+class HostBuffer {
+   public:
+    explicit HostBuffer(MemoryCategory category) : category(category) {}
+    ~HostBuffer() {
+        MemoryBudget::instance().release(ptr);
+    }
+    HostBuffer(const HostBuffer&) = delete;
+    HostBuffer& operator=(const HostBuffer&) = delete;
+
+    // 重新分配 bytes 字节，原来的内容不保留，新的内容未初始化
+    void resize(size_t bytes);
+    // 重新分配 bytes 字节，全部填充为 value
+    void assign(size_t bytes, unsigned char value);
+
+    inline unsigned char* data() {
+        return ptr;
+    }
+    inline const unsigned char* data() const {
+        return ptr;
+    }
+    inline size_t size() const {
+        return bytes;
+    }
+    inline unsigned char& operator[](size_t i) {
+        return ptr[i];
+    }
+    inline const unsigned char& operator[](size_t i) const {
+        return ptr[i];
+    }
+
+   private:
+    MemoryCategory category;
+    unsigned char* ptr = nullptr;
+    size_t bytes = 0;
+};
@@ -0,0 +1,163 @@
+﻿#include "mpr.h"
+
+#include <algorithm>
+#include <cmath>
+
+MprEngine::MprEngine(const VolumeData* volumeData) : volumeData(volumeData) {
+    extent = glm::vec3(volumeData->dim - 1) * volumeData->spacing;
+    dataMin = volumeData->DATA_MIN;
+    dataMax = volumeData->DATA_MAX;
+}
+
+glm::vec3 MprEngine::center() const {
+    return extent / 2.f;
+}
+
+float MprEngine::diagonal() const {
+    return glm::length(extent);
+}
+
+SlicePlane MprEngine::orthogonalPlane(SliceOrientation orientation, float position) const {
+    const glm::vec3& spacing = volumeData->spacing;
+    position = std::clamp(position, 0.f, 1.f);
+    SlicePlane plane;
+    float pixel;
+    switch (orientation) {
+        case SliceOrientation::Axial:
+            pixel = std::min(spacing.y, spacing.z);
+            plane.origin = {position * extent.x, 0, 0};
+            plane.uAxis = {0, 0, pixel};
+            plane.vAxis = {0, pixel, 0};
+            plane.width = (int)(extent.z / pixel) + 1;
+            plane.height = (int)(extent.y / pixel) + 1;
+            break;
+        case SliceOrientation::Coronal:
+            pixel = std::min(spacing.x, spacing.z);
+            plane.origin = {0, position * extent.y, 0};
+            plane.uAxis = {0, 0, pixel};
+            plane.vAxis = {pixel, 0, 0};
+            plane.width = (int)(extent.z / pixel) + 1;
+            plane.height = (int)(extent.x / pixel) + 1;
+            break;
+        case SliceOrientation::Sagittal:
+            pixel = std::min(spacing.x, spacing.y);
+            plane.origin = {0, 0, position * extent.z};
+            plane.uAxis = {0, pixel, 0};
+            plane.vAxis = {pixel, 0, 0};
+            plane.width = (int)(extent.y / pixel) + 1;
+            plane.height = (int)(extent.x / pixel) + 1;
+            break;
+    }
+    return plane;
+}
+
+SlicePlane MprEngine::obliquePlane(glm::vec3 center, glm::vec3 normal, glm::vec3 up, int size) const {
+    glm::vec3 n = glm::normalize(normal);
+    // up 和法向平行时换一个方向
+    if (std::abs(glm::dot(glm::normalize(up), n)) > 0.999f) {
+        up = std::abs(n.x) < 0.9f ? glm::vec3(1, 0, 0) : glm::vec3(0, 1, 0);
+    }
+    glm::vec3 right = glm::normalize(glm::cross(n, up));
+    // 图片的行是从上往下的
+    glm::vec3 down = glm::cross(n, right);
+    float pixel = diagonal() / std::max(size - 1, 1);
+
+    SlicePlane plane;
+    plane.uAxis = right * pixel;
+    plane.vAxis = down * pixel;
+    plane.width = plane.height = size;
+    plane.origin = center - (plane.uAxis + plane.vAxis) * ((size - 1) / 2.f);
+    return plane;
+}
+
+/**
+ * 沿一行像素重采样并按 mode 合并到 row 中，start 和 step 都是体素坐标
+ * 体数据外面的采样点不参与合并，counts 记录每个像素实际合并了多少个采样点；Thin 模式下外面为 0
+ */
+template <typename T, SlabMode mode>
+static void resampleRow(const VolumeData* volumeData, glm::vec3 start, glm::vec3 step, int width, float* row, int* counts) {
+    const glm::vec3 maxPos = glm::vec3(volumeData->dim - 1);
+    for (int x = 0; x < width; x++) {
+        glm::vec3 p = start + step * (float)x;
+        bool inside = p.x >= 0 && p.y >= 0 && p.z >= 0 && p.x <= maxPos.x && p.y <= maxPos.y && p.z <= maxPos.z;
+        if (mode == SlabMode::Thin) {
+            row[x] = inside ? volumeData->sample<T>(p) : 0.f;
+            continue;
+        }
+        if (!inside) continue;
+        float value = volumeData->sample<T>(p);
+        if (counts[x] == 0) {
+            row[x] = value;
+        } else if (mode == SlabMode::MIP) {
+            row[x] = std::max(row[x], value);
+        } else {
+            row[x] += value;
+        }
+        counts[x]++;
+    }
+}
+
+std::vector<float> MprEngine::reslice(const SlicePlane& plane, float slabThickness, SlabMode mode) const {
+    std::vector<float> values((size_t)plane.width * plane.height);
+    const glm::vec3 invSpacing = 1.f / volumeData->spacing;
+    const glm::vec3 step = plane.uAxis * invSpacing;
+    const glm::vec3 normal = plane.normal();
+
+    // slab 内沿法向的采样间隔不超过最小的 spacing
+    int samples = 1;
+    float sampleStep = 0;
+    if (mode != SlabMode::Thin && slabThickness > 0) {
+        float minSpacing = std::min({volumeData->spacing.x, volumeData->spacing.y, volumeData->spacing.z});
+        samples = (int)std::ceil(slabThickness / minSpacing) + 1;
+        sampleStep = slabThickness / (samples - 1);
+    }
+
+    // 按体素类型分发一次，每一行的采样都是针对具体类型特化的
+    dispatchVoxelType(volumeData->type, [&](auto zero) {
+        using T = decltype(zero);
+#pragma omp parallel
+        {
+            std::vector<int> counts(plane.width);
+#pragma omp for schedule(static)
+            for (int y = 0; y < plane.height; y++) {
+                float* row = &values[(size_t)y * plane.width];
+                std::fill(counts.begin(), counts.end(), 0);
+                for (int s = 0; s < samples; s++) {
+                    glm::vec3 offset = normal * ((s - (samples - 1) / 2.f) * sampleStep);
+                    glm::vec3 start = (plane.origin + plane.vAxis * (float)y + offset) * invSpacing;
+                    switch (mode) {
+                        case SlabMode::Thin:
+                            resampleRow<T, SlabMode::Thin>(volumeData, start, step, plane.width, row, counts.data());
+                            break;
+                        case SlabMode::MIP:
+                            resampleRow<T, SlabMode::MIP>(volumeData, start, step, plane.width, row, counts.data());
+                            break;
+                        case SlabMode::Average:
+                            resampleRow<T, SlabMode::Average>(volumeData, start, step, plane.width, row, counts.data());
+                            break;
+                    }
+                }
+                if (mode == SlabMode::Thin) continue;
+                // 只对落在体数据里面的采样点求平均，完全在外面的像素为 0
+                for (int x = 0; x < plane.width; x++) {
+                    if (counts[x] == 0) {
+                        row[x] = 0.f;
+                    } else if (mode == SlabMode::Average) {
+                        row[x] /= counts[x];
+                    }
+                }
+            }
+        }
+    });
+    return values;
+}
+
+std::vector<unsigned char> MprEngine::toGray(const std::vector<float>& values, float windowMin, float windowMax) {
+    std::vector<unsigned char> gray(values.size());
+    float scale = 255.f / std::max(windowMax - windowMin, 1e-6f);
+#pragma omp parallel for
+    for (int i = 0; i < (int)values.size(); i++) {
+        gray[i] = (unsigned char)std::clamp((values[i] - windowMin) * scale, 0.f, 255.f);
+    }
+    return gray;
+}
@@ -0,0 +1,76 @@
+﻿#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "volume_data.h"
+
+/**
+ * 重采样平面，所有坐标都是物理坐标 (mm)，分量顺序和 VolumeData::dim 一致 (z, y, x)，原点在第一个体素的中心
+ */
+struct SlicePlane {
+    // 左上角像素中心的位置
+    glm::vec3 origin;
+    // 相邻像素之间的位移，长度就是像素大小
+    glm::vec3 uAxis, vAxis;
+    int width = 0, height = 0;
+
+    inline glm::vec3 normal() const {
+        return glm::normalize(glm::cross(uAxis, vAxis));
+    }
+};
+
+enum class SliceOrientation {
+    // 垂直于 z (dim[0])
+    Axial,
+    // 垂直于 y (dim[1])
+    Coronal,
+    // 垂直于 x (dim[2])
+    Sagittal,
+};
+
+enum class SlabMode {
+    // 单层切片
+    Thin,
+    // 最大密度投影
+    MIP,
+    Average,
+};
+
+/**
+ * 多平面重建 (Multi-Planar Reconstruction)：从体数据中重采样任意方向的切片，或者一定厚度的 slab
+ * 每一行像素在体素坐标系中是等间距的，沿行增量步进，行与行之间多线程并行
+ */
+class MprEngine {
+   public:
+    explicit MprEngine(const VolumeData* volumeData);
+
+    /**
+     * 标准切面，position 为 [0, 1] 之间沿法向的位置，像素大小取面内两个方向 spacing 较小的那个
+     */
+    SlicePlane orthogonalPlane(SliceOrientation orientation, float position) const;
+    /**
+     * 经过 center 且垂直于 normal 的斜切面，up 用来确定图片的朝向，图片大小为 size x size，覆盖整个体数据
+     */
+    SlicePlane obliquePlane(glm::vec3 center, glm::vec3 normal, glm::vec3 up, int size) const;
+    /**
+     * 体数据中心和对角线长度（物理坐标）
+     */
+    glm::vec3 center() const;
+    float diagonal() const;
+
+    /**
+     * 重采样一个平面，slabThickness > 0 时沿法向在 [-slabThickness/2, slabThickness/2] 内采样并按 mode 合并
+     * 返回 width * height 个体素值，体数据外面的像素为 0
+     */
+    std::vector<float> reslice(const SlicePlane& plane, float slabThickness = 0, SlabMode mode = SlabMode::Thin) const;
+    /**
+     * 按窗宽窗位转为 8 位灰度图
+     */
+    static std::vector<unsigned char> toGray(const std::vector<float>& values, float windowMin, float windowMax);
+
+    float dataMin = 0, dataMax = 0;
+
+   private:
+    const VolumeData* volumeData;
+    glm::vec3 extent;
+};
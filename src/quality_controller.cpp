@@ -0,0 +1,74 @@
+﻿#include "quality_controller.h"
+
+#include <algorithm>
+#include <numeric>
+
+float QualityLevel::relativeCost() const {
+    // 片段数和分辨率的平方成正比，采样数和步长成反比；不计算光照时每个采样点少 3 次纹理采样
+    float shadingCost = shading == ShadingLevel::Unlit ? 0.4f : shading == ShadingLevel::Phong ? 1.f : 1.2f;
+    return renderScale * renderScale / stepScale * shadingCost;
+}
+
+QualityController::QualityController(double targetFrameMs) : targetFrameMs(targetFrameMs) {
+}
+
+const std::vector<QualityLevel>& QualityController::levels() {
+    static const std::vector<QualityLevel> levels = {
+        {1.f, 1.f, ShadingLevel::Full},
+        {1.f, 1.f, ShadingLevel::Phong},
+        {1.5f, 1.f, ShadingLevel::Phong},
+        {2.f, 0.75f, ShadingLevel::Phong},
+        {3.f, 0.5f, ShadingLevel::Phong},
+        {3.f, 0.5f, ShadingLevel::Unlit},
+        {4.f, 0.35f, ShadingLevel::Unlit},
+    };
+    return levels;
+}
+
+const char* QualityController::shadingName(ShadingLevel shading) {
+    switch (shading) {
+        case ShadingLevel::Unlit:
+            return "unlit";
+        case ShadingLevel::Phong:
+            return "Phong";
+        default:
+            return "full";
+    }
+}
+
+bool QualityController::addFrameTime(double frameMs) {
+    frameTimes.push_back(frameMs);
+    if ((int)frameTimes.size() > std::max(downgradeFrames, upgradeFrames)) frameTimes.pop_front();
+
+    // 最近 downgradeFrames 帧的平均耗时超过目标就降一级
+    if ((int)frameTimes.size() >= downgradeFrames && currentLevel + 1 < (int)levels().size()) {
+        double recent = std::accumulate(frameTimes.end() - downgradeFrames, frameTimes.end(), 0.0) / downgradeFrames;
+        if (recent > targetFrameMs) {
+            setLevel(currentLevel + 1);
+            return true;
+        }
+    }
+    // 按开销的比例预测提高一级之后的帧时间，有足够余量才升级
+    if ((int)frameTimes.size() >= upgradeFrames && currentLevel > 0) {
+        double predicted = averageFrameMs() * levels()[currentLevel - 1].relativeCost() / quality().relativeCost();
+        if (predicted < headroom * targetFrameMs) {
+            setLevel(currentLevel - 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+void QualityController::resetHistory() {
+    frameTimes.clear();
+}
+
+void QualityController::setLevel(int level) {
+    currentLevel = std::clamp(level, 0, (int)levels().size() - 1);
+    frameTimes.clear();
+}
+
+double QualityController::averageFrameMs() const {
+    if (frameTimes.empty()) return 0;
+    return std::accumulate(frameTimes.begin(), frameTimes.end(), 0.0) / frameTimes.size();
+}
@@ -0,0 +1,66 @@
+﻿#pragma once
+#include <deque>
+#include <vector>
+
+enum class ShadingLevel {
+    // 只用传输函数的颜色，不计算法向量和光照
+    Unlit,
+    // Phong 光照
+    Phong,
+    // Phong 光照加上阴影和环境光遮蔽（需要打开阴影）
+    Full,
+};
+
+/**
+ * 一个质量等级，等级越高开销越小
+ */
+struct QualityLevel {
+    // 相对于基础步长的倍数
+    float stepScale;
+    // 渲染分辨率相对于窗口的比例
+    float renderScale;
+    ShadingLevel shading;
+
+    // 相对开销的粗略估计，只用来预测提高一级之后的帧时间
+    float relativeCost() const;
+};
+
+/**
+ * 根据最近几帧的耗时调整渲染质量：超过目标帧时间时降低一级，预测提高一级之后仍然有余量时再提高一级
+ * 不依赖任何计时器，帧时间由调用者传入，可以用模拟的帧时间得到确定的结果
+ */
+class QualityController {
+   public:
+    explicit QualityController(double targetFrameMs = 1000.0 / 30);
+
+    /**
+     * 记录一帧的耗时，返回质量等级是否改变
+     */
+    bool addFrameTime(double frameMs);
+    // 窗口大小、体数据等变化之后以前的帧时间不再有参考价值
+    void resetHistory();
+    void setLevel(int level);
+    inline int level() const {
+        return currentLevel;
+    }
+    inline const QualityLevel& quality() const {
+        return levels()[currentLevel];
+    }
+    // 当前等级下最近几帧的平均耗时，还没有记录时返回 0
+    double averageFrameMs() const;
+
+    // 从最高质量到最低质量
+    static const std::vector<QualityLevel>& levels();
+    static const char* shadingName(ShadingLevel shading);
+
+    double targetFrameMs;
+    // 降级只需要连续几帧超时，升级需要更多帧，避免在两个等级之间来回跳
+    int downgradeFrames = 3, upgradeFrames = 10;
+    // 预测的帧时间低于 headroom * targetFrameMs 时才升级
+    double headroom = 0.8;
+
+   private:
+    int currentLevel = 0;
+    // 只保留当前等级下最近的帧时间，等级改变之后清空
+    std::deque<double> frameTimes;
+};
@@ -0,0 +1,115 @@
+﻿#include "quantized_volume.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+QuantizedVolume::QuantizedVolume(const VolumeData* volumeData, int bits, float lowPercentile, float highPercentile)
+    : bits(bits == 8 ? 8 : 12),
+      type(bits == 8 ? VoxelType::UInt8 : VoxelType::UInt16),
+      originalBytes(volumeData->size() * voxelSize(volumeData->type)),
+      dim(volumeData->dim),
+      spacing(volumeData->spacing),
+      reverseGradientDirection(volumeData->reverseGradientDirection) {
+    data.resize(volumeData->size() * voxelSize(type));
+    dispatchVoxelType(volumeData->type, [&](auto zero) {
+        using T = decltype(zero);
+        computeWindow<T>(volumeData, lowPercentile, highPercentile);
+        if (type == VoxelType::UInt8) {
+            quantize<T, uint8_t>(volumeData);
+        } else {
+            quantize<T, uint16_t>(volumeData);
+        }
+    });
+}
+
+template <typename T>
+void QuantizedVolume::computeWindow(const VolumeData* volumeData, float lowPercentile, float highPercentile) {
+    const T* values = volumeData->voxels<T>();
+    const long long n = (long long)volumeData->size();
+    const float dataMin = volumeData->DATA_MIN, dataMax = volumeData->DATA_MAX;
+    const float binWidth = dataMax > dataMin ? (dataMax - dataMin) / HISTOGRAM_BINS : 1.f;
+    std::vector<long long> histogram(HISTOGRAM_BINS, 0);
+    // 每个线程先统计自己的直方图，最后再合并
+#pragma omp parallel
+    {
+        std::vector<long long> threadHistogram(HISTOGRAM_BINS, 0);
+#pragma omp for nowait
+        for (long long i = 0; i < n; i++) {
+            float value = (float)values[i] * volumeData->valueScale + volumeData->valueOffset;
+            int bin = std::min((int)((value - dataMin) / binWidth), HISTOGRAM_BINS - 1);
+            threadHistogram[std::max(bin, 0)]++;
+        }
+#pragma omp critical
+        {
+            for (int b = 0; b < HISTOGRAM_BINS; b++) {
+                histogram[b] += threadHistogram[b];
+            }
+        }
+    }
+    windowMin = dataMin;
+    windowMax = dataMax;
+    long long count = 0;
+    bool lowFound = lowPercentile <= 0.f, highFound = highPercentile >= 1.f;
+    for (int b = 0; b < HISTOGRAM_BINS && !highFound; b++) {
+        count += histogram[b];
+        if (!lowFound && count > lowPercentile * n) {
+            windowMin = dataMin + b * binWidth;
+            lowFound = true;
+        }
+        if (count >= highPercentile * n) {
+            windowMax = std::min(dataMin + (b + 1) * binWidth, dataMax);
+            highFound = true;
+        }
+    }
+    if (windowMax <= windowMin) {
+        windowMax = windowMin + 1.f;
+    }
+}
+
+template <typename T, typename Q>
+void QuantizedVolume::quantize(const VolumeData* volumeData) {
+    const T* values = volumeData->voxels<T>();
+    Q* quantized = reinterpret_cast<Q*>(data.data());
+    const long long n = (long long)volumeData->size();
+    const float levels = (float)((1 << bits) - 1);
+    scale = (windowMax - windowMin) / levels;
+    offset = windowMin;
+    double squaredError = 0;
+    long long clipped = 0;
+#pragma omp parallel
+    {
+        double threadMaxError = 0;
+#pragma omp for reduction(+ : squaredError, clipped) nowait
+        for (long long i = 0; i < n; i++) {
+            float value = (float)values[i] * volumeData->valueScale + volumeData->valueOffset;
+            float level = std::round((value - offset) / scale);
+            if (level < 0.f || level > levels) {
+                level = std::clamp(level, 0.f, levels);
+                clipped++;
+            }
+            quantized[i] = (Q)level;
+            double error = std::abs((double)level * scale + offset - value);
+            squaredError += error * error;
+            threadMaxError = std::max(threadMaxError, error);
+        }
+#pragma omp critical
+        {
+            maxError = std::max(maxError, threadMaxError);
+        }
+    }
+    rmsError = n > 0 ? std::sqrt(squaredError / n) : 0.;
+    clippedRatio = n > 0 ? (double)clipped / n : 0.;
+}
+
+VolumeData* QuantizedVolume::createVolumeData() const {
+    VolumeData* volumeData = new VolumeData(data.data(), type, dim, spacing, reverseGradientDirection);
+    volumeData->setValueMapping(scale, offset);
+    return volumeData;
+}
+
+void QuantizedVolume::printReport() const {
+    std::cout << "Quantized to " << bits << " bits, window [" << windowMin << ", " << windowMax << "], "
+              << originalBytes / (1024 * 1024) << " MB -> " << data.size() / (1024 * 1024) << " MB" << std::endl;
+    std::cout << "Quantization error: max " << maxError << ", RMS " << rmsError << ", clipped " << clippedRatio * 100 << "% voxels" << std::endl;
+}
@@ -0,0 +1,47 @@
+﻿#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "memory_budget.h"
+#include "volume_data.h"
+
+/**
+ * 把体数据按窗宽窗位量化成 8 位（uint8）或者 12 位（存在 uint16 中），减少内存和显存占用
+ * 窗口由直方图的分位数确定，窗口外的值截断到窗口边界；量化值通过 scale 和 offset 映射回原始值，
+ * 所以传输函数、等值面阈值等仍然使用原始数据的单位，CPU 和 GPU 渲染都不需要改动阈值
+ */
+class QuantizedVolume {
+   public:
+    static constexpr int HISTOGRAM_BINS = 4096;
+
+    /**
+     * bits 只支持 8 和 12；lowPercentile、highPercentile 为窗口两端在直方图中的分位数
+     */
+    QuantizedVolume(const VolumeData* volumeData, int bits, float lowPercentile = 0.f, float highPercentile = 0.999f);
+
+    /**
+     * 用量化后的数据创建 VolumeData，数据仍然属于 QuantizedVolume，需要比返回的 VolumeData 活得更久
+     */
+    VolumeData* createVolumeData() const;
+    void printReport() const;
+
+    int bits;
+    VoxelType type;
+    // 原始单位下的窗口
+    float windowMin, windowMax;
+    // 原始值 = 量化值 * scale + offset
+    float scale, offset;
+    // 原始单位下的最大误差和均方根误差（包括窗口外被截断的体素），以及被截断的体素比例
+    double maxError = 0, rmsError = 0, clippedRatio = 0;
+    size_t originalBytes;
+    HostBuffer data{MemoryCategory::DerivedVolume};
+    glm::ivec3 dim;
+    glm::vec3 spacing;
+    bool reverseGradientDirection;
+
+   private:
+    template <typename T>
+    void computeWindow(const VolumeData* volumeData, float lowPercentile, float highPercentile);
+    template <typename T, typename Q>
+    void quantize(const VolumeData* volumeData);
+};
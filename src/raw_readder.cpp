@@ -1,10 +1,10 @@
-﻿#include <cassert>
-#include <fstream>
+﻿#include <fstream>
 #include <iostream>
 
+#include "memory_budget.h"
 #include "raw_reader.h"
 
-RawReader::RawReader(std::string filename, const int Z, const int Y, const int X) {
+RawReader::RawReader(std::string filename, const int Z, const int Y, const int X, VoxelType type) : m_type(type) {
     std::ifstream(filename, std::ios::in | std::ios::binary);
     // Copied from https://www.cplusplus.com/doc/tutorial/files/
     std::streampos size;
@@ -12,10 +12,24 @@ RawReader::RawReader(std::string filename, const int Z, const int Y, const int X
     std::ifstream file(filename, std::ios::in | std::ios::binary | std::ios::ate);
     if (file.is_open()) {
         size = file.tellg();
-        assert(size == Z * Y * X * sizeof(unsigned short));
-        m_data = (unsigned short *)malloc(size);
+        // 大小可能来自客户端的请求，不能只在 debug 模式下检查
+        if (size != (std::streampos)((size_t)Z * Y * X * voxelSize(type))) {
+            std::cout << "File size " << size << " does not match " << Z << " x " << Y << " x " << X << " voxels of " << voxelTypeName(type) << std::endl;
+            return;
+        }
+        m_data = MemoryBudget::instance().allocate(size, MemoryCategory::SourceVolume);
+        if (!m_data) {
+            std::cout << "Unable to allocate memory for " << filename << std::endl;
+            return;
+        }
         file.seekg(0, std::ios::beg);
-        file.read((char *)m_data, size);
+        if (!file.read((char *)m_data, size)) {
+            // 读失败时内存中是未初始化的数据，不能交给后面的处理
+            std::cout << "Unable to read " << filename << std::endl;
+            MemoryBudget::instance().release(m_data);
+            m_data = nullptr;
+            return;
+        }
         file.close();
 
         std::cout << "the entire file content is read" << std::endl;
@@ -23,10 +37,50 @@ RawReader::RawReader(std::string filename, const int Z, const int Y, const int X
         std::cout << "Unable to open file" << std::endl;
 }
 
+RawReader::RawReader(std::string filename, const int Z, const int Y, const int X, glm::ivec3 regionMin, glm::ivec3 regionMax, VoxelType type) : m_type(type) {
+    std::ifstream file(filename, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        std::cout << "Unable to open file" << std::endl;
+        return;
+    }
+    const size_t bytes = voxelSize(type);
+    if (file.tellg() != (std::streampos)((size_t)Z * Y * X * bytes)) {
+        std::cout << "File size " << file.tellg() << " does not match " << Z << " x " << Y << " x " << X << " voxels of " << voxelTypeName(type) << std::endl;
+        return;
+    }
+    regionMin = glm::clamp(regionMin, glm::ivec3(0), glm::ivec3(Z, Y, X));
+    regionMax = glm::clamp(regionMax, regionMin, glm::ivec3(Z, Y, X));
+    glm::ivec3 size = regionMax - regionMin;
+    m_data = MemoryBudget::instance().allocate((size_t)size[0] * size[1] * size[2] * bytes, MemoryCategory::SourceVolume);
+    if (!m_data) {
+        std::cout << "Unable to allocate memory for " << filename << std::endl;
+        return;
+    }
+    char *dst = (char *)m_data;
+    for (int z = regionMin[0]; z < regionMax[0]; z++) {
+        // x 覆盖整行时同一层的数据是连续的，一次读完
+        bool fullRows = size[2] == X;
+        for (int y = regionMin[1]; y < regionMax[1]; y += fullRows ? size[1] : 1) {
+            size_t count = fullRows ? (size_t)size[1] * X : size[2];
+            file.seekg(((size_t)z * Y * X + (size_t)y * X + regionMin[2]) * bytes, std::ios::beg);
+            if (!file.read(dst, count * bytes)) {
+                std::cout << "Unable to read " << filename << std::endl;
+                MemoryBudget::instance().release(m_data);
+                m_data = nullptr;
+                return;
+            }
+            dst += count * bytes;
+        }
+    }
+    file.close();
+
+    std::cout << "region [" << regionMin.x << ", " << regionMin.y << ", " << regionMin.z << ") - [" << regionMax.x << ", " << regionMax.y << ", " << regionMax.z << ") is read" << std::endl;
+}
+
 RawReader::~RawReader() {
-    free(m_data);
+    MemoryBudget::instance().release(m_data);
 }
 
-unsigned short *RawReader::data() const {
+void *RawReader::data() const {
     return m_data;
 }
@@ -1,11 +1,27 @@
 ﻿#pragma once
+#include <glm/glm.hpp>
 #include <string>
+
+#include "voxel_type.h"
+
 class RawReader {
    public:
-    RawReader(const std::string filename, const int Z, const int Y, const int X);
-    unsigned short* data() const;
+    /**
+     * 按 type 读取 Z * Y * X 个体素，数据保持原始类型，不做任何转换
+     */
+    RawReader(const std::string filename, const int Z, const int Y, const int X, VoxelType type = VoxelType::UInt16);
+    /**
+     * 只读取 [regionMin, regionMax) 范围内的体素，顺序为 (z, y, x)，data() 的大小为这个范围的大小
+     * 读取的数据量和范围成正比，不需要把整个文件读进内存
+     */
+    RawReader(const std::string filename, const int Z, const int Y, const int X, glm::ivec3 regionMin, glm::ivec3 regionMax, VoxelType type = VoxelType::UInt16);
+    void* data() const;
+    inline VoxelType voxelType() const {
+        return m_type;
+    }
     ~RawReader();
 
    private:
-    unsigned short* m_data;
+    void* m_data = nullptr;
+    VoxelType m_type;
 };
@@ -1,5 +1,14 @@
 ﻿#include "ray_casting.h"
 
+#include "ray_jitter.h"
+
+#ifndef GL_TIME_ELAPSED
+#define GL_TIME_ELAPSED 0x88BF
+#endif
+#ifndef GL_RGBA16F
+#define GL_RGBA16F 0x881A
+#endif
+
 // https://www.codenong.com/cs106436180/
 static void GLClearError() {
     while (glGetError() != GL_NO_ERROR)
@@ -11,37 +20,275 @@ static void GLCheckError() {
     }
 }
 
-RayCasting::RayCasting(VolumeData* volumeData) : indexBuf(QOpenGLBuffer::IndexBuffer) {
+RayCasting::RayCasting(VolumeData* volumeData) : proxyIndexBuf(QOpenGLBuffer::IndexBuffer), indexBuf(QOpenGLBuffer::IndexBuffer) {
+    inputClock.start();
+    refineTimer.setSingleShot(true);
+    refineTimer.setInterval(150);
+    connect(&refineTimer, &QTimer::timeout, this, [this]() {
+        refinePending = true;
+        update();
+    });
     setVolumeData(volumeData);
 }
 
 RayCasting::~RayCasting() {
+    // 先停下渲染线程，它可能还在使用体数据
+    delete renderThread;
+    makeCurrent();
+    delete hitBuffer;
+    delete illumination;
+    glDeleteTextures(1, &illuminationTexture);
+    delete lowResBuffer;
+    delete accumulationBuffer;
+    if (timerQueries[0]) glDeleteQueries(2, timerQueries);
+    glDeleteTextures(1, &volumeTexture);
+    glDeleteTextures(1, &labelTexture);
+    delete downsampledVolume;
+    delete brickGrid;
+    glDeleteFramebuffers(2, proxyDepthFbo);
+    glDeleteTextures(2, proxyDepthTexture);
     arrayBuf.destroy();
     indexBuf.destroy();
+    proxyVertexBuf.destroy();
+    proxyIndexBuf.destroy();
+    doneCurrent();
 }
 
 void RayCasting::setVolumeData(VolumeData* volumeData) {
+    const VolumeData* previous = this->volumeData;
     this->volumeData = volumeData;
+    // 渲染线程在下一帧开始前才换上新的体数据，旧的由它通知释放
+    if (!renderThread && previous && previous != volumeData) emit volumeReleased(previous);
     if (volumeData != nullptr) {
-        std::cout << "binding texture 3D image" << std::endl;
-        // 重新绑定 3D 纹理
-        glDeleteTextures(1, &volumeTexture);
-        glGenTextures(1, &volumeTexture);
-        glBindTexture(GL_TEXTURE_3D, volumeTexture);
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        // 注意 depth 是最外面一层
-        glTexImage3D(GL_TEXTURE_3D, 0, GL_R16UI, volumeData->dim[1], volumeData->dim[2], volumeData->dim[0], 0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, volumeData->data);
-        glGenerateMipmap(GL_TEXTURE_3D);
-        glBindTexture(GL_TEXTURE_3D, 0);
-
+        // 3D 纹理在 paintGL 中上传，那时 OpenGL 上下文一定是 current 的
+        volumeTextureDirty = true;
+        labelTextureDirty = true;
+        delete downsampledVolume;
+        downsampledVolume = nullptr;
+        if (renderThread) renderThread->setVolumeData(volumeData);
+        hasPublished = false;
+
+        delete illumination;
+        illumination = nullptr;
+        delete brickGrid;
+        brickGrid = volumeData->brickGrid ? new BrickGrid(*volumeData->brickGrid) : new BrickGrid(volumeData);
+        proxyDirty = true;
+        // 基础步长取半个体素，体数据越大步长越小
+        baseStepLength = 0.5f / std::max({volumeData->dim[0], volumeData->dim[1], volumeData->dim[2]});
+        qualityController.resetHistory();
+        hitBufferDirty = true;
         update();
     }
 }
 
+/**
+ * 每种体素类型对应的纹理格式和 shader 中的 sampler 类型，按原始类型上传，不做任何转换
+ */
+struct VolumeTextureFormat {
+    GLint internalFormat;
+    GLenum format, type;
+    const char* sampler;
+};
+static VolumeTextureFormat volumeTextureFormat(VoxelType type) {
+    switch (type) {
+        case VoxelType::UInt8:
+            return {GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE, "usampler3D"};
+        case VoxelType::Int16:
+            return {GL_R16I, GL_RED_INTEGER, GL_SHORT, "isampler3D"};
+        case VoxelType::Float32:
+            return {GL_R32F, GL_RED, GL_FLOAT, "sampler3D"};
+        case VoxelType::UInt16:
+        default:
+            return {GL_R16UI, GL_RED_INTEGER, GL_UNSIGNED_SHORT, "usampler3D"};
+    }
+}
+
+void RayCasting::uploadVolumeTexture() {
+    glm::ivec3 voxelMin, voxelMax;
+    clipping.voxelRegion(volumeData->dim, BrickGrid::BRICK_SIZE, voxelMin, voxelMax);
+    if (!volumeTextureDirty && voxelMin == textureVoxelMin && voxelMax == textureVoxelMax) return;
+
+    // sampler 类型变了，shader 需要重新编译
+    if (volumeData->type != shaderVoxelType) {
+        shaderVoxelType = volumeData->type;
+        initShaders();
+    }
+    VolumeTextureFormat textureFormat = volumeTextureFormat(volumeData->type);
+    const size_t bytesPerVoxel = voxelSize(volumeData->type);
+    // 上传的数据：默认直接从整个体数据中取裁剪盒覆盖的部分
+    const void* sourceData = volumeData->data;
+    glm::ivec3 sourceDim = volumeData->dim, sourceMin = voxelMin, sourceMax = voxelMax;
+    glm::ivec3 size = voxelMax - voxelMin;
+    // mipmap 大约多占 1/7
+    const size_t available = MemoryBudget::instance().gpuAvailable(MemoryCategory::GpuVolume);
+    textureDownsampled = (size_t)size[0] * size[1] * size[2] * bytesPerVoxel / 7 * 8 > available;
+    if (textureDownsampled) {
+        // 显存预算放不下时把整个体数据缩小到预算之内，再从缩小的数据中取裁剪盒覆盖的部分
+        if (!downsampledVolume) {
+            size_t maxVoxels = std::max<size_t>(available / 8 * 7 / bytesPerVoxel, 1);
+            downsampledVolume = new ResampledVolume(volumeData, ResampledVolume::budgetSpacing(volumeData, maxVoxels), ResampleFilter::Box);
+        }
+        sourceData = downsampledVolume->data.data();
+        sourceDim = downsampledVolume->dim;
+        clipping.voxelRegion(sourceDim, BrickGrid::BRICK_SIZE, sourceMin, sourceMax);
+        size = sourceMax - sourceMin;
+        std::cout << "GPU memory budget exceeded, downsampled to " << sourceDim[2] << "x" << sourceDim[1] << "x" << sourceDim[0] << std::endl;
+    }
+    std::cout << "binding texture 3D image " << size[2] << "x" << size[1] << "x" << size[0] << " (" << voxelTypeName(volumeData->type) << ")" << std::endl;
+    // 重新绑定 3D 纹理
+    glDeleteTextures(1, &volumeTexture);
+    glGenTextures(1, &volumeTexture);
+    glBindTexture(GL_TEXTURE_3D, volumeTexture);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    // 只上传裁剪盒覆盖的砖块，直接从整个体数据中按行跳着读，不需要先拷贝出来
+    glPixelStorei(GL_UNPACK_ALIGNMENT, (GLint)bytesPerVoxel);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, sourceDim[2]);
+    glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, sourceDim[1]);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, sourceMin[2]);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, sourceMin[1]);
+    glPixelStorei(GL_UNPACK_SKIP_IMAGES, sourceMin[0]);
+    // 注意 depth 是最外面一层，width 是最里面一层
+    glTexImage3D(GL_TEXTURE_3D, 0, textureFormat.internalFormat, size[2], size[1], size[0], 0, textureFormat.format, textureFormat.type, sourceData);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+    glPixelStorei(GL_UNPACK_SKIP_IMAGES, 0);
+    glGenerateMipmap(GL_TEXTURE_3D);
+    glBindTexture(GL_TEXTURE_3D, 0);
+    volumeTextureMemory.set((size_t)size[0] * size[1] * size[2] * bytesPerVoxel / 7 * 8);
+    // 缩小的数据只是为了下一次裁剪盒变化时不用重新计算，主机内存不够时先丢掉
+    if (downsampledVolume && MemoryBudget::instance().overHostBudget()) {
+        delete downsampledVolume;
+        downsampledVolume = nullptr;
+    }
+
+    // 纹理坐标 x, y, z 分别对应 dim[2], dim[1], dim[0]
+    glm::vec3 textureSize{sourceDim[2], sourceDim[1], sourceDim[0]};
+    textureOrigin = glm::vec3(sourceMin[2], sourceMin[1], sourceMin[0]) / textureSize;
+    textureExtent = glm::vec3(sourceMax[2], sourceMax[1], sourceMax[0]) / textureSize - textureOrigin;
+    textureVoxelMin = voxelMin;
+    textureVoxelMax = voxelMax;
+    volumeTextureDirty = false;
+}
+
+const LabelVolume* RayCasting::activeLabels() const {
+    const LabelVolume* labels = volumeData->labels;
+    return labels && !labelTable.empty() && labels->dim == volumeData->dim && labels->brickDim == brickGrid->dim ? labels : nullptr;
+}
+
+void RayCasting::uploadLabelTexture() {
+    if (!labelTextureDirty) return;
+    glDeleteTextures(1, &labelTexture);
+    labelTexture = 0;
+    labelTextureMemory.set(0);
+    labelTextureDirty = false;
+    const LabelVolume* labels = volumeData->labels;
+    if (!labels) return;
+    // 打包之后的字节直接作为整数纹理，shader 中用 texelFetch 取出字节再按位拆开，只能用最近邻
+    glGenTextures(1, &labelTexture);
+    glBindTexture(GL_TEXTURE_3D, labelTexture);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_R8UI, (GLsizei)labels->rowBytes, labels->dim[1], labels->dim[0], 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, labels->data.data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_3D, 0);
+    labelTextureMemory.set(labels->data.size());
+}
+
+void RayCasting::trackFramebufferMemory() {
+    auto pixels = [](QSize size) {
+        return size.isValid() ? (size_t)size.width() * size.height() : 0;
+    };
+    // 两张 32 位深度纹理；QOpenGLFramebufferObject 的深度和模板附件按每个像素 4 字节算
+    size_t bytes = pixels(proxyDepthSize) * 4 * 2;
+    if (lowResBuffer) bytes += pixels(lowResBuffer->size()) * (4 + 4);
+    if (accumulationBuffer) bytes += pixels(accumulationBuffer->size()) * (8 + 4);
+    if (hitBuffer) bytes += pixels(hitBuffer->size()) * (16 + 4);
+    framebufferMemory.set(bytes);
+}
+
+Clipping RayCasting::frameClipping() const {
+    Clipping result = clipping;
+    if (viewClipPlane) {
+        auto physicalSize = glm::vec3(volumeData->dim) * volumeData->spacing;
+        glm::vec3 halfSideLen = physicalSize / std::max({physicalSize.x, physicalSize.y, physicalSize.z}) / 2.f;
+        // 视线方向变换到 model 空间，平面经过 model 空间中 center 这一点
+        glm::vec3 forward = glm::normalize(glm::vec3(glm::inverse(camera.viewMatrix()) * glm::vec4(0, 0, -1, 0)));
+        glm::vec3 center = forward * viewClipOffset * glm::length(halfSideLen);
+        // 纹理坐标为 p / (2 * halfSideLen) + 0.5，法向量按逆转置变换
+        glm::vec3 normal = forward * 2.f * halfSideLen;
+        glm::vec3 centerTexCoord = center / (2.f * halfSideLen) + 0.5f;
+        result.planes.push_back(glm::vec4(normal, -glm::dot(normal, centerTexCoord)));
+    }
+    return result;
+}
+
+void RayCasting::setThreadedRendering(bool val) {
+    if (val && !renderThread) {
+        renderThread = new RenderThread;
+        // 渲染线程发出的信号在界面线程上处理，这里只保存最新的一帧
+        connect(renderThread, &RenderThread::frameReady, this, [this](const QImage& image, const RenderThread::FrameStats& stats) {
+            threadFrame = image;
+            threadStats = stats;
+            threadFrameShown = false;
+            update();
+        });
+        connect(renderThread, &RenderThread::volumeReleased, this, &RayCasting::volumeReleased);
+        renderThread->setVolumeData(volumeData);
+        renderThread->start();
+    }
+    threadedRendering = val;
+    hasPublished = false;
+    requestFrame();
+}
+
+RenderParams RayCasting::renderParams() const {
+    RenderParams params;
+    params.camera = camera;
+    params.transferFunction = transferFunction;
+    params.lighting = lighting;
+    params.renderMode = renderMode;
+    params.isoValue = isoValue;
+    params.width = std::max(1, width());
+    params.height = std::max(1, height());
+    params.stepLength = baseStepLength;
+    params.baseStepLength = baseStepLength;
+    params.backgroundColor = glm::vec3(backgroundColor.redF(), backgroundColor.greenF(), backgroundColor.blueF());
+    params.shadows = shadows;
+    params.shearWarp = shearWarp;
+    params.clipping = frameClipping();
+    params.labels = labelTable;
+    return params;
+}
+
+void RayCasting::paintThreadedFrame() {
+    // 参数变化时才发布，渲染线程正忙时新参数会覆盖还没开始渲染的旧参数
+    RenderParams params = renderParams();
+    if (!hasPublished || params != publishedParams) {
+        renderThread->publish(params, inputPending ? inputNs : inputClock.nsecsElapsed());
+        publishedParams = params;
+        hasPublished = true;
+        inputPending = false;
+    }
+    if (!threadFrameShown) {
+        inputLatencyMs = (inputClock.nsecsElapsed() - threadStats.inputNs) / 1e6;
+        threadFrameShown = true;
+    }
+    QPainter painter(this);
+    painter.fillRect(rect(), backgroundColor);
+    painter.drawImage(rect(), threadFrame);
+}
+
 void RayCasting::initializeGL() {
     initializeOpenGLFunctions();
 
@@ -69,15 +316,369 @@ void RayCasting::initializeGL() {
         std::cout << "indexBuf bind failed" << std::endl;
     }
     indexBuf.allocate(indices, sizeof(indices));
+
+    // 代理几何体在不透明度阈值变化时重新生成
+    proxyVertexBuf.create();
+    proxyVertexBuf.setUsagePattern(QOpenGLBuffer::DynamicDraw);
+    proxyIndexBuf.create();
+    proxyIndexBuf.setUsagePattern(QOpenGLBuffer::DynamicDraw);
 }
 void RayCasting::resizeGL(int w, int h) {
+    hitBufferDirty = true;
+    // 片段数变了，之前的帧时间不再有参考价值
+    qualityController.resetHistory();
 }
 void RayCasting::paintGL() {
     if (!volumeData) return;
+    if (threadedRendering) {
+        paintThreadedFrame();
+        drawOverlay();
+        return;
+    }
 
+    uploadVolumeTexture();
+    uploadLabelTexture();
+    trackFramebufferMemory();
+    collectFrameTimes();
+    // QPainter 画完 overlay 之后会修改这些状态
+    glEnable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
     // Clear color and depth buffer
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+    viewportPixels = QSize(width(), height()) * devicePixelRatio();
+    stepLength = baseStepLength;
+    if (renderMode == RenderMode::Isosurface) {
+        paintIsosurface();
+    } else {
+        paintAlphaBlending();
+    }
+    if (inputPending) {
+        inputLatencyMs = (inputClock.nsecsElapsed() - inputNs) / 1e6;
+        inputPending = false;
+    }
+    drawOverlay();
+}
+
+void RayCasting::paintAlphaBlending() {
+    RenderParams params = renderParams();
+    // 参数没有变化时继续累积，这些帧和补的最高质量帧一样不计入帧时间
+    bool accumulating = temporalAccumulation && accumulatedFrames > 0 && params == accumulationParams &&
+                        accumulationBuffer->size() == viewportPixels;
+    bool refine = refinePending || !adaptiveQuality || accumulating;
+    refinePending = false;
+    frameLevel = refine ? 0 : qualityController.level();
+    const QualityLevel& quality = QualityController::levels()[frameLevel];
+    // 降低了质量的帧在交互停下来之后补一帧最高质量的
+    if (!refine && qualityController.level() > 0) refineTimer.start();
+
+    QSize windowPixels = viewportPixels;
+    stepLength = baseStepLength * quality.stepScale;
+    if (quality.renderScale < 1) {
+        viewportPixels = QSize(std::max(1, qRound(windowPixels.width() * quality.renderScale)), std::max(1, qRound(windowPixels.height() * quality.renderScale)));
+    }
+    bool useIllumination = shadows && quality.shading == ShadingLevel::Full;
+    if (useIllumination) updateIllumination();
+    bool lowRes = viewportPixels != windowPixels;
+    // 只有最高质量、全分辨率的帧参与累积，每一帧用更大的步长和不同的抖动
+    bool accumulate = temporalAccumulation && frameLevel == 0 && !lowRes;
+    if (accumulate) {
+        if (!accumulating) {
+            if (!accumulationBuffer || accumulationBuffer->size() != viewportPixels) {
+                delete accumulationBuffer;
+                accumulationBuffer = new QOpenGLFramebufferObject(viewportPixels, QOpenGLFramebufferObject::Depth, GL_TEXTURE_2D, GL_RGBA16F);
+            }
+            accumulatedFrames = 0;
+            accumulationParams = params;
+        }
+        if (accumulatedFrames >= MAX_ACCUMULATED_FRAMES) {
+            // 已经收敛，直接显示累积的结果
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, accumulationBuffer->handle());
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, defaultFramebufferObject());
+            glBlitFramebuffer(0, 0, viewportPixels.width(), viewportPixels.height(), 0, 0, windowPixels.width(), windowPixels.height(), GL_COLOR_BUFFER_BIT, GL_NEAREST);
+            glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+            return;
+        }
+        stepLength = baseStepLength * ACCUMULATION_STEP_SCALE;
+    } else {
+        accumulatedFrames = 0;
+    }
+
+    beginFrameTimer(!refine);
+    updateProxyGeometry();
+    const bool entryClipped = nearPlaneCutsVolume();
+    renderProxyDepth(entryClipped);
+    if (accumulate) {
+        accumulationBuffer->bind();
+        glViewport(0, 0, viewportPixels.width(), viewportPixels.height());
+        glClear(accumulatedFrames == 0 ? GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT : GL_DEPTH_BUFFER_BIT);
+        // 第 n 帧（从 0 开始）的权重为 1 / (n + 1)，累积缓冲中始终是前 n + 1 帧的平均；第 0 帧直接覆盖
+        glEnable(GL_BLEND);
+        glBlendColor(0, 0, 0, 1.f / (accumulatedFrames + 1));
+        glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA);
+    } else if (lowRes) {
+        if (!lowResBuffer || lowResBuffer->size() != viewportPixels) {
+            delete lowResBuffer;
+            lowResBuffer = new QOpenGLFramebufferObject(viewportPixels, QOpenGLFramebufferObject::Depth);
+        }
+        lowResBuffer->bind();
+        glViewport(0, 0, viewportPixels.width(), viewportPixels.height());
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+    program.bind();
+    setUniforms(program);
+    program.setUniformValue("useLighting", quality.shading != ShadingLevel::Unlit);
+    program.setUniformValue("useIllumination", useIllumination);
+    program.setUniformValue("useJitter", temporalAccumulation);
+    program.setUniformValue("jitterOffset", accumulate ? jitterFrameOffset(accumulatedFrames) : 0.f);
+    program.setUniformValue("illumination", 2);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_3D, useIllumination ? illuminationTexture : 0);
+    program.setUniformValue("proxyEntry", 3);
+    program.setUniformValue("proxyExit", 4);
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_2D, proxyDepthTexture[0]);
+    glActiveTexture(GL_TEXTURE4);
+    glBindTexture(GL_TEXTURE_2D, proxyDepthTexture[1]);
+    setLabelUniforms(program, 5);
+    program.setUniformValue("entryClipped", entryClipped);
+    glEnable(GL_CULL_FACE);
+    if (entryClipped) {
+        // 正面可能被近平面裁掉，改为画包围盒的背面，每个像素正好一个片元，光线从包围盒的入口（最近为 t = 0）开始
+        glCullFace(GL_FRONT);
+        drawProxyGeometry(program, false);
+    } else {
+        // 只画正面，每个像素从离眼睛最近的不透明砖块开始步进
+        glCullFace(GL_BACK);
+        drawProxyGeometry(program, true);
+    }
+    glDisable(GL_CULL_FACE);
+    if (accumulate) {
+        glDisable(GL_BLEND);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, accumulationBuffer->handle());
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, defaultFramebufferObject());
+        glBlitFramebuffer(0, 0, viewportPixels.width(), viewportPixels.height(), 0, 0, windowPixels.width(), windowPixels.height(), GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+        // 没有输入事件时也继续渲染下一帧，直到累积够 MAX_ACCUMULATED_FRAMES 帧
+        if (++accumulatedFrames < MAX_ACCUMULATED_FRAMES) update();
+    } else if (lowRes) {
+        // 放大到窗口大小
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, lowResBuffer->handle());
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, defaultFramebufferObject());
+        glBlitFramebuffer(0, 0, viewportPixels.width(), viewportPixels.height(), 0, 0, windowPixels.width(), windowPixels.height(), GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+        glViewport(0, 0, windowPixels.width(), windowPixels.height());
+    }
+    endFrameTimer();
+}
+
+void RayCasting::updateProxyGeometry() {
+    if (!proxyDirty && proxyOpacityThreshold == transferFunction.opacityThreshold) return;
+
+    auto occupancy = brickGrid->occupancy(transferFunction);
+    if (const LabelVolume* labels = activeLabels()) labels->applyTo(occupancy, labelTable);
+    if (clipping.isCropped()) {
+        glm::ivec3 voxelMin, voxelMax;
+        clipping.voxelRegion(volumeData->dim, 1, voxelMin, voxelMax);
+        brickGrid->restrictTo(occupancy, voxelMin, voxelMax);
+    }
+    std::vector<float> proxyVertices;
+    std::vector<unsigned int> proxyIndices;
+    brickGrid->buildProxyMesh(occupancy, proxyVertices, proxyIndices);
+    proxyVertexBuf.bind();
+    proxyVertexBuf.allocate(proxyVertices.data(), (int)(proxyVertices.size() * sizeof(float)));
+    proxyIndexBuf.bind();
+    proxyIndexBuf.allocate(proxyIndices.data(), (int)(proxyIndices.size() * sizeof(unsigned int)));
+    proxyIndexCount = (int)proxyIndices.size();
+    occupiedRatio = occupancy.empty() ? 0 : std::count(occupancy.begin(), occupancy.end(), 1) / (float)occupancy.size();
+
+    proxyOpacityThreshold = transferFunction.opacityThreshold;
+    proxyDirty = false;
+}
+
+bool RayCasting::nearPlaneCutsVolume() const {
+    auto physicalSize = glm::vec3(volumeData->dim) * volumeData->spacing;
+    glm::vec3 halfSideLen = physicalSize / std::max({physicalSize.x, physicalSize.y, physicalSize.z}) / 2.f;
+    glm::vec3 eye = glm::vec3(glm::inverse(camera.viewMatrix()) * glm::vec4(0, 0, 0, 1));
+    // 近平面上离眼睛最远的是四个角，包围盒离眼睛比这更近时近平面可能和它相交
+    float tanHalfFov = std::tan(glm::radians(camera.fov) / 2.f);
+    float aspectRatio = (float)width() / height();
+    float nearCorner = camera.zNear * std::sqrt(1 + tanHalfFov * tanHalfFov * (1 + aspectRatio * aspectRatio));
+    return glm::length(glm::max(glm::abs(eye) - halfSideLen, glm::vec3(0.f))) <= nearCorner;
+}
+
+void RayCasting::renderProxyDepth(bool entryClipped) {
+    if (proxyDepthSize != viewportPixels) {
+        glDeleteFramebuffers(2, proxyDepthFbo);
+        glDeleteTextures(2, proxyDepthTexture);
+        glGenFramebuffers(2, proxyDepthFbo);
+        glGenTextures(2, proxyDepthTexture);
+        for (int i = 0; i < 2; i++) {
+            glBindTexture(GL_TEXTURE_2D, proxyDepthTexture[i]);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, viewportPixels.width(), viewportPixels.height(), 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+            glBindFramebuffer(GL_FRAMEBUFFER, proxyDepthFbo[i]);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, proxyDepthTexture[i], 0);
+            GLenum none = GL_NONE;
+            glDrawBuffers(1, &none);
+            glReadBuffer(GL_NONE);
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        proxyDepthSize = viewportPixels;
+    }
+
+    glViewport(0, 0, viewportPixels.width(), viewportPixels.height());
+    proxyDepthProgram.bind();
+    setUniforms(proxyDepthProgram);
+    glEnable(GL_CULL_FACE);
+    if (!entryClipped) {
+        // 入口：正面中最近的深度
+        glBindFramebuffer(GL_FRAMEBUFFER, proxyDepthFbo[0]);
+        glClearDepthf(1);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        glDepthFunc(GL_LESS);
+        glCullFace(GL_BACK);
+        drawProxyGeometry(proxyDepthProgram, true);
+    }
+    // 出口：背面中最远的深度
+    glBindFramebuffer(GL_FRAMEBUFFER, proxyDepthFbo[1]);
+    glClearDepthf(0);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    glDepthFunc(GL_GREATER);
+    glCullFace(GL_FRONT);
+    drawProxyGeometry(proxyDepthProgram, true);
+
+    glClearDepthf(1);
+    glDepthFunc(GL_LESS);
+    glDisable(GL_CULL_FACE);
+    glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+    glViewport(0, 0, width() * devicePixelRatio(), height() * devicePixelRatio());
+}
+
+void RayCasting::beginFrameTimer(bool record) {
+    if (!timerQueries[0]) glGenQueries(2, timerQueries);
+    // 上一次用这个查询的帧还没有结果，直接丢弃
+    glBeginQuery(GL_TIME_ELAPSED, timerQueries[timerIndex]);
+    timerPending[timerIndex] = true;
+    timerRecord[timerIndex] = record && adaptiveQuality;
+}
+
+void RayCasting::endFrameTimer() {
+    glEndQuery(GL_TIME_ELAPSED);
+    timerIndex = 1 - timerIndex;
+}
+
+void RayCasting::collectFrameTimes() {
+    // timerIndex 指向的是较早的那一帧
+    for (int i = 0; i < 2; i++) {
+        int q = (timerIndex + i) % 2;
+        if (!timerPending[q]) continue;
+        GLuint available = 0;
+        glGetQueryObjectuiv(timerQueries[q], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) break;
+        GLuint ns = 0;
+        glGetQueryObjectuiv(timerQueries[q], GL_QUERY_RESULT, &ns);
+        timerPending[q] = false;
+        lastFrameMs = ns / 1e6;
+        if (timerRecord[q] && qualityController.addFrameTime(lastFrameMs)) {
+            emit qualityChanged(qualityController.level());
+            update();
+        }
+    }
+}
+
+void RayCasting::drawOverlay() {
+    if (!showOverlay) return;
+    QString text;
+    if (threadedRendering) {
+        text = QString("CPU render thread%1: %2 ms, %3 requests coalesced")
+                   .arg(shearWarp ? " (shear-warp)" : "")
+                   .arg(threadStats.renderMs, 0, 'f', 1)
+                   .arg(threadStats.coalesced);
+    } else if (renderMode == RenderMode::Isosurface) {
+        text = "Isosurface";
+    } else {
+        const QualityLevel& quality = QualityController::levels()[frameLevel];
+        text = QString("Quality %1/%2: step x%3, scale %4%, %5\nGPU %6 ms, target %7 ms, %8% bricks occupied")
+                   .arg(frameLevel)
+                   .arg(QualityController::levels().size() - 1)
+                   .arg(quality.stepScale)
+                   .arg(qRound(quality.renderScale * 100))
+                   .arg(QualityController::shadingName(quality.shading))
+                   .arg(lastFrameMs, 0, 'f', 1)
+                   .arg(qualityController.targetFrameMs, 0, 'f', 1)
+                   .arg(qRound(occupiedRatio * 100));
+        if (!adaptiveQuality) text += " (adaptive quality off)";
+        if (temporalAccumulation) text += QString("\nAccumulated %1/%2 frames").arg(accumulatedFrames).arg(MAX_ACCUMULATED_FRAMES);
+    }
+    text += QString("\nInput latency %1 ms").arg(inputLatencyMs, 0, 'f', 1);
+    MemoryBudget::Usage memory = MemoryBudget::instance().usage();
+    text += QString("\nMemory: host %1 MB, GPU %2 MB").arg(memory.hostBytes >> 20).arg(memory.gpuBytes >> 20);
+    if (textureDownsampled) text += " (volume downsampled to fit the GPU budget)";
+    QPainter painter(this);
+    painter.setPen(Qt::white);
+    painter.drawText(rect().adjusted(8, 8, -8, -8), Qt::AlignLeft | Qt::AlignTop, text);
+}
+
+void RayCasting::updateIllumination() {
+    if (!illumination) illumination = new IlluminationVolume(volumeData);
+    bool changed = illumination->update(transferFunction, IlluminationVolume::lightDirection(camera, lighting));
+    if (!changed && illuminationTexture != 0) return;
+
+    if (illuminationTexture == 0) {
+        glGenTextures(1, &illuminationTexture);
+        glBindTexture(GL_TEXTURE_3D, illuminationTexture);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+    glBindTexture(GL_TEXTURE_3D, illuminationTexture);
+    // 每个格子两个字节，行长度不一定是 4 的倍数
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    const glm::ivec3& dim = illumination->dim;
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_RG8, dim[2], dim[1], dim[0], 0, GL_RG, GL_UNSIGNED_BYTE, illumination->data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_3D, 0);
+    illuminationTextureMemory.set((size_t)dim[0] * dim[1] * dim[2] * 2);
+}
+
+void RayCasting::paintIsosurface() {
+    QSize size = QSize(width(), height()) * devicePixelRatio();
+    if (!hitBuffer || hitBuffer->size() != size) {
+        delete hitBuffer;
+        QOpenGLFramebufferObjectFormat format;
+        format.setInternalTextureFormat(GL_RGBA32F);
+        hitBuffer = new QOpenGLFramebufferObject(size, format);
+        hitBufferDirty = true;
+    }
+    // 第一遍：光线步进找到交点写入命中缓冲，只改光照或颜色时跳过
+    if (hitBufferDirty) {
+        hitBuffer->bind();
+        glViewport(0, 0, size.width(), size.height());
+        glClearColor(0, 0, 0, 0);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        isosurfaceHitProgram.bind();
+        setUniforms(isosurfaceHitProgram);
+        drawProxyGeometry(isosurfaceHitProgram);
+        glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+        glClearColor(backgroundColor.redF(), backgroundColor.greenF(), backgroundColor.blueF(), backgroundColor.alphaF());
+        hitBufferDirty = false;
+    }
+    // 第二遍：只对交点着色
+    isosurfaceShadeProgram.bind();
+    setUniforms(isosurfaceShadeProgram);
+    isosurfaceShadeProgram.setUniformValue("hitBuffer", 1);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, hitBuffer->texture());
+    drawProxyGeometry(isosurfaceShadeProgram);
+}
+
+void RayCasting::setUniforms(QOpenGLShaderProgram& program) {
     QMatrix4x4 model, view, projection;
 
     auto physicalSize = glm::vec3(volumeData->dim) * volumeData->spacing;
@@ -88,13 +689,12 @@ void RayCasting::paintGL() {
     model.scale(halfSideLen);
 
     // 在 shader 里面 texture 采样的时候用的索引是没有旋转的，都是在 [0, 1) 区间内的采样，因此我们只能通过 view 的逆旋转表示 model 的旋转
-    view.rotate(QQuaternion(curr_quat[3], -curr_quat[0], -curr_quat[1], -curr_quat[2]));
-    auto lookAtMatrix = glm::lookAt(eye, lookat, up);
-    auto p = glm::value_ptr(lookAtMatrix);
-    view = QMatrix4x4(p).transposed() * view;
+    auto viewMatrix = camera.viewMatrix();
+    auto p = glm::value_ptr(viewMatrix);
+    view = QMatrix4x4(p).transposed();
 
     float aspectRatio = (float)width() / height();
-    projection.perspective(fov, aspectRatio, zNear, zFar);
+    projection.perspective(camera.fov, aspectRatio, camera.zNear, camera.zFar);
 
     auto mvpMatrix = projection * view * model;
     program.setUniformValue("modelMatrix", model);
@@ -102,38 +702,86 @@ void RayCasting::paintGL() {
     program.setUniformValue("projectionMatrix", projection);
     program.setUniformValue("mvpMatrix", mvpMatrix);
 
-    program.setUniformValue("viewportSize", QVector2D{(float)width(), (float)height()});
+    // gl_FragCoord 是以物理像素为单位的
+    program.setUniformValue("viewportSize", QVector2D{(float)viewportPixels.width(), (float)viewportPixels.height()});
     // raycasting 的计算过程都是在缩放之后的单位 identityCube 上进行的，计算出结果之后再进行 view 变换展示出来
     // view 变换之后要保证眼睛在圆心，相当于倒推眼睛在哪里
     // 同样 view 变换之后眼睛距离渲染平面的距离为 focalLength，视角为 fov，在 shader 中计算出来的光线方向也是需要进行 view 逆变换到世界坐标系的
     program.setUniformValue("rayOrigin", view.inverted() * QVector3D({0.0, 0.0, 0.0}));
     program.setUniformValue("aspectRatio", aspectRatio);
-    program.setUniformValue("focalLength", focalLength);
+    program.setUniformValue("focalLength", camera.focalLength());
+    program.setUniformValue("zNear", camera.zNear);
+    program.setUniformValue("zFar", camera.zFar);
 
     program.setUniformValue("top", halfSideLen);
     program.setUniformValue("bottom", -halfSideLen);
-    program.setUniformValue("stepLength", 0.001f);
+    Clipping clip = frameClipping();
+    program.setUniformValue("cropMin", clip.boxMin.x, clip.boxMin.y, clip.boxMin.z);
+    program.setUniformValue("cropMax", clip.boxMax.x, clip.boxMax.y, clip.boxMax.z);
+    QVector4D clipPlanes[Clipping::MAX_PLANES];
+    int clipPlaneCount = std::min((int)clip.planes.size(), Clipping::MAX_PLANES);
+    for (int i = 0; i < clipPlaneCount; i++) {
+        clipPlanes[i] = QVector4D(clip.planes[i].x, clip.planes[i].y, clip.planes[i].z, clip.planes[i].w);
+    }
+    program.setUniformValueArray("clipPlanes", clipPlanes, Clipping::MAX_PLANES);
+    program.setUniformValue("clipPlaneCount", clipPlaneCount);
+    program.setUniformValue("textureOrigin", textureOrigin.x, textureOrigin.y, textureOrigin.z);
+    program.setUniformValue("textureExtent", textureExtent.x, textureExtent.y, textureExtent.z);
+    program.setUniformValue("valueScale", volumeData->valueScale);
+    program.setUniformValue("valueOffset", volumeData->valueOffset);
+    program.setUniformValue("stepLength", stepLength);
+    program.setUniformValue("baseStepLength", baseStepLength);
     program.setUniformValue("backgroundColor", QVector3D(backgroundColor.redF(), backgroundColor.greenF(), backgroundColor.blueF()));
     program.setUniformValue("gamma", 2.2f);
 
     program.setUniformValue("normalMatrix", (view * model).normalMatrix());
-    program.setUniformValue("light.position", 1.2f, 1.0f, 2.0f);
-    program.setUniformValue("light.ambient", 0.2f, 0.2f, 0.2f, 1.f);
-    program.setUniformValue("light.diffuse", 0.5f, 0.5f, 0.5f, 1.f);
-    program.setUniformValue("light.specular", 1.0f, 1.0f, 1.0f, 1.f);
+    program.setUniformValue("light.position", lighting.position.x, lighting.position.y, lighting.position.z);
+    program.setUniformValue("light.ambient", lighting.ambient.r, lighting.ambient.g, lighting.ambient.b, lighting.ambient.a);
+    program.setUniformValue("light.diffuse", lighting.diffuse.r, lighting.diffuse.g, lighting.diffuse.b, lighting.diffuse.a);
+    program.setUniformValue("light.specular", lighting.specular.r, lighting.specular.g, lighting.specular.b, lighting.specular.a);
     // material properties
-    program.setUniformValue("material.specular", 1.f, 1.f, 1.f, 0.f);
-    program.setUniformValue("material.shininess", 32.0f);
+    program.setUniformValue("material.specular", lighting.materialSpecular.r, lighting.materialSpecular.g, lighting.materialSpecular.b, lighting.materialSpecular.a);
+    program.setUniformValue("material.shininess", lighting.shininess);
     program.setUniformValue("reverseGradient", volumeData->reverseGradientDirection);
+    // 光源位置变换到 model 空间，每一帧在 CPU 上只算一次
+    program.setUniformValue("lightPosition", (view.inverted() * QVector4D(lighting.position.x, lighting.position.y, lighting.position.z, 0)).toVector3D());
+
+    program.setUniformValue("opacityThreshold", transferFunction.opacityThreshold);
+    program.setUniformValue("colorThreshold", transferFunction.colorThreshold);
+    program.setUniformValue("isoValue", isoValue);
+    auto surfaceColor = transferFunction(isoValue);
+    program.setUniformValue("surfaceColor", surfaceColor.r, surfaceColor.g, surfaceColor.b);
+}
 
-    program.setUniformValue("opacityThreshold", opacityThreshold);
-    program.setUniformValue("colorThreshold", colorThreshold);
+void RayCasting::setLabelUniforms(QOpenGLShaderProgram& program, int unit) {
+    const LabelVolume* labels = activeLabels();
+    program.setUniformValue("useLabels", labels != nullptr);
+    program.setUniformValue("labels", unit);
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_3D, labels ? labelTexture : 0);
+    if (!labels) return;
+    program.setUniformValue("labelBits", labels->bits);
+    // QOpenGLShaderProgram 没有 ivec3 的重载，program 已经 bind 过了
+    glUniform3i(program.uniformLocation("labelDim"), labels->dim[2], labels->dim[1], labels->dim[0]);
+    QVector4D colors[LabelTable::MAX_LABELS];
+    for (int i = 1; i < LabelTable::MAX_LABELS; i++) {
+        glm::vec4 c = labelTable(i);
+        colors[i] = QVector4D(c.r, c.g, c.b, c.a);
+    }
+    program.setUniformValueArray("labelColors", colors, LabelTable::MAX_LABELS);
+    program.setUniformValue("unlabeledVisible", labelTable.unlabeledVisible());
+}
 
+void RayCasting::drawProxyGeometry(QOpenGLShaderProgram& program, bool occupied) {
+    QOpenGLBuffer& vertexBuf = occupied ? proxyVertexBuf : arrayBuf;
+    QOpenGLBuffer& elementBuf = occupied ? proxyIndexBuf : indexBuf;
+    int count = occupied ? proxyIndexCount : sizeof(indices) / sizeof(int);
+    if (count == 0) return;
     // Tell OpenGL which VBOs to use
-    if (!arrayBuf.bind()) {
+    if (!vertexBuf.bind()) {
         std::cout << "arrayBuf bind failed" << std::endl;
     }
-    if (!indexBuf.bind()) {
+    if (!elementBuf.bind()) {
         std::cout << "indexBuf bind failed" << std::endl;
     }
     program.setAttributeBuffer(0, GL_FLOAT, 0, 3, 0);
@@ -145,26 +793,40 @@ void RayCasting::paintGL() {
     // glPolygonMode(GL_FRONT_AND_BACK,GL_FILL);
     GLCheckError();
     // type: Must be one of GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT, or GL_UNSIGNED_INT.
-    glDrawElements(GL_TRIANGLES, sizeof(indices) / sizeof(int), GL_UNSIGNED_INT, nullptr);
+    glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, nullptr);
     GLCheckError();
 }
 
 void RayCasting::initShaders() {
-    // Compile vertex shader
-    if (!program.addShaderFromSourceFile(QOpenGLShader::Vertex, ":/shaders/alpha_blending.vs"))
+    for (auto p : {&program, &isosurfaceHitProgram, &isosurfaceShadeProgram, &proxyDepthProgram}) {
+        p->removeAllShaders();
+    }
+    if (!buildProgram(program, ":/shaders/alpha_blending.vs", ":/shaders/alpha_blending.fs") ||
+        !buildProgram(isosurfaceHitProgram, ":/shaders/alpha_blending.vs", ":/shaders/isosurface_hit.fs") ||
+        !buildProgram(isosurfaceShadeProgram, ":/shaders/alpha_blending.vs", ":/shaders/isosurface_shade.fs") ||
+        !buildProgram(proxyDepthProgram, ":/shaders/alpha_blending.vs", ":/shaders/proxy_depth.fs"))
         close();
+}
 
-    // Compile fragment shader
-    if (!program.addShaderFromSourceFile(QOpenGLShader::Fragment, ":/shaders/alpha_blending.fs"))
-        close();
+bool RayCasting::buildProgram(QOpenGLShaderProgram& program, const QString& vertexShader, const QString& fragmentShader) {
+    // Compile vertex shader
+    if (!program.addShaderFromSourceFile(QOpenGLShader::Vertex, vertexShader))
+        return false;
+
+    // Compile fragment shader，在 #version 之后定义体素类型对应的 sampler
+    QFile file(fragmentShader);
+    if (!file.open(QIODevice::ReadOnly)) {
+        std::cout << "cannot open " << fragmentShader.toStdString() << std::endl;
+        return false;
+    }
+    QByteArray source = file.readAll();
+    int versionEnd = source.indexOf('\n') + 1;
+    source.insert(versionEnd, QByteArray("#define VOLUME_SAMPLER ") + volumeTextureFormat(shaderVoxelType).sampler + "\n");
+    if (!program.addShaderFromSourceCode(QOpenGLShader::Fragment, source))
+        return false;
 
     // Link shader pipeline
-    if (!program.link())
-        close();
-
-    // Bind shader pipeline for use
-    if (!program.bind())
-        close();
+    return program.link();
 }
 
 QPointF RayCasting::pixel_pos_to_view_pos(const QPointF& p) {
@@ -208,21 +870,25 @@ void RayCasting::mouseMoveEvent(QMouseEvent* e) {
             rotScale * (2.0f * mouse.x() - width()) / (float)width(),
             rotScale * (height() - 2.0f * mouse.y()) / (float)height());
 
-        add_quats(prev_quat, curr_quat, curr_quat);
+        add_quats(prev_quat, camera.quat, camera.quat);
     }
     // 中间键移动
     else if (mouseMiddlePressed) {
-        eye[0] -= transScale * (mouse.x() - prevMouse.x()) / (float)width();
-        lookat[0] -= transScale * (mouse.x() - prevMouse.x()) / (float)width();
-        eye[1] += transScale * (mouse.y() - prevMouse.y()) / (float)height();
-        lookat[1] += transScale * (mouse.y() - prevMouse.y()) / (float)height();
+        camera.eye[0] -= transScale * (mouse.x() - prevMouse.x()) / (float)width();
+        camera.lookat[0] -= transScale * (mouse.x() - prevMouse.x()) / (float)width();
+        camera.eye[1] += transScale * (mouse.y() - prevMouse.y()) / (float)height();
+        camera.lookat[1] += transScale * (mouse.y() - prevMouse.y()) / (float)height();
     }
     // 右键缩放
     else if (mouseRightPressed) {
-        eye[2] += transScale * (mouse.y() - prevMouse.y()) / (float)height();
-        lookat[2] += transScale * (mouse.y() - prevMouse.y()) / (float)height();
+        camera.eye[2] += transScale * (mouse.y() - prevMouse.y()) / (float)height();
+        camera.lookat[2] += transScale * (mouse.y() - prevMouse.y()) / (float)height();
     }
     prevMouse = mouse;
+    if (mouseLeftPressed || mouseMiddlePressed || mouseRightPressed) {
+        hitBufferDirty = true;
+        emit cameraChanged(camera);
+    }
     // Request an update
-    update();
+    requestFrame();
 }
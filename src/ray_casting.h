@@ -1,6 +1,8 @@
 ﻿#pragma once
+#include <QOpenGLFramebufferObject>
 #include <QOpenGLFunctions>
 #include <QOpenGLWidget>
+#include <QTimer>
 #include <QtMath>
 #include <QtWidgets>
 #include <glm/glm.hpp>
@@ -8,6 +10,14 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <iostream>
 
+#include "brick_grid.h"
+#include "illumination_volume.h"
+#include "label_volume.h"
+#include "memory_budget.h"
+#include "quality_controller.h"
+#include "render_params.h"
+#include "render_thread.h"
+#include "resampled_volume.h"
 #include "trackball.h"
 #include "volume_data.h"
 
@@ -18,19 +28,126 @@ class RayCasting : public QOpenGLWidget, protected QOpenGLExtraFunctions {
     ~RayCasting();
     void setVolumeData(VolumeData* volumeData);
     inline void setOpacityThreshold(float val) {
-        opacityThreshold = val;
-        update();
+        transferFunction.opacityThreshold = val;
+        requestFrame();
     }
     inline float getOpacityThreshold() {
-        return opacityThreshold;
+        return transferFunction.opacityThreshold;
     }
     inline float getColorThreshold() {
-        return colorThreshold;
+        return transferFunction.colorThreshold;
     }
     inline void setColorThreshold(float val) {
-        colorThreshold = val;
-        update();
+        transferFunction.colorThreshold = val;
+        requestFrame();
+    }
+    inline const Camera& getCamera() const {
+        return camera;
+    }
+    inline void setRenderMode(RenderMode mode) {
+        renderMode = mode;
+        requestFrame();
+    }
+    inline RenderMode getRenderMode() const {
+        return renderMode;
+    }
+    inline void setIsoValue(float val) {
+        isoValue = val;
+        hitBufferDirty = true;
+        requestFrame();
+    }
+    inline float getIsoValue() const {
+        return isoValue;
+    }
+    // 只改变光照时等值面模式不需要重新做光线步进
+    inline void setLighting(const Lighting& val) {
+        lighting = val;
+        requestFrame();
+    }
+    inline const Lighting& getLighting() const {
+        return lighting;
+    }
+    // alpha blending 模式下的阴影和环境光遮蔽
+    inline void setShadows(bool val) {
+        shadows = val;
+        requestFrame();
+    }
+    inline bool getShadows() const {
+        return shadows;
+    }
+    // alpha blending 模式下根据 GPU 帧时间自动调整步长、渲染分辨率和光照，关闭时始终使用最高质量
+    inline void setAdaptiveQuality(bool val) {
+        adaptiveQuality = val;
+        qualityController.setLevel(0);
+        requestFrame();
+    }
+    inline bool getAdaptiveQuality() const {
+        return adaptiveQuality;
+    }
+    inline QualityController& getQualityController() {
+        return qualityController;
+    }
+    // 左上角显示当前质量等级和帧时间
+    inline void setShowOverlay(bool val) {
+        showOverlay = val;
+        requestFrame();
+    }
+    // 裁剪盒变化时只重新上传它覆盖的砖块，代理几何体也只保留裁剪盒里面的砖块
+    inline void setClipping(const Clipping& val) {
+        if (val.boxMin != clipping.boxMin || val.boxMax != clipping.boxMax) proxyDirty = true;
+        clipping = val;
+        hitBufferDirty = true;
+        requestFrame();
     }
+    inline const Clipping& getClipping() const {
+        return clipping;
+    }
+    // 体数据带有 LabelVolume 时每个标签的颜色、不透明度和是否显示，隐藏的标签所在的砖块从代理几何体中去掉
+    inline void setLabelTable(const LabelTable& val) {
+        labelTable = val;
+        proxyDirty = true;
+        requestFrame();
+    }
+    inline const LabelTable& getLabelTable() const {
+        return labelTable;
+    }
+    // 垂直于视线方向的裁剪平面，随相机旋转，切掉离眼睛近的一侧；offset 在 [-1, 1] 之间，0 时经过体数据中心
+    inline void setViewClipPlane(bool enabled, float offset) {
+        viewClipPlane = enabled;
+        viewClipOffset = offset;
+        hitBufferDirty = true;
+        requestFrame();
+    }
+    // 相机和传输函数不变时，用抖动的光线起点和更大的步长渲染多帧并逐帧平均，参数变化时重新开始
+    inline void setTemporalAccumulation(bool val) {
+        temporalAccumulation = val;
+        accumulatedFrames = 0;
+        requestFrame();
+    }
+    inline bool getTemporalAccumulation() const {
+        return temporalAccumulation;
+    }
+    // 在单独的线程上用 CPU 渲染，界面线程只发布参数和显示最新的一帧
+    void setThreadedRendering(bool val);
+    inline bool getThreadedRendering() const {
+        return threadedRendering;
+    }
+    // CPU 渲染线程用 shear-warp 代替 ray casting，速度快很多，适合快速预览
+    inline void setShearWarp(bool val) {
+        shearWarp = val;
+        requestFrame();
+    }
+    inline bool getShearWarp() const {
+        return shearWarp;
+    }
+    // 当前状态对应的渲染参数，和 GPU 最高质量时的参数一致
+    RenderParams renderParams() const;
+
+   signals:
+    void cameraChanged(const Camera& camera);
+    void qualityChanged(int level);
+    // setVolumeData 换下来的体数据已经不再使用，可以释放；开着渲染线程时要等它换上新的体数据之后才发出
+    void volumeReleased(const VolumeData* volumeData);
 
    protected:
     void mousePressEvent(QMouseEvent* e) override;
@@ -42,28 +159,145 @@ class RayCasting : public QOpenGLWidget, protected QOpenGLExtraFunctions {
     void paintGL() override;
 
     void initShaders();
+    bool buildProgram(QOpenGLShaderProgram& program, const QString& vertexShader, const QString& fragmentShader);
+    void setUniforms(QOpenGLShaderProgram& program);
+    // 标签纹理绑定到 unit，标签表转换成 shader 中的 labelColors
+    void setLabelUniforms(QOpenGLShaderProgram& program, int unit);
+    // occupied 为 true 时画不透明砖块的外表面，否则画整个包围盒
+    void drawProxyGeometry(QOpenGLShaderProgram& program, bool occupied = false);
+    void updateProxyGeometry();
+    // 眼睛在包围盒里面或者近平面和包围盒相交时，代理几何体的正面可能被近平面裁掉
+    bool nearPlaneCutsVolume() const;
+    // entryClipped 为 true 时不画入口，光线从包围盒的入口开始
+    void renderProxyDepth(bool entryClipped);
+    void paintAlphaBlending();
+    void paintIsosurface();
+    void drawOverlay();
+    void beginFrameTimer(bool record);
+    void endFrameTimer();
+    void collectFrameTimes();
+    void updateIllumination();
+    void uploadVolumeTexture();
+    void uploadLabelTexture();
+    // 按当前分配的帧缓冲统计显存
+    void trackFramebufferMemory();
+    // 当前体数据的标签，没有或者没有设置标签表时为空
+    const LabelVolume* activeLabels() const;
+    // 加上视线方向裁剪平面之后这一帧实际使用的裁剪参数
+    Clipping frameClipping() const;
+    void paintThreadedFrame();
+    // 输入事件触发的重绘，记录第一个还没有显示出来的输入事件的时间，用来统计输入延迟
+    inline void requestFrame() {
+        if (!inputPending) {
+            inputNs = inputClock.nsecsElapsed();
+            inputPending = true;
+        }
+        update();
+    }
 
    private:
-    float opacityThreshold = 1800.f, colorThreshold = 2482.f;
+    TransferFunction transferFunction;
+    Lighting lighting;
+    RenderMode renderMode = RenderMode::AlphaBlending;
+    float isoValue = 2000.f;
+    bool shadows = false;
+    bool shearWarp = false;
+    Clipping clipping;
+    LabelTable labelTable;
+    bool viewClipPlane = false;
+    float viewClipOffset = 0;
 
     QPointF pixel_pos_to_view_pos(const QPointF& p);
 
     VolumeData* volumeData;
     GLuint volumeTexture = 0;
+    // shader 当前按哪种体素类型编译的
+    VoxelType shaderVoxelType = VoxelType::UInt16;
+    // 纹理中实际上传的体素范围 [textureVoxelMin, textureVoxelMax)，顺序为 (z, y, x)，体数据或者裁剪盒变化时重新上传
+    glm::ivec3 textureVoxelMin{0}, textureVoxelMax{0};
+    // 纹理覆盖的范围在整个体数据的纹理坐标下的起点和大小
+    glm::vec3 textureOrigin{0.f}, textureExtent{1.f};
+    bool volumeTextureDirty = true;
+    bool textureDownsampled = false;
+    // 显存预算放不下时上传的缩小的整个体数据，裁剪盒变化时直接从中取出子区域；体数据变化或者主机内存超过预算时释放
+    ResampledVolume* downsampledVolume = nullptr;
+    // 打包的标签，和体数据一起更新，总是上传整个体数据的标签
+    GLuint labelTexture = 0;
+    bool labelTextureDirty = true;
     QColor backgroundColor = QColor(41, 65, 71);
 
     QOpenGLShaderProgram program;
+    // 等值面模式：第一遍把每个像素的交点写入 hitBuffer，第二遍只对交点着色
+    QOpenGLShaderProgram isosurfaceHitProgram, isosurfaceShadeProgram;
+    QOpenGLFramebufferObject* hitBuffer = nullptr;
+    // 相机、isoValue、体数据或者窗口大小改变之后需要重新计算交点
+    bool hitBufferDirty = true;
+    // 第一次打开阴影时才创建，传输函数或者光源方向变化时增量更新后重新上传
+    IlluminationVolume* illumination = nullptr;
+    GLuint illuminationTexture = 0;
+    TrackedMemory volumeTextureMemory{MemoryCategory::GpuVolume};
+    TrackedMemory labelTextureMemory{MemoryCategory::GpuLabels};
+    TrackedMemory illuminationTextureMemory{MemoryCategory::GpuIllumination};
+    TrackedMemory framebufferMemory{MemoryCategory::GpuFramebuffers};
+
+    QualityController qualityController;
+    bool adaptiveQuality = true, showOverlay = true;
+    // 降低分辨率时先渲染到这里，再放大到窗口
+    QOpenGLFramebufferObject* lowResBuffer = nullptr;
+    // 时间累积：每一帧按 1 / (n + 1) 的权重混合到浮点的累积缓冲中，再复制到窗口
+    static constexpr int MAX_ACCUMULATED_FRAMES = 16;
+    static constexpr float ACCUMULATION_STEP_SCALE = 4.f;
+    bool temporalAccumulation = false;
+    QOpenGLFramebufferObject* accumulationBuffer = nullptr;
+    // 累积缓冲中的帧对应的参数，和当前参数不同时重新开始累积
+    RenderParams accumulationParams;
+    int accumulatedFrames = 0;
+    // 当前这一帧实际使用的步长和渲染分辨率，基础步长为半个体素
+    float baseStepLength = 0.001f, stepLength = 0.001f;
+    QSize viewportPixels;
+    // 当前画面实际使用的质量等级，补的最高质量帧为 0
+    int frameLevel = 0;
+    // 交互停下来之后再用最高质量渲染一帧，这一帧不计入帧时间
+    QTimer refineTimer;
+    bool refinePending = false;
+    // GL_TIME_ELAPSED 查询，两个轮流使用，读取上一帧的结果时不需要等待 GPU
+    GLuint timerQueries[2] = {0, 0};
+    bool timerPending[2] = {false, false}, timerRecord[2] = {false, false};
+    int timerIndex = 0;
+    double lastFrameMs = 0;
+    // 输入延迟：输入事件到对应的一帧画出来的时间（GPU 渲染时到提交完这一帧为止）
+    QElapsedTimer inputClock;
+    qint64 inputNs = 0;
+    bool inputPending = false;
+    double inputLatencyMs = 0;
+
+    // CPU 渲染线程，第一次打开时才创建
+    RenderThread* renderThread = nullptr;
+    bool threadedRendering = false;
+    // 参数没有变化时不重复发布，避免收到新的一帧之后的重绘又触发一次渲染
+    RenderParams publishedParams;
+    bool hasPublished = false;
+    QImage threadFrame;
+    RenderThread::FrameStats threadStats;
+    bool threadFrameShown = true;
+
+    // alpha blending 模式下用不透明砖块的外表面代替包围盒，不透明度阈值变化时重新生成
+    BrickGrid* brickGrid = nullptr;
+    QOpenGLBuffer proxyVertexBuf, proxyIndexBuf;
+    int proxyIndexCount = 0;
+    bool proxyDirty = true;
+    float proxyOpacityThreshold = 0;
+    float occupiedRatio = 0;
+    // 代理几何体正面（光线入口）和背面（光线出口）的深度纹理
+    QOpenGLShaderProgram proxyDepthProgram;
+    GLuint proxyDepthFbo[2] = {0, 0}, proxyDepthTexture[2] = {0, 0};
+    QSize proxyDepthSize;
     QMatrix4x4 projection;
-    float zNear = 0.1f, zFar = 100.0f, fov = 60.0f;
-    float focalLength = 1.0 / qTan(M_PI / 180.0 * fov / 2.0);
+    Camera camera;
 
     QPointF prevMouse;
     bool mouseLeftPressed = false, mouseRightPressed = false, mouseMiddlePressed = false;
-    float curr_quat[4] = {0, 0, 0, 1};
     float prev_quat[4] = {0, 0, 0, 1};
-    // model 放在原点并且缩放到 [-0.5, 0.5] 区间，我们从 z=3 往 -z 方向看，确保能够看到 model 整体全貌，不管它有多大
-    glm::vec3 eye = {0, 0, 1.2},
-              lookat = {0, 0, 0}, up = {0, 1, 0};
 
     QOpenGLBuffer arrayBuf;
     QOpenGLBuffer indexBuf;
@@ -0,0 +1,19 @@
+﻿#pragma once
+#include <cmath>
+
+/**
+ * 光线起点的抖动，在 [0, 1) 之间，乘以步长之后加到起点上，和 alpha_blending.fs 中的 rayJitter 完全一致
+ * 空间上是 interleaved gradient noise，相邻像素的值差别很大，噪声集中在高频（近似蓝噪声），累积几帧之后很快就平均掉了
+ * 时间上每一帧加上黄金分割数的倍数，任意连续几帧的偏移都比较均匀
+ */
+inline float jitterFrameOffset(int frame) {
+    double offset = frame * 0.6180339887498949;
+    return (float)(offset - std::floor(offset));
+}
+/**
+ * (fragX, fragY) 和 gl_FragCoord.xy 一样，原点在左下角，像素中心在 0.5 上
+ */
+inline float rayJitter(float fragX, float fragY, float frameOffset) {
+    auto fract = [](float x) { return x - std::floor(x); };
+    return fract(52.9829189f * fract(0.06711056f * fragX + 0.00583715f * fragY) + frameOffset);
+}
@@ -0,0 +1,137 @@
+﻿#include "render_client.h"
+
+#include <QFile>
+#include <QtMath>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "trackball.h"
+
+RenderClient::RenderClient(const QString& volumePath, glm::ivec3 dim, glm::vec3 spacing, QObject* parent)
+    : QObject(parent), volumePath(volumePath), dim(dim), spacing(spacing) {
+    // CPU 渲染比较慢，默认步长比 GPU 的大一点
+    params.stepLength = 0.002f;
+    connect(&requestTimer, &QTimer::timeout, this, &RenderClient::sendRequest);
+}
+
+RenderClient::~RenderClient() {
+    delete socket;
+}
+
+void RenderClient::start(const QString& address, int requestCount, int requestRate) {
+    this->requestCount = requestCount;
+    requestTimer.setInterval(1000 / std::max(requestRate, 1));
+
+    bool isPort;
+    quint16 port = address.toUShort(&isPort);
+    if (isPort) {
+        auto tcpSocket = new QTcpSocket;
+        tcpSocket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+        connect(tcpSocket, &QTcpSocket::connected, this, &RenderClient::onConnected);
+        connect(tcpSocket, &QTcpSocket::errorOccurred, this, [=]() {
+            std::cout << "render client: " << tcpSocket->errorString().toStdString() << std::endl;
+            emit finished();
+        });
+        tcpSocket->connectToHost(QHostAddress::LocalHost, port);
+        socket = tcpSocket;
+    } else {
+        auto localSocket = new QLocalSocket;
+        connect(localSocket, &QLocalSocket::connected, this, &RenderClient::onConnected);
+        connect(localSocket, &QLocalSocket::errorOccurred, this, [=]() {
+            std::cout << "render client: " << localSocket->errorString().toStdString() << std::endl;
+            emit finished();
+        });
+        localSocket->connectToServer(address);
+        socket = localSocket;
+    }
+    connect(socket, &QIODevice::readyRead, this, &RenderClient::onReadyRead);
+}
+
+void RenderClient::onConnected() {
+    clock.start();
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    out << (quint8)RenderProtocol::LoadVolume << volumePath << dim << spacing << (quint8)voxelType;
+    RenderProtocol::writeMessage(socket, payload);
+}
+
+void RenderClient::onReadyRead() {
+    QByteArray payload;
+    RenderProtocol::ReadResult result;
+    while ((result = RenderProtocol::readMessage(socket, readBuffer, payload)) == RenderProtocol::ReadResult::Message) {
+        handleMessage(payload);
+    }
+    if (result == RenderProtocol::ReadResult::TooLarge) {
+        std::cout << "render client: message from server is too large" << std::endl;
+        socket->close();
+        emit finished();
+    }
+}
+
+void RenderClient::handleMessage(const QByteArray& payload) {
+    QDataStream in(payload);
+    quint8 type;
+    in >> type;
+    if (type == RenderProtocol::VolumeLoaded) {
+        in >> volumeId;
+        if (volumeId < 0) {
+            std::cout << "render client: server failed to load " << volumePath.toStdString() << std::endl;
+            emit finished();
+            return;
+        }
+        std::cout << "render client: volume loaded in " << clock.elapsed() << " ms" << std::endl;
+        firstRequestNs = clock.nsecsElapsed();
+        sendRequest();
+        requestTimer.start();
+    } else if (type == RenderProtocol::Frame) {
+        quint32 requestId;
+        in >> requestId >> lastStats >> lastImage;
+        double latencyMs = (clock.nsecsElapsed() - sentAtNs.take(requestId)) / 1e6;
+        latenciesMs.push_back(latencyMs);
+        bytesReceived += lastImage.size();
+        printf("frame %u: round trip %.1f ms (server: render %.1f ms, encode %.1f ms, latency %.1f ms), %d bytes\n",
+               requestId, latencyMs, lastStats.renderMs, lastStats.encodeMs, lastStats.latencyMs, (int)lastImage.size());
+        // 最后一个请求之后不会再有更新的请求，服务器一定会返回它
+        if ((int)requestId == requestCount - 1) {
+            printSummary();
+            emit finished();
+        }
+    }
+}
+
+void RenderClient::sendRequest() {
+    if ((int)nextRequestId >= requestCount) {
+        requestTimer.stop();
+        return;
+    }
+    // 绕 y 轴转一整圈
+    float axis[3] = {0, 1, 0};
+    axis_to_quat(axis, 2 * M_PI * nextRequestId / requestCount, params.camera.quat);
+
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    out << (quint8)RenderProtocol::RenderRequest << nextRequestId << volumeId << params << (qint32)quality;
+    sentAtNs[nextRequestId] = clock.nsecsElapsed();
+    RenderProtocol::writeMessage(socket, payload);
+    nextRequestId++;
+}
+
+void RenderClient::printSummary() {
+    if (latenciesMs.empty()) return;
+    double seconds = (clock.nsecsElapsed() - firstRequestNs) / 1e9;
+    std::vector<double> sorted = latenciesMs;
+    std::sort(sorted.begin(), sorted.end());
+    double sum = 0;
+    for (double latency : sorted) sum += latency;
+    printf("render client: %d requests sent, %zu frames received, %u coalesced by server\n",
+           requestCount, sorted.size(), lastStats.coalesced);
+    printf("render client: %.1f fps, %.2f MB/s, round trip avg %.1f ms, p50 %.1f ms, p95 %.1f ms, max %.1f ms\n",
+           sorted.size() / seconds, bytesReceived / seconds / (1024.0 * 1024.0), sum / sorted.size(),
+           sorted[sorted.size() / 2], sorted[std::min(sorted.size() - 1, sorted.size() * 95 / 100)], sorted.back());
+
+    QFile file(quality >= 0 && quality <= 100 ? "render_client.jpg" : "render_client.png");
+    if (file.open(QIODevice::WriteOnly)) {
+        file.write(lastImage);
+    }
+}
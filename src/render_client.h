@@ -0,0 +1,65 @@
+﻿#pragma once
+#include <QElapsedTimer>
+#include <QHash>
+#include <QLocalSocket>
+#include <QObject>
+#include <QTcpSocket>
+#include <QTimer>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "render_protocol.h"
+#include "voxel_type.h"
+
+/**
+ * 渲染服务器的测试客户端：加载体数据，以固定频率发送绕 y 轴旋转的相机参数，
+ * 统计每一帧的往返延迟和帧率，最后把最后一帧保存到 render_client.jpg
+ */
+class RenderClient : public QObject {
+    Q_OBJECT
+   public:
+    RenderClient(const QString& volumePath, glm::ivec3 dim, glm::vec3 spacing, QObject* parent = nullptr);
+    ~RenderClient();
+
+    /**
+     * address 为纯数字时连接 localhost 上的 TCP 端口，否则作为 QLocalSocket 的名字
+     * requestCount 为总共发送的请求数，requestRate 为每秒发送的请求数
+     */
+    void start(const QString& address, int requestCount, int requestRate);
+
+    RenderParams params;
+    // JPEG 压缩质量，不在 [0, 100] 之间时使用 PNG
+    int quality = 80;
+    VoxelType voxelType = VoxelType::UInt16;
+
+   signals:
+    void finished();
+
+   private slots:
+    void onConnected();
+    void onReadyRead();
+    void sendRequest();
+
+   private:
+    void handleMessage(const QByteArray& payload);
+    void printSummary();
+
+    QString volumePath;
+    glm::ivec3 dim;
+    glm::vec3 spacing;
+
+    QIODevice* socket = nullptr;
+    QByteArray readBuffer;
+    QTimer requestTimer;
+    QElapsedTimer clock;
+
+    qint32 volumeId = -1;
+    int requestCount = 0;
+    quint32 nextRequestId = 0;
+    QHash<quint32, qint64> sentAtNs;
+    std::vector<double> latenciesMs;
+    quint64 bytesReceived = 0;
+    qint64 firstRequestNs = 0;
+    RenderProtocol::FrameStats lastStats;
+    QByteArray lastImage;
+};
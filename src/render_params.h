@@ -0,0 +1,51 @@
+﻿#pragma once
+#include <glm/glm.hpp>
+
+#include "camera.h"
+#include "clipping.h"
+#include "label_table.h"
+#include "lighting.h"
+#include "transfer_function.h"
+
+enum class RenderMode {
+    // 沿光线做 alpha blending
+    AlphaBlending,
+    // 只找第一个 >= isoValue 的位置，得到不透明的表面
+    Isosurface,
+};
+
+/**
+ * 渲染一帧需要的全部参数，GUI、CPU 渲染和渲染服务器之间传递的都是这份数据
+ */
+struct RenderParams {
+    Camera camera;
+    TransferFunction transferFunction;
+    Lighting lighting;
+    RenderMode renderMode = RenderMode::AlphaBlending;
+    float isoValue = 2000.f;
+    int width = 512, height = 512;
+    float stepLength = 0.001f;
+    // 传输函数的不透明度是按这个步长定义的，stepLength 更大时修正每个采样点的不透明度；0 表示不修正
+    float baseStepLength = 0.f;
+    // >= 0 时光线起点按 rayJitter 抖动，不同的 jitterFrame 对应不同的偏移，多帧平均之后可以使用更大的步长
+    int jitterFrame = -1;
+    float gamma = 2.2f;
+    glm::vec3 backgroundColor{41 / 255.f, 65 / 255.f, 71 / 255.f};
+    // alpha blending 模式下使用预计算的光照体 (IlluminationVolume) 计算阴影和环境光遮蔽
+    bool shadows = false;
+    // CPU 渲染时使用 shear-warp 快速预览，不满足条件（等值面模式、眼睛在体数据的层之间）时仍然使用 ray casting；GPU 渲染忽略
+    bool shearWarp = false;
+    Clipping clipping;
+    // 体数据带有 LabelVolume 时每个分割标签的颜色、不透明度和是否显示，为空时不使用标签
+    LabelTable labels;
+
+    inline bool operator==(const RenderParams& other) const {
+        return camera == other.camera && transferFunction == other.transferFunction && lighting == other.lighting &&
+               renderMode == other.renderMode && isoValue == other.isoValue && width == other.width && height == other.height &&
+               stepLength == other.stepLength && baseStepLength == other.baseStepLength && jitterFrame == other.jitterFrame && gamma == other.gamma && backgroundColor == other.backgroundColor &&
+               shadows == other.shadows && shearWarp == other.shearWarp && clipping == other.clipping && labels == other.labels;
+    }
+    inline bool operator!=(const RenderParams& other) const {
+        return !(*this == other);
+    }
+};
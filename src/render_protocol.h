@@ -0,0 +1,154 @@
+﻿#pragma once
+#include <QByteArray>
+#include <QDataStream>
+#include <QIODevice>
+#include <QtEndian>
+#include <cmath>
+#include <glm/glm.hpp>
+
+#include "render_params.h"
+
+/**
+ * 渲染服务器和客户端之间的通信协议
+ * 每条消息是 [quint32 大端长度][payload]，payload 用 QDataStream 序列化，第一个字节是消息类型
+ */
+namespace RenderProtocol {
+
+enum MessageType : quint8 {
+    // client -> server: QString path, glm::ivec3 dim, glm::vec3 spacing, quint8 VoxelType
+    LoadVolume = 1,
+    // server -> client: qint32 volumeId，失败时为 -1
+    VolumeLoaded,
+    // client -> server: quint32 requestId, qint32 volumeId, RenderParams, qint32 quality
+    // quality 在 [0, 100] 之间时使用 JPEG 压缩，否则使用 PNG
+    RenderRequest,
+    // server -> client: quint32 requestId, FrameStats, QByteArray 压缩后的图片
+    Frame,
+};
+
+// 服务器接受的最大图片边长和最小步长，超出范围的 RenderParams 当作损坏的数据，避免过大的分配和停不下来的光线步进
+constexpr int MAX_IMAGE_SIZE = 4096;
+constexpr float MIN_STEP_LENGTH = 1e-5f;
+// 一条消息的最大长度：请求只有几百字节，最大的是一帧图片，压缩之后不会比 RGB 原始数据大很多，留 1 MB 给统计信息和 PNG 的额外开销
+constexpr quint32 MAX_MESSAGE_BYTES = (quint32)MAX_IMAGE_SIZE * MAX_IMAGE_SIZE * 3 + (1 << 20);
+
+// 服务器对每个客户端统计的延迟和吞吐量，随每一帧一起发回
+struct FrameStats {
+    // 被更新的请求覆盖掉的请求数量（包括没有开始渲染的和渲染完但被丢弃的）
+    quint32 coalesced = 0;
+    double renderMs = 0, encodeMs = 0;
+    // 从服务器收到请求到发出这一帧的时间
+    double latencyMs = 0;
+    // 这个客户端的平均帧率和带宽
+    double framesPerSecond = 0, megabytesPerSecond = 0;
+};
+
+inline void writeMessage(QIODevice* device, const QByteArray& payload) {
+    quint32 length = qToBigEndian<quint32>(payload.size());
+    device->write(reinterpret_cast<const char*>(&length), sizeof(length));
+    device->write(payload);
+}
+
+enum class ReadResult {
+    // 还没有收到一条完整的消息
+    Incomplete,
+    Message,
+    // 长度超过 MAX_MESSAGE_BYTES，对方发来的数据已经损坏，应该断开连接
+    TooLarge,
+};
+
+/**
+ * 从 device 读取所有可读的数据追加到 buffer，如果 buffer 中已经有一条完整的消息则取出到 payload 中
+ * 需要循环调用直到不再返回 Message，才能把一次 readyRead 收到的消息全部取出
+ */
+inline ReadResult readMessage(QIODevice* device, QByteArray& buffer, QByteArray& payload) {
+    buffer.append(device->readAll());
+    if (buffer.size() < (int)sizeof(quint32)) return ReadResult::Incomplete;
+    quint32 length = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(buffer.constData()));
+    // 长度来自对方，不检查的话一个错误的长度会让 buffer 一直增长到 4 GB
+    if (length > MAX_MESSAGE_BYTES) {
+        buffer.clear();
+        return ReadResult::TooLarge;
+    }
+    if ((quint32)buffer.size() < sizeof(quint32) + length) return ReadResult::Incomplete;
+    payload = buffer.mid(sizeof(quint32), length);
+    buffer.remove(0, sizeof(quint32) + length);
+    return ReadResult::Message;
+}
+
+}  // namespace RenderProtocol
+
+inline QDataStream& operator<<(QDataStream& out, const glm::vec3& v) {
+    return out << v.x << v.y << v.z;
+}
+inline QDataStream& operator>>(QDataStream& in, glm::vec3& v) {
+    return in >> v.x >> v.y >> v.z;
+}
+inline QDataStream& operator<<(QDataStream& out, const glm::vec4& v) {
+    return out << v.x << v.y << v.z << v.w;
+}
+inline QDataStream& operator>>(QDataStream& in, glm::vec4& v) {
+    return in >> v.x >> v.y >> v.z >> v.w;
+}
+inline QDataStream& operator<<(QDataStream& out, const glm::ivec3& v) {
+    return out << (qint32)v.x << (qint32)v.y << (qint32)v.z;
+}
+inline QDataStream& operator>>(QDataStream& in, glm::ivec3& v) {
+    qint32 x, y, z;
+    in >> x >> y >> z;
+    v = {x, y, z};
+    return in;
+}
+
+inline QDataStream& operator<<(QDataStream& out, const RenderParams& p) {
+    out << p.camera.quat[0] << p.camera.quat[1] << p.camera.quat[2] << p.camera.quat[3]
+        << p.camera.eye << p.camera.lookat << p.camera.up
+        << p.camera.zNear << p.camera.zFar << p.camera.fov;
+    out << p.transferFunction.opacityThreshold << p.transferFunction.colorThreshold;
+    out << p.lighting.position << p.lighting.ambient << p.lighting.diffuse << p.lighting.specular
+        << p.lighting.materialSpecular << p.lighting.shininess;
+    out << (qint32)p.renderMode << p.isoValue;
+    out << (qint32)p.width << (qint32)p.height << p.stepLength << p.baseStepLength << (qint32)p.jitterFrame << p.gamma << p.backgroundColor << p.shadows << p.shearWarp;
+    out << p.clipping.boxMin << p.clipping.boxMax << (qint32)p.clipping.planes.size();
+    for (const auto& plane : p.clipping.planes) out << plane;
+    return out;
+}
+inline QDataStream& operator>>(QDataStream& in, RenderParams& p) {
+    in >> p.camera.quat[0] >> p.camera.quat[1] >> p.camera.quat[2] >> p.camera.quat[3] >> p.camera.eye >> p.camera.lookat >> p.camera.up >> p.camera.zNear >> p.camera.zFar >> p.camera.fov;
+    in >> p.transferFunction.opacityThreshold >> p.transferFunction.colorThreshold;
+    in >> p.lighting.position >> p.lighting.ambient >> p.lighting.diffuse >> p.lighting.specular >> p.lighting.materialSpecular >> p.lighting.shininess;
+    qint32 renderMode;
+    in >> renderMode >> p.isoValue;
+    p.renderMode = (RenderMode)renderMode;
+    qint32 width, height, jitterFrame;
+    in >> width >> height >> p.stepLength >> p.baseStepLength >> jitterFrame >> p.gamma >> p.backgroundColor >> p.shadows >> p.shearWarp;
+    p.jitterFrame = jitterFrame;
+    qint32 planeCount;
+    in >> p.clipping.boxMin >> p.clipping.boxMax >> planeCount;
+    // 多出来的平面没法跳过，后面的字段和消息都会错位，只能把整个请求当作损坏的
+    if (planeCount < 0 || planeCount > Clipping::MAX_PLANES) {
+        in.setStatus(QDataStream::ReadCorruptData);
+        return in;
+    }
+    p.clipping.planes.resize(planeCount);
+    for (auto& plane : p.clipping.planes) in >> plane;
+    p.width = width;
+    p.height = height;
+    // 参数来自网络，步长不是正数时光线步进停不下来；baseStepLength 为 0 表示不修正不透明度
+    auto validStep = [](float step) {
+        return std::isfinite(step) && step >= RenderProtocol::MIN_STEP_LENGTH;
+    };
+    if (width <= 0 || height <= 0 || width > RenderProtocol::MAX_IMAGE_SIZE || height > RenderProtocol::MAX_IMAGE_SIZE ||
+        !validStep(p.stepLength) || !(p.baseStepLength == 0 || validStep(p.baseStepLength)) || !(std::isfinite(p.gamma) && p.gamma > 0) ||
+        (renderMode != (qint32)RenderMode::AlphaBlending && renderMode != (qint32)RenderMode::Isosurface)) {
+        in.setStatus(QDataStream::ReadCorruptData);
+    }
+    return in;
+}
+
+inline QDataStream& operator<<(QDataStream& out, const RenderProtocol::FrameStats& s) {
+    return out << s.coalesced << s.renderMs << s.encodeMs << s.latencyMs << s.framesPerSecond << s.megabytesPerSecond;
+}
+inline QDataStream& operator>>(QDataStream& in, RenderProtocol::FrameStats& s) {
+    return in >> s.coalesced >> s.renderMs >> s.encodeMs >> s.latencyMs >> s.framesPerSecond >> s.megabytesPerSecond;
+}
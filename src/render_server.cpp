@@ -0,0 +1,345 @@
+﻿#include "render_server.h"
+
+#include <QBuffer>
+#include <QFileInfo>
+#include <QImage>
+#include <QtConcurrent>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "memory_budget.h"
+
+ClientSession::ClientSession(QIODevice* socket, RenderServer* server) : QObject(server), socket(socket), server(server) {
+    sessionTimer.start();
+    lastFrameTimer.start();
+    connect(socket, &QIODevice::readyRead, this, &ClientSession::onReadyRead);
+    connect(&watcher, &QFutureWatcher<RenderResult>::finished, this, &ClientSession::onRenderFinished);
+    connect(&statsTimer, &QTimer::timeout, this, &ClientSession::reportStats);
+    statsTimer.start(5000);
+    std::cout << "client connected" << std::endl;
+}
+
+ClientSession::~ClientSession() {
+    reportStats();
+    std::cout << "client disconnected" << std::endl;
+    // 还在渲染的帧不需要了，但是要等它结束，因为结果会写回 watcher
+    watcher.waitForFinished();
+    socket->deleteLater();
+}
+
+bool ClientSession::usesVolume(qint32 volumeId) const {
+    return (rendering && current.volumeId == volumeId) || (hasPending && pending.volumeId == volumeId);
+}
+
+void ClientSession::onReadyRead() {
+    QByteArray payload;
+    // 收到损坏的消息之后连接已经关闭，剩下的消息不再处理
+    RenderProtocol::ReadResult result = RenderProtocol::ReadResult::Incomplete;
+    while (socket->isOpen() && (result = RenderProtocol::readMessage(socket, readBuffer, payload)) == RenderProtocol::ReadResult::Message) {
+        handleMessage(payload);
+    }
+    if (socket->isOpen() && result == RenderProtocol::ReadResult::TooLarge) {
+        std::cout << "message from client is too large, closing connection" << std::endl;
+        socket->close();
+    }
+}
+
+void ClientSession::handleMessage(const QByteArray& payload) {
+    QDataStream in(payload);
+    quint8 type;
+    in >> type;
+    if (type == RenderProtocol::LoadVolume) {
+        QString path;
+        glm::ivec3 dim;
+        glm::vec3 spacing;
+        quint8 voxelType;
+        in >> path >> dim >> spacing >> voxelType;
+        qint32 volumeId = -1;
+        // 未知的类型不能当作 float32 读，否则大小检查也可能恰好通过
+        if (voxelType > (quint8)VoxelType::Float32) {
+            std::cout << "unknown voxel type " << (int)voxelType << " for " << path.toStdString() << std::endl;
+        } else {
+            volumeId = server->loadVolume(path, dim, spacing, (VoxelType)voxelType);
+        }
+
+        QByteArray reply;
+        QDataStream out(&reply, QIODevice::WriteOnly);
+        out << (quint8)RenderProtocol::VolumeLoaded << volumeId;
+        RenderProtocol::writeMessage(socket, reply);
+    } else if (type == RenderProtocol::RenderRequest) {
+        Request request;
+        in >> request.requestId >> request.volumeId >> request.params >> request.quality;
+        if (in.status() != QDataStream::Ok) {
+            std::cout << "corrupted render request, closing connection" << std::endl;
+            socket->close();
+            return;
+        }
+        request.received.start();
+        if (server->volume(request.volumeId) == nullptr) {
+            std::cout << "render request for unknown volume " << request.volumeId << std::endl;
+            return;
+        }
+        // 合并请求：还没开始渲染的旧请求直接被新的相机参数覆盖
+        if (hasPending) coalesced++;
+        pending = request;
+        hasPending = true;
+        if (!rendering) startRender();
+    } else {
+        std::cout << "unknown message type " << (int)type << std::endl;
+    }
+}
+
+void ClientSession::startRender() {
+    current = pending;
+    hasPending = false;
+    rendering = true;
+    auto cachedHits = current.volumeId == isosurfaceHitsVolumeId ? isosurfaceHits : nullptr;
+    if (current.params.shadows && current.volumeId != illuminationVolumeId) {
+        illumination.reset(new IlluminationVolume(server->volumeData(current.volumeId)));
+        illuminationVolumeId = current.volumeId;
+    }
+    watcher.setFuture(QtConcurrent::run(&ClientSession::renderAndEncode, server->volume(current.volumeId), current.params, (int)current.quality, cachedHits, illumination.get()));
+}
+
+void ClientSession::onRenderFinished() {
+    rendering = false;
+    RenderResult result = watcher.result();
+    isosurfaceHits = result.isosurfaceHits;
+    isosurfaceHitsVolumeId = current.volumeId;
+    // 渲染期间收到了更新的相机参数，这一帧已经过时，丢弃掉直接渲染最新的请求
+    if (hasPending && lastFrameTimer.elapsed() < MAX_STALE_MS) {
+        coalesced++;
+    } else {
+        sendFrame(result);
+    }
+    if (hasPending) startRender();
+}
+
+void ClientSession::sendFrame(const RenderResult& result) {
+    double latencyMs = current.received.nsecsElapsed() / 1e6;
+    framesSent++;
+    bytesSent += result.image.size();
+    totalLatencyMs += latencyMs;
+    maxLatencyMs = std::max(maxLatencyMs, latencyMs);
+    lastFrameTimer.restart();
+
+    RenderProtocol::FrameStats stats;
+    stats.coalesced = coalesced;
+    stats.renderMs = result.renderMs;
+    stats.encodeMs = result.encodeMs;
+    stats.latencyMs = latencyMs;
+    double seconds = sessionTimer.elapsed() / 1000.0;
+    if (seconds > 0) {
+        stats.framesPerSecond = framesSent / seconds;
+        stats.megabytesPerSecond = bytesSent / seconds / (1024.0 * 1024.0);
+    }
+
+    QByteArray reply;
+    QDataStream out(&reply, QIODevice::WriteOnly);
+    out << (quint8)RenderProtocol::Frame << current.requestId << stats << result.image;
+    RenderProtocol::writeMessage(socket, reply);
+}
+
+void ClientSession::reportStats() {
+    double seconds = sessionTimer.elapsed() / 1000.0;
+    if (framesSent == 0 || seconds <= 0) return;
+    printf("client %p: %llu frames, %.1f fps, %.2f MB/s, latency avg %.1f ms max %.1f ms, %u requests coalesced\n",
+           (void*)this, (unsigned long long)framesSent, framesSent / seconds, bytesSent / seconds / (1024.0 * 1024.0),
+           totalLatencyMs / framesSent, maxLatencyMs, coalesced);
+}
+
+ClientSession::RenderResult ClientSession::renderAndEncode(const VolumeRendering* volumeRendering, const RenderParams& params, int quality, std::shared_ptr<const IsosurfaceHits> cachedHits, IlluminationVolume* illumination) {
+    RenderResult result;
+    QElapsedTimer timer;
+    timer.start();
+    RenderedImage image;
+    if (params.renderMode == RenderMode::Isosurface) {
+        // 相机等没有变化时跳过光线步进，只重新着色
+        if (cachedHits && cachedHits->matches(params)) {
+            result.isosurfaceHits = cachedHits;
+        } else {
+            result.isosurfaceHits = std::make_shared<const IsosurfaceHits>(volumeRendering->findIsosurface(params));
+        }
+        image = volumeRendering->shadeIsosurface(*result.isosurfaceHits, params);
+    } else {
+        // 光照体只在传输函数或者光源方向变化时才会重新计算
+        if (params.shadows && illumination) {
+            illumination->update(params.transferFunction, IlluminationVolume::lightDirection(params.camera, params.lighting));
+        }
+        image = volumeRendering->render(params, illumination);
+    }
+    result.renderMs = timer.nsecsElapsed() / 1e6;
+
+    timer.restart();
+    QImage qImage(image.pixels.data(), image.width, image.height, image.width * 3, QImage::Format_RGB888);
+    QBuffer buffer(&result.image);
+    buffer.open(QIODevice::WriteOnly);
+    if (quality >= 0 && quality <= 100) {
+        qImage.save(&buffer, "JPG", quality);
+    } else {
+        qImage.save(&buffer, "PNG");
+    }
+    result.encodeMs = timer.nsecsElapsed() / 1e6;
+    return result;
+}
+
+RenderServer::RenderServer(QObject* parent) : QObject(parent) {
+    connect(&tcpServer, &QTcpServer::newConnection, this, &RenderServer::onNewTcpConnection);
+    connect(&localServer, &QLocalServer::newConnection, this, &RenderServer::onNewLocalConnection);
+}
+
+RenderServer::~RenderServer() {
+    // 先关闭所有连接，再释放它们正在使用的体数据
+    qDeleteAll(findChildren<ClientSession*>());
+    for (auto& volume : volumes) {
+        unloadVolume(volume);
+    }
+}
+
+bool RenderServer::listen(const QString& address) {
+    bool isPort;
+    quint16 port = address.toUShort(&isPort);
+    bool ok;
+    if (isPort) {
+        ok = tcpServer.listen(QHostAddress::LocalHost, port);
+        std::cout << "render server listening on tcp port " << port << std::endl;
+    } else {
+        QLocalServer::removeServer(address);
+        ok = localServer.listen(address);
+        std::cout << "render server listening on local socket " << address.toStdString() << std::endl;
+    }
+    if (!ok) {
+        std::cout << "render server listen failed: "
+                  << (isPort ? tcpServer.errorString() : localServer.errorString()).toStdString() << std::endl;
+    }
+    return ok;
+}
+
+qint32 RenderServer::loadVolume(const QString& path, glm::ivec3 dim, glm::vec3 spacing, VoxelType voxelType) {
+    // 大小、间距和类型都来自客户端，读取之前先检查，和文件大小不符时不能读
+    if (dim[0] <= 0 || dim[1] <= 0 || dim[2] <= 0 || !(spacing[0] > 0 && spacing[1] > 0 && spacing[2] > 0) || !std::isfinite(spacing[0] + spacing[1] + spacing[2])) {
+        std::cout << "invalid volume dim or spacing for " << path.toStdString() << std::endl;
+        return -1;
+    }
+    QString canonicalPath = QFileInfo(path).canonicalFilePath();
+    qint32 volumeId = (qint32)volumes.size();
+    for (size_t i = 0; i < volumes.size(); i++) {
+        // 同一个文件按不同的大小或者类型解释是不同的体数据
+        const ResidentVolume& resident = volumes[i];
+        if (resident.path != canonicalPath || resident.dim != dim || resident.spacing != spacing || resident.voxelType != voxelType) continue;
+        if (resident.volumeRendering) {
+            resident.lastUsed = ++useClock;
+            return (qint32)i;
+        }
+        // 之前被换出了，重新读入到原来的位置
+        volumeId = (qint32)i;
+        break;
+    }
+    if (canonicalPath.isEmpty()) {
+        std::cout << "volume not found: " << path.toStdString() << std::endl;
+        return -1;
+    }
+    // 用 double 比较，dim 很大时 size_t 的乘积会溢出，可能恰好等于文件大小
+    if ((double)dim[0] * dim[1] * dim[2] * voxelSize(voxelType) != (double)QFileInfo(canonicalPath).size()) {
+        std::cout << "volume " << path.toStdString() << " does not match " << dim[2] << " x " << dim[1] << " x " << dim[0] << " voxels of "
+                  << voxelTypeName(voxelType) << std::endl;
+        return -1;
+    }
+    evictIdleVolumes((size_t)dim[0] * dim[1] * dim[2] * voxelSize(voxelType));
+    ResidentVolume volume;
+    volume.path = canonicalPath;
+    volume.dim = dim;
+    volume.spacing = spacing;
+    volume.voxelType = voxelType;
+    // 服务器不做预处理，和 MainWindow 不做预处理时的缓存是同一个
+    const std::string source = canonicalPath.toStdString();
+    VolumeCache::Settings cacheSettings;
+    cacheSettings.voxelType = (int32_t)voxelType;
+    cacheSettings.dim = dim;
+    cacheSettings.spacing = spacing;
+    volume.volumeCache = VolumeCache::open(source, cacheSettings);
+    if (!volume.volumeCache) {
+        volume.rawReader = new RawReader(source, dim[0], dim[1], dim[2], voxelType);
+        if (volume.rawReader->data() == nullptr) {
+            delete volume.rawReader;
+            return -1;
+        }
+        volume.volumeData = new VolumeData(volume.rawReader->data(), voxelType, dim, spacing, true);
+        // 写入缓存之后改为映射缓存文件，读入的数据就可以释放了
+        if (VolumeCache::write(source, cacheSettings, voxelType, dim, spacing, volume.volumeData, BrickGrid(volume.volumeData)) &&
+            (volume.volumeCache = VolumeCache::open(source, cacheSettings))) {
+            delete volume.volumeData;
+            delete volume.rawReader;
+            volume.rawReader = nullptr;
+        }
+    }
+    if (volume.volumeCache) volume.volumeData = volume.volumeCache->createVolumeData();
+    volume.volumeRendering = new VolumeRendering(volume.volumeData);
+    volume.lastUsed = ++useClock;
+    if (volumeId == (qint32)volumes.size()) {
+        volumes.push_back(volume);
+    } else {
+        volumes[volumeId] = volume;
+    }
+    MemoryBudget::instance().printUsage();
+    return volumeId;
+}
+
+void RenderServer::evictIdleVolumes(size_t bytes) {
+    const QList<ClientSession*> sessions = findChildren<ClientSession*>();
+    while (MemoryBudget::instance().overHostBudget(bytes)) {
+        ResidentVolume* oldest = nullptr;
+        for (size_t i = 0; i < volumes.size(); i++) {
+            if (!volumes[i].volumeRendering || (oldest && volumes[i].lastUsed >= oldest->lastUsed)) continue;
+            bool used = std::any_of(sessions.begin(), sessions.end(), [&](ClientSession* session) {
+                return session->usesVolume((qint32)i);
+            });
+            if (!used) oldest = &volumes[i];
+        }
+        if (!oldest) {
+            std::cout << "host memory budget exceeded, no idle volume to evict" << std::endl;
+            return;
+        }
+        std::cout << "evicting volume " << oldest->path.toStdString() << std::endl;
+        unloadVolume(*oldest);
+    }
+}
+
+void RenderServer::unloadVolume(ResidentVolume& volume) {
+    delete volume.volumeRendering;
+    delete volume.volumeData;
+    delete volume.rawReader;
+    delete volume.volumeCache;
+    volume.volumeRendering = nullptr;
+    volume.volumeData = nullptr;
+    volume.rawReader = nullptr;
+    volume.volumeCache = nullptr;
+}
+
+const VolumeRendering* RenderServer::volume(qint32 volumeId) const {
+    if (volumeId < 0 || volumeId >= (qint32)volumes.size()) return nullptr;
+    volumes[volumeId].lastUsed = ++useClock;
+    return volumes[volumeId].volumeRendering;
+}
+
+const VolumeData* RenderServer::volumeData(qint32 volumeId) const {
+    if (volumeId < 0 || volumeId >= (qint32)volumes.size()) return nullptr;
+    return volumes[volumeId].volumeData;
+}
+
+void RenderServer::onNewTcpConnection() {
+    while (QTcpSocket* socket = tcpServer.nextPendingConnection()) {
+        // 帧比较小且对延迟敏感，关闭 Nagle 算法
+        socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+        auto session = new ClientSession(socket, this);
+        connect(socket, &QTcpSocket::disconnected, session, &QObject::deleteLater);
+    }
+}
+
+void RenderServer::onNewLocalConnection() {
+    while (QLocalSocket* socket = localServer.nextPendingConnection()) {
+        auto session = new ClientSession(socket, this);
+        connect(socket, &QLocalSocket::disconnected, session, &QObject::deleteLater);
+    }
+}
@@ -0,0 +1,133 @@
+﻿#pragma once
+#include <QElapsedTimer>
+#include <QFutureWatcher>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+#include <glm/glm.hpp>
+#include <memory>
+#include <vector>
+
+#include "illumination_volume.h"
+#include "raw_reader.h"
+#include "render_protocol.h"
+#include "volume_cache.h"
+#include "volume_data.h"
+#include "volume_rendering.h"
+
+class RenderServer;
+
+/**
+ * 一个客户端连接，同一时刻最多只渲染一帧，最多只保留一个等待中的请求
+ * 新的请求会直接覆盖还没开始渲染的旧请求；渲染完成时如果已经有更新的请求在等待，这一帧就是过时的，直接丢弃
+ */
+class ClientSession : public QObject {
+    Q_OBJECT
+   public:
+    ClientSession(QIODevice* socket, RenderServer* server);
+    ~ClientSession();
+    // 正在渲染或者等待渲染 volumeId，这时它不能被换出
+    bool usesVolume(qint32 volumeId) const;
+
+   private slots:
+    void onReadyRead();
+    void onRenderFinished();
+    void reportStats();
+
+   private:
+    struct Request {
+        quint32 requestId;
+        qint32 volumeId;
+        RenderParams params;
+        qint32 quality;
+        QElapsedTimer received;
+    };
+    struct RenderResult {
+        QByteArray image;
+        double renderMs = 0, encodeMs = 0;
+        // 等值面模式下这一帧用到的交点，只改光照或颜色时下一帧可以直接复用
+        std::shared_ptr<const IsosurfaceHits> isosurfaceHits;
+    };
+    void handleMessage(const QByteArray& payload);
+    void startRender();
+    void sendFrame(const RenderResult& result);
+    static RenderResult renderAndEncode(const VolumeRendering* volumeRendering, const RenderParams& params, int quality, std::shared_ptr<const IsosurfaceHits> cachedHits, IlluminationVolume* illumination);
+
+    // 过时的帧最多连续丢弃这么长时间，避免客户端请求速度比渲染速度快时一直拿不到画面
+    static constexpr qint64 MAX_STALE_MS = 250;
+
+    QIODevice* socket;
+    RenderServer* server;
+    QByteArray readBuffer;
+
+    bool rendering = false, hasPending = false;
+    Request current, pending;
+    QFutureWatcher<RenderResult> watcher;
+    std::shared_ptr<const IsosurfaceHits> isosurfaceHits;
+    qint32 isosurfaceHitsVolumeId = -1;
+    // 每个连接的传输函数和相机不同，光照体各自计算；同一时刻只有一帧在渲染，不需要加锁
+    std::unique_ptr<IlluminationVolume> illumination;
+    qint32 illuminationVolumeId = -1;
+
+    QElapsedTimer sessionTimer, lastFrameTimer;
+    QTimer statsTimer;
+    quint64 framesSent = 0, bytesSent = 0;
+    quint32 coalesced = 0;
+    double totalLatencyMs = 0, maxLatencyMs = 0;
+};
+
+/**
+ * 渲染服务器：常驻体数据，通过本地 TCP 端口或者 Unix socket (QLocalServer) 接收相机和传输函数，
+ * 使用 CPU 渲染 (VolumeRendering::render) 并返回压缩后的图片
+ */
+class RenderServer : public QObject {
+    Q_OBJECT
+   public:
+    explicit RenderServer(QObject* parent = nullptr);
+    ~RenderServer();
+
+    /**
+     * address 为纯数字时监听 localhost 上的 TCP 端口，否则作为 QLocalServer 的名字
+     */
+    bool listen(const QString& address);
+    /**
+     * 读取体数据并常驻内存，同样的文件和参数只会读取一次，返回 volumeId，失败（包括文件大小和 dim、voxelType 不符）返回 -1
+     * 超过主机内存预算时先换出最久没有使用、也没有连接正在使用的体数据；被换出的文件再次加载时仍然使用原来的 volumeId
+     */
+    qint32 loadVolume(const QString& path, glm::ivec3 dim, glm::vec3 spacing, VoxelType voxelType = VoxelType::UInt16);
+    const VolumeRendering* volume(qint32 volumeId) const;
+    const VolumeData* volumeData(qint32 volumeId) const;
+
+   private slots:
+    void onNewTcpConnection();
+    void onNewLocalConnection();
+
+   private:
+    struct ResidentVolume {
+        // 同一个文件只有 path、dim、spacing 和 voxelType 都相同时才复用
+        QString path;
+        glm::ivec3 dim;
+        glm::vec3 spacing;
+        VoxelType voxelType;
+        RawReader* rawReader = nullptr;
+        // 从缓存中打开时数据属于 volumeCache，rawReader 为空
+        VolumeCache* volumeCache = nullptr;
+        // 被换出之后为空，只保留 path 和 volumeId
+        VolumeData* volumeData = nullptr;
+        VolumeRendering* volumeRendering = nullptr;
+        // 最近一次使用的时间 (useClock)
+        mutable quint64 lastUsed = 0;
+    };
+    // 换出最久没有使用的空闲体数据，直到再读入 bytes 之后不超过主机内存预算，或者没有可以换出的
+    void evictIdleVolumes(size_t bytes);
+    static void unloadVolume(ResidentVolume& volume);
+
+    std::vector<ResidentVolume> volumes;
+    mutable quint64 useClock = 0;
+
+    QTcpServer tcpServer;
+    QLocalServer localServer;
+};
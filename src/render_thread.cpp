@@ -0,0 +1,61 @@
+﻿#include "render_thread.h"
+
+RenderThread::RenderThread(QObject* parent) : QThread(parent) {
+    qRegisterMetaType<RenderThread::FrameStats>();
+    qRegisterMetaType<const VolumeData*>();
+}
+
+RenderThread::~RenderThread() {
+    stopping = true;
+    wake.release();
+    wait();
+}
+
+void RenderThread::setVolumeData(const VolumeData* volumeData) {
+    if (volumeData == publishedVolume) return;
+    // 覆盖了渲染线程还没有换上的体数据，它不会再被使用
+    const VolumeData* skipped = publishedVolume;
+    publishedVolume = volumeData;
+    if (pendingVolume.publish(volumeData) && skipped) emit volumeReleased(skipped);
+    wake.release();
+}
+
+void RenderThread::publish(const RenderParams& params, qint64 inputNs) {
+    if (latest.publish({params, inputNs})) coalesced++;
+    wake.release();
+}
+
+void RenderThread::run() {
+    Request request;
+    while (!stopping) {
+        wake.acquire();
+        // 一次唤醒可能对应多次 publish，只需要渲染最新的那一份
+        wake.tryAcquire(wake.available());
+        if (stopping) continue;
+        const VolumeData* next;
+        if (pendingVolume.consume(next) && next != volumeData) {
+            const VolumeData* previous = volumeData;
+            volumeData = next;
+            volumeRendering.reset(volumeData ? new VolumeRendering(volumeData) : nullptr);
+            illumination.reset();
+            if (previous) emit volumeReleased(previous);
+        }
+        if (!latest.consume(request) || !volumeRendering) continue;
+
+        QElapsedTimer timer;
+        timer.start();
+        const RenderParams& params = request.params;
+        if (params.shadows && params.renderMode == RenderMode::AlphaBlending) {
+            if (!illumination) illumination.reset(new IlluminationVolume(volumeData));
+            illumination->update(params.transferFunction, IlluminationVolume::lightDirection(params.camera, params.lighting));
+        }
+        RenderedImage rendered = volumeRendering->render(params, illumination.get());
+        QImage image = QImage(rendered.pixels.data(), rendered.width, rendered.height, rendered.width * 3, QImage::Format_RGB888).copy();
+
+        FrameStats stats;
+        stats.renderMs = timer.nsecsElapsed() / 1e6;
+        stats.inputNs = request.inputNs;
+        stats.coalesced = coalesced.exchange(0);
+        emit frameReady(image, stats);
+    }
+}
@@ -0,0 +1,72 @@
+﻿#pragma once
+#include <QElapsedTimer>
+#include <QImage>
+#include <QSemaphore>
+#include <QThread>
+#include <atomic>
+#include <memory>
+
+#include "illumination_volume.h"
+#include "latest_value.h"
+#include "render_params.h"
+#include "volume_data.h"
+#include "volume_rendering.h"
+
+/**
+ * 在单独的线程上用 CPU 渲染 (VolumeRendering::render)，界面线程只负责发布最新的参数和显示结果
+ * 参数通过 LatestValue 传递，渲染线程每次只渲染最新的一份，渲染期间到达的旧参数直接丢弃，界面线程从不等待任何一帧
+ * 体数据也一样，渲染线程在下一帧开始前换上最新的一份，不再使用的体数据通过 volumeReleased 通知界面线程释放
+ */
+class RenderThread : public QThread {
+    Q_OBJECT
+   public:
+    struct FrameStats {
+        // 这一帧对应的第一个输入事件的时间，原样从 publish 传过来
+        qint64 inputNs = 0;
+        double renderMs = 0;
+        // 上一帧之后被新参数覆盖、没有渲染的参数个数
+        unsigned coalesced = 0;
+    };
+
+    explicit RenderThread(QObject* parent = nullptr);
+    ~RenderThread();
+
+    /**
+     * 切换体数据，不等待正在渲染的一帧；旧的体数据要等收到 volumeReleased 之后才能释放
+     */
+    void setVolumeData(const VolumeData* volumeData);
+    /**
+     * 发布新的参数，inputNs 为触发这次渲染的第一个输入事件的时间，显示这一帧时用来计算输入延迟
+     */
+    void publish(const RenderParams& params, qint64 inputNs);
+
+   signals:
+    void frameReady(const QImage& image, const RenderThread::FrameStats& stats);
+    // 渲染线程不会再使用这份体数据了，在渲染线程上发出；换上之前就被覆盖的体数据在 setVolumeData 中直接发出
+    void volumeReleased(const VolumeData* volumeData);
+
+   protected:
+    void run() override;
+
+   private:
+    struct Request {
+        RenderParams params;
+        qint64 inputNs = 0;
+    };
+    LatestValue<Request> latest;
+    // 只用来唤醒渲染线程，release 不会阻塞
+    QSemaphore wake;
+    std::atomic<bool> stopping{false};
+    std::atomic<unsigned> coalesced{0};
+
+    // 界面线程最后发布的体数据，只在界面线程上使用
+    const VolumeData* publishedVolume = nullptr;
+    LatestValue<const VolumeData*> pendingVolume;
+    // 以下只在渲染线程上使用
+    std::unique_ptr<VolumeRendering> volumeRendering;
+    std::unique_ptr<IlluminationVolume> illumination;
+    const VolumeData* volumeData = nullptr;
+};
+
+Q_DECLARE_METATYPE(RenderThread::FrameStats)
+Q_DECLARE_METATYPE(const VolumeData*)
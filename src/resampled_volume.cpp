@@ -0,0 +1,187 @@
+﻿#include "resampled_volume.h"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <iostream>
+
+static float filterRadius(ResampleFilter filter) {
+    switch (filter) {
+        case ResampleFilter::Box:
+            return 0.5f;
+        case ResampleFilter::Tent:
+            return 1.f;
+        case ResampleFilter::Lanczos3:
+        default:
+            return 3.f;
+    }
+}
+
+static float filterWeight(ResampleFilter filter, float x) {
+    switch (filter) {
+        case ResampleFilter::Box:
+            return x >= -0.5f && x < 0.5f ? 1.f : 0.f;
+        case ResampleFilter::Tent:
+            return std::max(0.f, 1.f - std::abs(x));
+        case ResampleFilter::Lanczos3:
+        default: {
+            if (std::abs(x) < 1e-6f) return 1.f;
+            if (std::abs(x) >= 3.f) return 0.f;
+            const float pi = 3.14159265358979f;
+            float px = pi * x;
+            return 3.f * std::sin(px) * std::sin(px / 3.f) / (px * px);
+        }
+    }
+}
+
+ResampledVolume::ResampledVolume(const VolumeData* volumeData, glm::vec3 targetSpacing, ResampleFilter filter)
+    : type(volumeData->type),
+      reverseGradientDirection(volumeData->reverseGradientDirection),
+      valueScale(volumeData->valueScale),
+      valueOffset(volumeData->valueOffset) {
+    glm::vec3 extent = glm::vec3(volumeData->dim) * volumeData->spacing;
+    dim = glm::max(glm::ivec3(extent / targetSpacing + 0.5f), glm::ivec3(1));
+    spacing = extent / glm::vec3(dim);
+    data.resize((size_t)dim[0] * dim[1] * dim[2] * voxelSize(type));
+    dispatchVoxelType(type, [&](auto zero) {
+        resample<decltype(zero)>(volumeData, filter);
+    });
+    std::cout << "Resampled " << volumeData->dim.x << " x " << volumeData->dim.y << " x " << volumeData->dim.z << " -> "
+              << dim.x << " x " << dim.y << " x " << dim.z << ", spacing " << spacing.x << ", " << spacing.y << ", " << spacing.z << std::endl;
+}
+
+glm::vec3 ResampledVolume::isotropicSpacing(const VolumeData* volumeData, size_t maxVoxels) {
+    const glm::vec3& s = volumeData->spacing;
+    float spacing = std::min({s.x, s.y, s.z});
+    if (maxVoxels > 0) {
+        glm::vec3 extent = glm::vec3(volumeData->dim) * s;
+        double voxels = (double)extent.x * extent.y * extent.z / ((double)spacing * spacing * spacing);
+        if (voxels > maxVoxels) spacing *= (float)std::cbrt(voxels / maxVoxels);
+    }
+    return glm::vec3(spacing);
+}
+
+glm::vec3 ResampledVolume::budgetSpacing(const VolumeData* volumeData, size_t maxVoxels) {
+    double voxels = (double)volumeData->size();
+    if (maxVoxels == 0 || voxels <= maxVoxels) return volumeData->spacing;
+    return volumeData->spacing * (float)std::cbrt(voxels / maxVoxels);
+}
+
+VolumeData* ResampledVolume::createVolumeData() const {
+    VolumeData* volumeData = new VolumeData(data.data(), type, dim, spacing, reverseGradientDirection);
+    volumeData->setValueMapping(valueScale, valueOffset);
+    return volumeData;
+}
+
+ResampledVolume::AxisWeights ResampledVolume::axisWeights(int inputSize, int outputSize, ResampleFilter filter) {
+    AxisWeights weights;
+    // 输出体素的中心 (i + 0.5) * scale - 0.5 在输入中的坐标；缩小时滤波器按比例展宽，避免走样
+    const float scale = (float)inputSize / outputSize;
+    const float width = std::max(scale, 1.f);
+    const float radius = filterRadius(filter) * width;
+    for (int i = 0; i < outputSize; i++) {
+        weights.first.push_back((int)weights.index.size());
+        float center = (i + 0.5f) * scale - 0.5f;
+        float sum = 0;
+        for (int j = (int)std::ceil(center - radius); j <= (int)std::floor(center + radius); j++) {
+            float w = filterWeight(filter, (j - center) / width);
+            if (w == 0.f) continue;
+            // 边界外的体素 clamp 到边界上，相同的输入体素合并权重
+            int index = std::clamp(j, 0, inputSize - 1);
+            if (weights.index.size() > (size_t)weights.first.back() && weights.index.back() == index) {
+                weights.weight.back() += w;
+            } else {
+                weights.index.push_back(index);
+                weights.weight.push_back(w);
+            }
+            sum += w;
+        }
+        if (sum == 0.f) {
+            weights.index.push_back(std::clamp((int)std::round(center), 0, inputSize - 1));
+            weights.weight.push_back(1.f);
+        } else {
+            for (size_t k = weights.first.back(); k < weights.weight.size(); k++) {
+                weights.weight[k] /= sum;
+            }
+        }
+    }
+    weights.first.push_back((int)weights.index.size());
+    return weights;
+}
+
+template <typename T>
+void ResampledVolume::resample(const VolumeData* volumeData, ResampleFilter filter) {
+    const glm::ivec3 inputDim = volumeData->dim;
+    const AxisWeights wz = axisWeights(inputDim[0], dim[0], filter);
+    const AxisWeights wy = axisWeights(inputDim[1], dim[1], filter);
+    const AxisWeights wx = axisWeights(inputDim[2], dim[2], filter);
+    const T* input = volumeData->voxels<T>();
+    T* output = reinterpret_cast<T*>(data.data());
+    const size_t inputSlice = (size_t)inputDim[1] * inputDim[2];
+    const size_t outputSlice = (size_t)dim[1] * dim[2];
+
+    // 只在 x 方向上重采样之后的一层
+    std::vector<float> rows((size_t)inputDim[1] * dim[2]);
+    // 在 x、y 方向上重采样之后的输入层，只保留当前输出层的 z 滤波窗口用到的那些
+    std::deque<std::vector<float>> window;
+    int windowFirst = 0;
+    std::vector<float> sum(outputSlice);
+
+    for (int z = 0; z < dim[0]; z++) {
+        int lo = wz.index[wz.first[z]], hi = wz.index[wz.first[z + 1] - 1];
+        while (!window.empty() && windowFirst < lo) {
+            window.pop_front();
+            windowFirst++;
+        }
+        if (window.empty()) windowFirst = lo;
+        while (windowFirst + (int)window.size() <= hi) {
+            const T* slice = input + (size_t)(windowFirst + window.size()) * inputSlice;
+            window.emplace_back(outputSlice);
+            float* resampled = window.back().data();
+#pragma omp parallel for
+            for (int y = 0; y < inputDim[1]; y++) {
+                const T* row = slice + (size_t)y * inputDim[2];
+                float* dst = rows.data() + (size_t)y * dim[2];
+                for (int x = 0; x < dim[2]; x++) {
+                    float value = 0;
+                    for (int k = wx.first[x]; k < wx.first[x + 1]; k++) {
+                        value += wx.weight[k] * (float)row[wx.index[k]];
+                    }
+                    dst[x] = value;
+                }
+            }
+            // y 和 z 方向上都是连续的整行相加，编译器可以向量化
+#pragma omp parallel for
+            for (int y = 0; y < dim[1]; y++) {
+                float* dst = resampled + (size_t)y * dim[2];
+                std::fill(dst, dst + dim[2], 0.f);
+                for (int k = wy.first[y]; k < wy.first[y + 1]; k++) {
+                    const float* src = rows.data() + (size_t)wy.index[k] * dim[2];
+                    const float w = wy.weight[k];
+                    for (int x = 0; x < dim[2]; x++) {
+                        dst[x] += w * src[x];
+                    }
+                }
+            }
+        }
+
+        T* dstSlice = output + (size_t)z * outputSlice;
+#pragma omp parallel for
+        for (int y = 0; y < dim[1]; y++) {
+            float* acc = sum.data() + (size_t)y * dim[2];
+            std::fill(acc, acc + dim[2], 0.f);
+            for (int k = wz.first[z]; k < wz.first[z + 1]; k++) {
+                const float* src = window[wz.index[k] - windowFirst].data() + (size_t)y * dim[2];
+                const float w = wz.weight[k];
+                for (int x = 0; x < dim[2]; x++) {
+                    acc[x] += w * src[x];
+                }
+            }
+            T* dst = dstSlice + (size_t)y * dim[2];
+            // Lanczos 的过冲截断到类型的范围内，不会溢出
+            for (int x = 0; x < dim[2]; x++) {
+                dst[x] = toVoxel<T>(acc[x]);
+            }
+        }
+    }
+}
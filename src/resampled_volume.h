@@ -0,0 +1,62 @@
+﻿#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "memory_budget.h"
+#include "volume_data.h"
+
+enum class ResampleFilter {
+    // 缩小时为区域平均，放大时为最近邻
+    Box,
+    // 线性插值，缩小时按比例展宽
+    Tent,
+    // a = 3 的 Lanczos，锐利但是会有少量过冲，结果截断到体素类型的范围内
+    Lanczos3,
+};
+
+/**
+ * 把体数据重采样到新的间距，例如各向同性的间距，或者把太大的数据缩小到体素数量的预算之内
+ * 三个方向分开滤波：每一层先在 x、y 方向上重采样，z 方向只保留滤波窗口内的几层，
+ * 所以除了输出之外只需要很少的额外内存；输出保持原来的体素类型和值映射，可以直接交给渲染器
+ */
+class ResampledVolume {
+   public:
+    /**
+     * 输出的大小为 round(dim * spacing / targetSpacing)，实际的间距会稍微调整，保证物理尺寸不变
+     */
+    ResampledVolume(const VolumeData* volumeData, glm::vec3 targetSpacing, ResampleFilter filter = ResampleFilter::Lanczos3);
+
+    /**
+     * 各向同性的间距，取最小的间距；maxVoxels 大于 0 时再放大到体素数量不超过 maxVoxels
+     */
+    static glm::vec3 isotropicSpacing(const VolumeData* volumeData, size_t maxVoxels = 0);
+    /**
+     * 保持各个方向间距的比例，只在体素数量超过 maxVoxels 时等比例放大间距
+     */
+    static glm::vec3 budgetSpacing(const VolumeData* volumeData, size_t maxVoxels);
+
+    /**
+     * 用重采样后的数据创建 VolumeData，数据仍然属于 ResampledVolume，需要比返回的 VolumeData 活得更久
+     */
+    VolumeData* createVolumeData() const;
+
+    VoxelType type;
+    HostBuffer data{MemoryCategory::DerivedVolume};
+    glm::ivec3 dim;
+    glm::vec3 spacing;
+    bool reverseGradientDirection;
+    float valueScale, valueOffset;
+
+   private:
+    /**
+     * 一个方向上每个输出体素用到的输入体素和权重，first[i] 到 first[i + 1] 之间为第 i 个输出体素的部分
+     */
+    struct AxisWeights {
+        std::vector<int> first;
+        std::vector<int> index;
+        std::vector<float> weight;
+    };
+    static AxisWeights axisWeights(int inputSize, int outputSize, ResampleFilter filter);
+    template <typename T>
+    void resample(const VolumeData* volumeData, ResampleFilter filter);
+};
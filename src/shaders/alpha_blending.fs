@@ -6,13 +6,14 @@ struct Material{
     float shininess;
 };
 struct Light{
-    vec3 position;
     vec4 ambient;
     vec4 diffuse;
     vec4 specular;
 };
 uniform Material material;
 uniform Light light;
+// 光源位置已经在 CPU 上变换到了 model 空间，不需要每个采样点都求一次 inverse(viewMatrix)
+uniform vec3 lightPosition;
 
 uniform mat4 viewMatrix;
 uniform mat3 normalMatrix;
@@ -26,12 +27,49 @@ uniform float aspectRatio;
 // 眼睛到投射平面的距离
 uniform float focalLength;
 uniform float stepLength;
+// 质量控制器改变步长之前的基础步长（半个体素），用来修正不透明度和计算梯度
+uniform float baseStepLength;
+// 为 false 时只用传输函数的颜色，不计算法向量和光照
+uniform bool useLighting;
+// 光线起点的抖动，jitterOffset 每一帧不同，见 ray_jitter.h
+uniform bool useJitter;
+uniform float jitterOffset;
 uniform float gamma;
 uniform bool reverseGradient;
 uniform float opacityThreshold;
 uniform float colorThreshold;
 
-uniform usampler3D volume;
+// 体素类型对应的 sampler（usampler3D, isampler3D 或 sampler3D），由 RayCasting::buildProgram 定义
+uniform VOLUME_SAMPLER volume;
+// 预计算的光照体：r 为光源方向上的透过率（阴影），g 为环境光遮蔽
+uniform sampler3D illumination;
+uniform bool useIllumination;
+// 代理几何体正面和背面的深度，给出每个像素光线的入口和出口
+uniform sampler2D proxyEntry;
+uniform sampler2D proxyExit;
+// 近平面裁掉了代理几何体的正面：画的是包围盒的背面，不用 proxyEntry，光线从包围盒的入口开始
+uniform bool entryClipped;
+uniform float zNear;
+uniform float zFar;
+// 裁剪盒和裁剪平面，都在 [0, 1] 的纹理坐标下；平面保留 dot(n, p) + d >= 0 的一侧
+uniform vec3 cropMin;
+uniform vec3 cropMax;
+uniform vec4 clipPlanes[6];
+uniform int clipPlaneCount;
+// 纹理只包含裁剪盒覆盖的子区域时，子区域在整个体数据中的起点和大小
+uniform vec3 textureOrigin;
+uniform vec3 textureExtent;
+// 量化后的体数据通过 原始值 = 纹理值 * valueScale + valueOffset 映射回原始单位，未量化时为 1 和 0
+uniform float valueScale;
+uniform float valueOffset;
+// 分割标签：每个体素 labelBits 位，按行打包在 R8UI 纹理中，labelDim 为体素数 (x, y, z)
+// 标签 0 为没有分割的体素，unlabeledVisible 时按传输函数显示；其他标签的颜色和不透明度在 labelColors 中，隐藏的标签 alpha 为 0
+uniform usampler3D labels;
+uniform bool useLabels;
+uniform int labelBits;
+uniform ivec3 labelDim;
+uniform vec4 labelColors[64];
+uniform bool unlabeledVisible;
 
 // Ray
 struct Ray{
@@ -58,6 +96,31 @@ vec3 getRayDirection(){
     return rayDirection;
 }
 
+// 整个体数据的纹理坐标 position 处的原始值，纹理只包含子区域时先换算到子区域中
+float sampleVolume(vec3 position){
+    return float(texture(volume,(position-textureOrigin)/textureExtent).r)*valueScale+valueOffset;
+}
+
+// 最近的体素的标签，和 LabelVolume::labelAt 一致
+uint sampleLabel(vec3 position){
+    ivec3 voxel=clamp(ivec3(floor(position*vec3(labelDim))),ivec3(0),labelDim-1);
+    int bit=voxel.x*labelBits;
+    uint packed=texelFetch(labels,ivec3(bit/8,voxel.y,voxel.z),0).r;
+    return (packed>>uint(bit%8))&uint((1<<labelBits)-1);
+}
+
+// 深度缓冲中的值转换为光线参数 t：view 空间中的光线为 t*(x,y,-focalLength)
+float depthToRayParameter(float depth){
+    float zNdc=2.*depth-1.;
+    float distance=2.*zNear*zFar/((zFar+zNear)-zNdc*(zFar-zNear));
+    return distance/focalLength;
+}
+
+// 和 ray_jitter.h 中的 rayJitter 一致：interleaved gradient noise 加上每一帧的偏移
+float rayJitter(){
+    return fract(52.9829189*fract(dot(gl_FragCoord.xy,vec2(.06711056,.00583715)))+jitterOffset);
+}
+
 float max3(vec3 v){
     return max(max(v.x,v.y),v.z);
 }
@@ -79,6 +142,27 @@ void ray_box_intersection(Ray ray,AABB box,out float t_enter,out float t_exit)
     t_exit=min3(t_xyz_exit);
 }
 
+// 纹理坐标下的光线 o + tv 和裁剪盒、裁剪平面求交，缩小 [t_0, t_1]
+void clip_ray(vec3 o,vec3 v,inout float t_0,inout float t_1)
+{
+    vec3 direction_inv=1./v;
+    vec3 t_max=direction_inv*(cropMax-o);
+    vec3 t_min=direction_inv*(cropMin-o);
+    t_0=max(t_0,max3(min(t_max,t_min)));
+    t_1=min(t_1,min3(max(t_max,t_min)));
+    for(int i=0;i<clipPlaneCount;i++){
+        float num=dot(clipPlanes[i].xyz,o)+clipPlanes[i].w;
+        float denom=dot(clipPlanes[i].xyz,v);
+        if(denom>0){
+            t_0=max(t_0,-num/denom);
+        }else if(denom<0){
+            t_1=min(t_1,-num/denom);
+        }else if(num<0){
+            t_1=t_0;
+        }
+    }
+}
+
 // A very simple color transfer function
 vec4 color_transfer(float ratio)
 {
@@ -111,7 +195,7 @@ vec4 color_transfer(float ratio)
 // Estimate normal from a finite difference approximation of the gradient
 vec3 normal(vec3 position,float intensity)
 {
-    float d=stepLength*30;
+    float d=baseStepLength*30;
     // float dx=texture(volume,position+vec3(d,0,0)).r-texture(volume,position+vec3(-d,0,0)).r;
     // dx+=texture(volume,position+vec3(d,d,0)).r-texture(volume,position+vec3(-d,d,0)).r;
     // dx+=texture(volume,position+vec3(d,-d,0)).r-texture(volume,position+vec3(-d,-d,0)).r;
@@ -130,13 +214,38 @@ vec3 normal(vec3 position,float intensity)
     // dz+=texture(volume,position+vec3(0,d,d)).r-texture(volume,position+vec3(0,d,-d)).r;
     // dz+=texture(volume,position+vec3(0,-d,d)).r-texture(volume,position+vec3(0,-d,-d)).r;
     
-    float dx=texture(volume,position+vec3(d,0,0)).r-intensity;
-    float dy=texture(volume,position+vec3(0,d,0)).r-intensity;
-    float dz=texture(volume,position+vec3(0,0,d)).r-intensity;
+    float dx=sampleVolume(position+vec3(d,0,0))-intensity;
+    float dy=sampleVolume(position+vec3(0,d,0))-intensity;
+    float dz=sampleVolume(position+vec3(0,0,d))-intensity;
     
     return normalize(normalMatrix*((reverseGradient?-1:1)*vec3(dx,dy,dz)));
 }
 
+vec4 shade(vec4 c,vec3 position,float intensity,vec3 viewDir){
+    // 传输函数的颜色作为材质的 ambient 和 diffuse 属性
+    vec4 ambient=light.ambient*c;
+    // diffuse
+    vec3 norm=normal(position,intensity);
+    vec3 lightDir=normalize(lightPosition-position);
+    float diff=max(dot(norm,lightDir),0.);
+    vec4 diffuse=light.diffuse*(diff*c);
+    
+    // specular
+    vec3 h=normalize(lightDir+viewDir);
+    float spec=pow(max(dot(norm,h),0.),material.shininess);
+    vec4 specular=light.specular*(spec*material.specular);
+    
+    // 阴影和环境光遮蔽只影响颜色，不改变不透明度
+    if(useIllumination){
+        vec2 il=texture(illumination,position).rg;
+        ambient.rgb*=il.g;
+        diffuse.rgb*=il.r;
+        specular.rgb*=il.r;
+    }
+    
+    return diffuse+specular+ambient;
+}
+
 void main(){
     vec3 v=getRayDirection();
     // the parametric equation of the ray: p = o + tv, where o is the origin of the ray, given by the position of the camera, and v is its direction, given by the vector going from the camera to the fragment
@@ -146,6 +255,24 @@ void main(){
     Ray casting_ray=Ray(o,v);
     AABB bounding_box=AABB(top,bottom);
     ray_box_intersection(casting_ray,bounding_box,t_0,t_1);
+    // 换算到纹理坐标之后参数 t 不变，裁剪掉的部分不会产生任何采样
+    clip_ray((o-bottom)/(top-bottom),v/(top-bottom),t_0,t_1);
+    
+    vec2 uv=gl_FragCoord.xy/viewportSize;
+    if(!entryClipped){
+        // 同一个像素上可能有多个正面，只有最近的那个需要步进
+        float entryDepth=texture(proxyEntry,uv).r;
+        if(gl_FragCoord.z>entryDepth+1e-6){
+            discard;
+        }
+        t_0=max(t_0,depthToRayParameter(entryDepth));
+    }
+    // 只在不透明砖块的外表面之间步进，而不是整个包围盒
+    t_1=min(t_1,depthToRayParameter(texture(proxyExit,uv).r));
+    if(t_1<=t_0){
+        FragColor=backgroundColor;
+        return;
+    }
     
     // 这里 ray_start 和 ray_stop 都是在 bottom 和 top 之间的比例，在 0~1 之间，所以后面的 texture() 采样用这个值的话，是在单位立方体坐标上采样的，正好符合 texture 的使用方法
     vec3 ray_start=(o+v*t_0-bottom)/(top-bottom);
@@ -156,31 +283,37 @@ void main(){
     vec3 stepVector=stepLength*ray/rayLength;
     
     vec3 position=ray_start;
+    // 起点往前挪一个步长以内的距离，固定步长产生的木纹变成高频噪声，多帧累积之后平均掉
+    if(useJitter){
+        float jitter=rayJitter();
+        position+=jitter*stepVector;
+        rayLength-=jitter*stepLength;
+    }
     // 背景需要抵消后面的 gamma 矫正，因为 Qt 里面没有校正
     vec4 color=vec4(pow(backgroundColor,vec3(gamma)),0);
+    vec3 viewDir=-normalize(v);
     
     // Ray march until reaching the end of the volume, or color saturation
     while(rayLength>0&&color.a<1.){
         
-        float intensity=texture(volume,position).r;
+        float intensity=sampleVolume(position);
         
         vec4 c=color_transfer(intensity);
-        
-        // 传输函数的颜色作为材质的 ambient 和 diffuse 属性
-        vec4 ambient=light.ambient*c;
-        // diffuse
-        vec3 norm=normal(position,intensity);
-        vec3 lightDir=normalize((inverse(viewMatrix)*vec4(light.position,0)).xyz-position);
-        float diff=max(dot(norm,lightDir),0.);
-        vec4 diffuse=light.diffuse*(diff*c);
-        
-        // specular
-        vec3 viewDir=-normalize(v);
-        vec3 h=normalize(lightDir+viewDir);
-        float spec=pow(max(dot(norm,h),0.),material.shininess);
-        vec4 specular=light.specular*(spec*material.specular);
-        
-        c=diffuse+specular+ambient;
+        if(useLabels){
+            uint label=sampleLabel(position);
+            if(label!=0u){
+                c=labelColors[label];
+            }else if(!unlabeledVisible){
+                c=vec4(0);
+            }
+        }
+        // 步长变大时修正每个采样点的不透明度，整体的透明程度不随步长变化
+        if(stepLength!=baseStepLength){
+            c.a=1.-pow(1.-c.a,stepLength/baseStepLength);
+        }
+        if(useLighting){
+            c=shade(c,position,intensity,viewDir);
+        }
         
         // Alpha-blending
         color.rgb=color.rgb+(1-color.a)*c.a*c.rgb;
@@ -0,0 +1,118 @@
+#version 330 core
+// 等值面模式第一遍：只沿光线找第一个 >= isoValue 的位置，写到命中缓冲中，不做任何着色
+// xyz 为命中点的纹理坐标，w 为 1 表示命中，0 表示没有命中
+out vec4 hitPosition;
+
+uniform mat4 viewMatrix;
+uniform vec3 rayOrigin;
+uniform vec3 top;
+uniform vec3 bottom;
+uniform vec2 viewportSize;
+// 宽高比
+uniform float aspectRatio;
+// 眼睛到投射平面的距离
+uniform float focalLength;
+uniform float stepLength;
+uniform float isoValue;
+
+// 体素类型对应的 sampler（usampler3D, isampler3D 或 sampler3D），由 RayCasting::buildProgram 定义
+uniform VOLUME_SAMPLER volume;
+// 和 alpha_blending.fs 一样的裁剪盒、裁剪平面和子区域纹理
+uniform vec3 cropMin;
+uniform vec3 cropMax;
+uniform vec4 clipPlanes[6];
+uniform int clipPlaneCount;
+uniform vec3 textureOrigin;
+uniform vec3 textureExtent;
+uniform float valueScale;
+uniform float valueOffset;
+
+// 交点的二分次数
+const int REFINE_STEPS=6;
+
+// 计算当前像素对应的光线方向
+vec3 getRayDirection(){
+    vec3 rayDirection;
+    rayDirection.xy=2.*gl_FragCoord.xy/viewportSize-1.;
+    rayDirection.x*=aspectRatio;
+    rayDirection.z=-focalLength;
+    rayDirection=(inverse(viewMatrix)*vec4(rayDirection,0)).xyz;
+    return rayDirection;
+}
+
+float max3(vec3 v){
+    return max(max(v.x,v.y),v.z);
+}
+float min3(vec3 v){
+    return min(min(v.x,v.y),v.z);
+}
+
+// 整个体数据的纹理坐标 position 处的原始值，纹理只包含子区域时先换算到子区域中
+float sampleVolume(vec3 position){
+    return float(texture(volume,(position-textureOrigin)/textureExtent).r)*valueScale+valueOffset;
+}
+
+void clip_ray(vec3 o,vec3 v,inout float t_0,inout float t_1){
+    vec3 direction_inv=1./v;
+    vec3 t_max=direction_inv*(cropMax-o);
+    vec3 t_min=direction_inv*(cropMin-o);
+    t_0=max(t_0,max3(min(t_max,t_min)));
+    t_1=min(t_1,min3(max(t_max,t_min)));
+    for(int i=0;i<clipPlaneCount;i++){
+        float num=dot(clipPlanes[i].xyz,o)+clipPlanes[i].w;
+        float denom=dot(clipPlanes[i].xyz,v);
+        if(denom>0){
+            t_0=max(t_0,-num/denom);
+        }else if(denom<0){
+            t_1=min(t_1,-num/denom);
+        }else if(num<0){
+            t_1=t_0;
+        }
+    }
+}
+
+void main(){
+    vec3 v=getRayDirection();
+    vec3 o=rayOrigin;
+    // Slab method for ray-box intersection
+    vec3 direction_inv=1./v;
+    vec3 t_top=direction_inv*(top-o);
+    vec3 t_bottom=direction_inv*(bottom-o);
+    float t_0=max(0,max3(min(t_top,t_bottom)));
+    float t_1=min3(max(t_top,t_bottom));
+    clip_ray((o-bottom)/(top-bottom),v/(top-bottom),t_0,t_1);
+
+    hitPosition=vec4(0);
+    if(t_1<=t_0){
+        return;
+    }
+    vec3 ray_start=(o+v*t_0-bottom)/(top-bottom);
+    vec3 ray_stop=(o+v*t_1-bottom)/(top-bottom);
+    vec3 ray=ray_stop-ray_start;
+    float rayLength=length(ray);
+    vec3 stepVector=stepLength*ray/rayLength;
+
+    vec3 position=ray_start;
+    if(sampleVolume(position)>=isoValue){
+        hitPosition=vec4(position,1);
+        return;
+    }
+    while(rayLength>0){
+        rayLength-=stepLength;
+        position+=stepVector;
+        if(sampleVolume(position)>=isoValue){
+            // 在前后两个采样点之间二分，得到更精确的交点
+            vec3 a=position-stepVector,b=position;
+            for(int i=0;i<REFINE_STEPS;i++){
+                vec3 m=(a+b)*.5;
+                if(sampleVolume(m)>=isoValue){
+                    b=m;
+                }else{
+                    a=m;
+                }
+            }
+            hitPosition=vec4(b,1);
+            return;
+        }
+    }
+}
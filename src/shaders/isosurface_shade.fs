@@ -0,0 +1,89 @@
+#version 330 core
+// 等值面模式第二遍：读取命中缓冲，每个像素只在交点处计算一次法向量和光照
+// 只改光照时不需要重新执行第一遍的光线步进
+out vec3 FragColor;
+
+struct Material{
+    vec4 specular;
+    float shininess;
+};
+struct Light{
+    vec4 ambient;
+    vec4 diffuse;
+    vec4 specular;
+};
+uniform Material material;
+uniform Light light;
+// 光源位置已经在 CPU 上变换到了 model 空间
+uniform vec3 lightPosition;
+
+uniform mat4 viewMatrix;
+uniform mat3 normalMatrix;
+uniform vec3 backgroundColor;
+uniform vec2 viewportSize;
+uniform float aspectRatio;
+uniform float focalLength;
+uniform float gamma;
+uniform bool reverseGradient;
+// 等值面的颜色，取传输函数在 isoValue 处的颜色
+uniform vec3 surfaceColor;
+
+// 体素类型对应的 sampler（usampler3D, isampler3D 或 sampler3D），由 RayCasting::buildProgram 定义
+uniform VOLUME_SAMPLER volume;
+uniform sampler2D hitBuffer;
+// 纹理只包含裁剪盒覆盖的子区域时，子区域在整个体数据中的起点和大小
+uniform vec3 textureOrigin;
+uniform vec3 textureExtent;
+// 量化后的体数据映射回原始单位
+uniform float valueScale;
+uniform float valueOffset;
+
+float sampleVolume(vec3 position){
+    return float(texture(volume,(position-textureOrigin)/textureExtent).r)*valueScale+valueOffset;
+}
+
+vec3 getRayDirection(){
+    vec3 rayDirection;
+    rayDirection.xy=2.*gl_FragCoord.xy/viewportSize-1.;
+    rayDirection.x*=aspectRatio;
+    rayDirection.z=-focalLength;
+    rayDirection=(inverse(viewMatrix)*vec4(rayDirection,0)).xyz;
+    return rayDirection;
+}
+
+// 每个像素只算一次法向量，用一个体素间隔的中心差分，比前向差分更平滑
+vec3 normal(vec3 position)
+{
+    vec3 d=textureExtent/vec3(textureSize(volume,0));
+    float dx=sampleVolume(position+vec3(d.x,0,0))-sampleVolume(position-vec3(d.x,0,0));
+    float dy=sampleVolume(position+vec3(0,d.y,0))-sampleVolume(position-vec3(0,d.y,0));
+    float dz=sampleVolume(position+vec3(0,0,d.z))-sampleVolume(position-vec3(0,0,d.z));
+    vec3 gradient=normalMatrix*((reverseGradient?-1:1)*vec3(dx,dy,dz));
+    return length(gradient)>0?normalize(gradient):vec3(0);
+}
+
+void main(){
+    vec4 hit=texelFetch(hitBuffer,ivec2(gl_FragCoord.xy),0);
+    if(hit.w==0){
+        FragColor=backgroundColor;
+        return;
+    }
+    vec3 position=hit.xyz;
+    vec4 c=vec4(surfaceColor,1);
+
+    vec4 ambient=light.ambient*c;
+    // diffuse
+    vec3 norm=normal(position);
+    vec3 lightDir=normalize(lightPosition-position);
+    float diff=max(dot(norm,lightDir),0.);
+    vec4 diffuse=light.diffuse*(diff*c);
+    // specular
+    vec3 viewDir=-normalize(getRayDirection());
+    vec3 h=normalize(lightDir+viewDir);
+    float spec=pow(max(dot(norm,h),0.),material.shininess);
+    vec4 specular=light.specular*(spec*material.specular);
+
+    c=diffuse+specular+ambient;
+    // Gamma correction
+    FragColor=pow(c.rgb,vec3(1./gamma));
+}
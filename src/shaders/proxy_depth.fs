@@ -0,0 +1,4 @@
+#version 330 core
+// 只写深度，用来得到代理几何体正面（光线入口）和背面（光线出口）的深度
+void main(){
+}
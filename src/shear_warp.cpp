@@ -0,0 +1,297 @@
+﻿/**
+ * VolumeRendering 的 shear-warp 渲染 (Lacroute and Levoy 1994)，透视投影的版本：
+ * 1. 选择和视线方向最接近的体素轴作为主轴，每一层沿主轴的投影只是一次缩放和平移
+ * 2. 从前往后逐层合成到和层平行的中间图像上，层内按行连续访问体数据
+ * 3. 把中间图像变换到最终的图片上，每个像素只做一次二维的双线性插值
+ */
+#include <algorithm>
+#include <cmath>
+
+#include "volume_rendering.h"
+
+// 每次处理的层数；主轴为 x 时先把这些层转置到连续的缓冲中，体数据的每一行只读一次
+static const int SLAB_SIZE = 16;
+// 中间图像按行分成带，每个线程负责一条带上从前往后的所有层，线程之间不需要同步
+static const int BAND_HEIGHT = 8;
+// 超过这个不透明度的像素不再合成，后面的层直接跳过
+static const float OPAQUE_ALPHA = 0.99f;
+// 体数据投影之后比图片大时降低中间图像的分辨率，最多降到每个体素 1/4 个像素
+static const float MIN_INTERMEDIATE_SCALE = 0.25f;
+
+// 从 i 开始第一个还没有不透明的像素，next[i] == i 表示像素 i 还要继续合成；查找时顺便减半路径
+static inline int nextOpen(int* next, int i) {
+    while (next[i] != i) {
+        next[i] = next[next[i]];
+        i = next[i];
+    }
+    return i;
+}
+
+// 层内的双线性插值，r0、r1 为相邻的两行，u 超出范围时 clamp 到边界
+template <typename T>
+static inline float bilinear(const T* r0, const T* r1, float u, float fv, int maxU) {
+    u = std::clamp(u, 0.f, (float)maxU);
+    int u0 = (int)u, u1 = std::min(u0 + 1, maxU);
+    float fu = u - u0;
+    float top = (float)r0[u0] + ((float)r0[u1] - (float)r0[u0]) * fu;
+    float bottom = (float)r1[u0] + ((float)r1[u1] - (float)r1[u0]) * fu;
+    return top + (bottom - top) * fv;
+}
+
+static inline void writePixel(RenderedImage& image, int x, int y, glm::vec3 color) {
+    unsigned char* pixel = &image.pixels[((size_t)y * image.width + x) * 3];
+    for (int c = 0; c < 3; c++) {
+        pixel[c] = (unsigned char)(std::clamp(color[c], 0.f, 1.f) * 255 + 0.5f);
+    }
+}
+
+bool VolumeRendering::canShearWarp(const RenderParams& params) const {
+    if (params.renderMode != RenderMode::AlphaBlending) return false;
+    ShearWarpView view;
+    return shearWarpView(frameContext(params), view);
+}
+
+bool VolumeRendering::shearWarpView(const FrameContext& ctx, ShearWarpView& view) const {
+    const RenderParams& params = *ctx.params;
+    const glm::vec3 extent = ctx.top - ctx.bottom;
+    view.eye = volumeData->voxelPosition((ctx.rayOrigin - ctx.bottom) / extent);
+    // 主轴取眼睛到体数据中心的方向上物理长度分量最大的轴，包围盒的 x, y, z 对应体素的 dim[2], dim[1], dim[0]
+    glm::vec3 center = glm::abs(ctx.rayOrigin);
+    view.a = center.z >= center.y && center.z >= center.x ? 0 : center.y >= center.x ? 1 : 2;
+    view.u = view.a == 2 ? 1 : 2;
+    view.v = view.a == 0 ? 1 : 0;
+    const int a = view.a;
+    // 眼睛在层之间时有的光线往两个方向穿过层，不能按同一个顺序合成
+    if (view.eye[a] > -0.5f && view.eye[a] < dim[a] - 0.5f) return false;
+
+    glm::ivec3 voxelMin, voxelMax;
+    params.clipping.voxelRegion(dim, 1, voxelMin, voxelMax);
+    view.step = view.eye[a] < 0 ? 1 : -1;
+    view.front = view.step > 0 ? voxelMin[a] : voxelMax[a] - 1;
+    view.back = view.step > 0 ? voxelMax[a] - 1 : voxelMin[a];
+
+    // 第 k 层以眼睛为中心缩放 s 倍投影到基准平面上，离眼睛越远的层越小，所以范围只取决于第一层和最后一层
+    glm::vec2 lo(std::numeric_limits<float>::max()), hi(std::numeric_limits<float>::lowest());
+    for (int k : {view.front, view.back}) {
+        float s = (view.front - view.eye[a]) / (k - view.eye[a]);
+        for (int i = 0; i < 2; i++) {
+            int axis = i == 0 ? view.u : view.v;
+            float e = view.eye[axis];
+            float p0 = e + (-0.5f - e) * s, p1 = e + (dim[axis] - 0.5f - e) * s;
+            lo[i] = std::min({lo[i], p0, p1});
+            hi[i] = std::max({hi[i], p0, p1});
+        }
+    }
+    // 基准平面上一个体素在图片上大约占多少像素
+    glm::vec3 basePoint;
+    basePoint[a] = (float)view.front;
+    basePoint[view.u] = (dim[view.u] - 1) * 0.5f;
+    basePoint[view.v] = (dim[view.v] - 1) * 0.5f;
+    glm::vec3 baseTex{(basePoint[2] + 0.5f) / dim[2], (basePoint[1] + 0.5f) / dim[1], (basePoint[0] + 0.5f) / dim[0]};
+    float distance = glm::length(ctx.bottom + baseTex * extent - ctx.rayOrigin);
+    float voxelSize = std::min(extent[2 - view.u] / dim[view.u], extent[2 - view.v] / dim[view.v]);
+    float voxelPixels = params.height * 0.5f * ctx.focalLength * voxelSize / distance;
+    view.scale = std::clamp(voxelPixels, MIN_INTERMEDIATE_SCALE, 1.f);
+    view.uMin = lo[0];
+    view.vMin = lo[1];
+    view.width = (int)std::ceil((hi[0] - lo[0]) * view.scale) + 1;
+    view.height = (int)std::ceil((hi[1] - lo[1]) * view.scale) + 1;
+
+    // 沿中心的光线，相邻两层之间的距离（纹理坐标下），和 castRay 的 stepLength 是同一个单位
+    glm::vec3 centerDirection = glm::normalize(glm::vec3(0.5f) - (ctx.rayOrigin - ctx.bottom) / extent);
+    float sliceDistance = 1.f / dim[a] / std::max(std::abs(centerDirection[2 - a]), 1e-6f);
+    view.opacityExponent = sliceDistance / (params.baseStepLength > 0 ? params.baseStepLength : params.stepLength);
+    return true;
+}
+
+RenderedImage VolumeRendering::renderShearWarp(const RenderParams& params, const IlluminationVolume* illumination) const {
+    FrameContext ctx = frameContext(params, illumination);
+    ShearWarpView view;
+    if (params.renderMode != RenderMode::AlphaBlending || !shearWarpView(ctx, view)) {
+        RenderParams rayCasting = params;
+        rayCasting.shearWarp = false;
+        return render(rayCasting, illumination);
+    }
+
+    std::vector<glm::vec4> intermediate((size_t)view.width * view.height, glm::vec4(0.f));
+    dispatchVoxelType(volumeData->type, [&](auto zero) {
+        compositeShearWarp<decltype(zero)>(ctx, view, intermediate);
+    });
+
+    RenderedImage image;
+    image.width = params.width;
+    image.height = params.height;
+    image.pixels.resize((size_t)image.width * image.height * 3);
+    const glm::vec3 extent = ctx.top - ctx.bottom;
+    auto fetch = [&](int i, int j) {
+        if (i < 0 || j < 0 || i >= view.width || j >= view.height) return glm::vec4(0.f);
+        return intermediate[(size_t)j * view.width + i];
+    };
+    // warp：每个像素的光线和基准平面求交，在中间图像上双线性插值
+#pragma omp parallel for
+    for (int y = 0; y < image.height; y++) {
+        for (int x = 0; x < image.width; x++) {
+            glm::vec3 t = rayDirection(ctx, x, y) / extent;
+            glm::vec3 d{t.z * dim[0], t.y * dim[1], t.x * dim[2]};
+            glm::vec4 color(0.f);
+            float distance = (view.front - view.eye[view.a]) / d[view.a];
+            if (distance > 0) {
+                float fi = (view.eye[view.u] + distance * d[view.u] - view.uMin) * view.scale;
+                float fj = (view.eye[view.v] + distance * d[view.v] - view.vMin) * view.scale;
+                int i = (int)std::floor(fi), j = (int)std::floor(fj);
+                float wi = fi - i, wj = fj - j;
+                glm::vec4 top = fetch(i, j) * (1 - wi) + fetch(i + 1, j) * wi;
+                glm::vec4 bottom = fetch(i, j + 1) * (1 - wi) + fetch(i + 1, j + 1) * wi;
+                color = top * (1 - wj) + bottom * wj;
+            }
+            // 和 castRay 一样，颜色从背景色开始累加，再做 gamma 矫正
+            writePixel(image, x, y, glm::pow(ctx.background + glm::vec3(color), glm::vec3(1.f / params.gamma)));
+        }
+    }
+    return image;
+}
+
+template <typename T>
+void VolumeRendering::compositeShearWarp(const FrameContext& ctx, const ShearWarpView& view, std::vector<glm::vec4>& intermediate) const {
+    const RenderParams& params = *ctx.params;
+    const int a = view.a, ua = view.u, va = view.v;
+    const int maxU = dim[ua] - 1, maxV = dim[va] - 1;
+    const int width = view.width, height = view.height;
+    const T* data = volumeData->voxels<T>();
+    const float valueScale = volumeData->valueScale, valueOffset = volumeData->valueOffset;
+    const bool clipped = params.clipping.isCropped() || !params.clipping.planes.empty();
+    const glm::vec3 extent = ctx.top - ctx.bottom;
+    const glm::vec3 eyeTex = (ctx.rayOrigin - ctx.bottom) / extent;
+    const int brickSize = brickGrid.brickSize;
+    const int bricksU = brickGrid.dim[ua];
+
+    // 中间图像每一行的不透明像素跳转表，最后多一个哨兵
+    std::vector<int> next((size_t)height * (width + 1));
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i <= width; i++) {
+            next[(size_t)j * (width + 1) + i] = i;
+        }
+    }
+    // 主轴为 x 时层内的行在内存中不连续，把当前的一组层（前后各多一层用来算梯度）转置成 [x][z][y]
+    std::vector<T> slab;
+    int slabFirst = 0;
+    auto row = [&](int k, int v) -> const T* {
+        switch (a) {
+            case 0:
+                return data + ((size_t)k * dim[1] + v) * dim[2];
+            case 1:
+                return data + ((size_t)v * dim[1] + k) * dim[2];
+            default:
+                return slab.data() + ((size_t)(k - slabFirst) * dim[0] + v) * dim[1];
+        }
+    };
+
+    const int sliceCount = (view.back - view.front) * view.step + 1;
+    for (int n0 = 0; n0 < sliceCount; n0 += SLAB_SIZE) {
+        const int n1 = std::min(n0 + SLAB_SIZE, sliceCount);
+        if (a == 2) {
+            int k0 = view.front + n0 * view.step, k1 = view.front + (n1 - 1) * view.step;
+            int first = std::max(std::min(k0, k1) - 1, 0), last = std::min(std::max(k0, k1) + 1, dim[2] - 1);
+            int count = last - first + 1;
+            slabFirst = first;
+            slab.resize((size_t)count * dim[0] * dim[1]);
+#pragma omp parallel for
+            for (int z = 0; z < dim[0]; z++) {
+                for (int y = 0; y < dim[1]; y++) {
+                    const T* src = data + ((size_t)z * dim[1] + y) * dim[2] + first;
+                    for (int c = 0; c < count; c++) {
+                        slab[((size_t)c * dim[0] + z) * dim[1] + y] = src[c];
+                    }
+                }
+            }
+        }
+
+        const int bands = (height + BAND_HEIGHT - 1) / BAND_HEIGHT;
+#pragma omp parallel for schedule(dynamic)
+        for (int band = 0; band < bands; band++) {
+            for (int n = n0; n < n1; n++) {
+                const int k = view.front + n * view.step;
+                const int kPrev = std::max(k - 1, 0), kNext = std::min(k + 1, dim[a] - 1);
+                // 第 k 层上的坐标 = 眼睛 + (基准平面上的坐标 - 眼睛) / s，中间图像上走一个像素在层上走 step 个体素
+                const float s = (view.front - view.eye[a]) / (k - view.eye[a]);
+                const float step = 1.f / (view.scale * s);
+                const float u0 = view.eye[ua] + (view.uMin - view.eye[ua]) / s;
+                const float v0 = view.eye[va] + (view.vMin - view.eye[va]) / s;
+                const int iMin = std::max(0, (int)std::ceil((-0.5f - u0) / step));
+                const int iMax = std::min(width - 1, (int)std::floor((maxU + 0.5f - u0) / step));
+                const int jMin = std::max(band * BAND_HEIGHT, (int)std::ceil((-0.5f - v0) / step));
+                const int jMax = std::min({(band + 1) * BAND_HEIGHT, height, (int)std::floor((maxV + 0.5f - v0) / step) + 1}) - 1;
+
+                for (int j = jMin; j <= jMax; j++) {
+                    int* rowNext = next.data() + (size_t)j * (width + 1);
+                    if (nextOpen(rowNext, std::max(iMin, 0)) > iMax) continue;
+                    const float v = std::clamp(v0 + j * step, 0.f, (float)maxV);
+                    const int vi = (int)v;
+                    const float fv = v - vi;
+                    const T *r0 = row(k, vi), *r1 = row(k, std::min(vi + 1, maxV));
+                    // 梯度用层内前后一个体素和相邻两层的中心差分
+                    const float vUp = std::min(v + 1.f, (float)maxV), vDown = std::max(v - 1.f, 0.f);
+                    const int viUp = (int)vUp, viDown = (int)vDown;
+                    const T *up0 = row(k, viUp), *up1 = row(k, std::min(viUp + 1, maxV));
+                    const T *down0 = row(k, viDown), *down1 = row(k, std::min(viDown + 1, maxV));
+                    const T *next0 = row(kNext, vi), *next1 = row(kNext, std::min(vi + 1, maxV));
+                    const T *prev0 = row(kPrev, vi), *prev1 = row(kPrev, std::min(vi + 1, maxV));
+                    glm::vec4* dst = intermediate.data() + (size_t)j * width;
+
+                    glm::ivec3 brick;
+                    brick[a] = k / brickSize;
+                    brick[va] = vi / brickSize;
+                    // 按砖块的占用情况把这一行分成不透明的区间，完全透明的区间直接跳过
+                    for (int bu = 0; bu < bricksU;) {
+                        brick[ua] = bu;
+                        if (!ctx.occupancy[brickGrid.index(brick[0], brick[1], brick[2])]) {
+                            bu++;
+                            continue;
+                        }
+                        int buEnd = bu + 1;
+                        for (; buEnd < bricksU; buEnd++) {
+                            brick[ua] = buEnd;
+                            if (!ctx.occupancy[brickGrid.index(brick[0], brick[1], brick[2])]) break;
+                        }
+                        // 这些砖块覆盖的体素 [bu, buEnd) * brickSize 对应的中间图像上的列
+                        int first = bu == 0 ? iMin : std::max(iMin, (int)std::ceil((bu * brickSize - u0) / step));
+                        int last = buEnd == bricksU ? iMax : std::min(iMax, (int)std::ceil((buEnd * brickSize - u0) / step) - 1);
+                        bu = buEnd;
+
+                        for (int i = nextOpen(rowNext, first); i <= last; i = nextOpen(rowNext, i + 1)) {
+                            const float u = u0 + i * step;
+                            float intensity = bilinear(r0, r1, u, fv, maxU) * valueScale + valueOffset;
+                            glm::vec3 voxel;
+                            voxel[a] = (float)k;
+                            voxel[ua] = std::clamp(u, 0.f, (float)maxU);
+                            voxel[va] = v;
+                            glm::vec4 c = classify(ctx, voxel, intensity);
+                            if (c.a <= 0) continue;
+                            glm::vec3 position{(voxel[2] + 0.5f) / dim[2], (voxel[1] + 0.5f) / dim[1], (voxel[0] + 0.5f) / dim[0]};
+                            if (clipped && !params.clipping.contains(position)) continue;
+                            if (view.opacityExponent != 1.f) {
+                                c.a = 1.f - std::pow(1.f - c.a, view.opacityExponent);
+                            }
+                            glm::vec3 gradient;
+                            gradient[ua] = bilinear(r0, r1, u + 1.f, fv, maxU) - bilinear(r0, r1, u - 1.f, fv, maxU);
+                            gradient[va] = bilinear(up0, up1, u, vUp - viUp, maxU) - bilinear(down0, down1, u, vDown - viDown, maxU);
+                            gradient[a] = bilinear(next0, next1, u, fv, maxU) - bilinear(prev0, prev1, u, fv, maxU);
+                            // 体素坐标 (z, y, x) 换成纹理坐标的顺序，和 isosurfaceNormal 一样以一个体素为间隔
+                            glm::vec3 norm = normalizeGradient(glm::vec3(gradient[2], gradient[1], gradient[0]) * valueScale, ctx);
+                            glm::vec3 viewDir = -glm::normalize((position - eyeTex) * extent);
+                            glm::vec2 lightFactors = ctx.illumination ? ctx.illumination->sample(position) : glm::vec2(1.f);
+                            c = shade(c, norm, position, viewDir, ctx, lightFactors);
+
+                            glm::vec4& color = dst[i];
+                            color.r += (1 - color.a) * c.a * c.r;
+                            color.g += (1 - color.a) * c.a * c.g;
+                            color.b += (1 - color.a) * c.a * c.b;
+                            color.a += (1 - color.a) * c.a;
+                            if (color.a >= OPAQUE_ALPHA) rowNext[i] = i + 1;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,93 @@
+﻿#include "slice_view.h"
+
+#include <QElapsedTimer>
+
+SliceView::SliceView(QWidget* parent) : QWidget(parent) {
+    orientationBox = new QComboBox;
+    orientationBox->addItems({"Axial", "Coronal", "Sagittal", "Oblique (view aligned)"});
+    slabModeBox = new QComboBox;
+    slabModeBox->addItems({"Thin", "MIP", "Average"});
+    slabThicknessBox = new QDoubleSpinBox;
+    slabThicknessBox->setRange(0, 50);
+    slabThicknessBox->setSingleStep(0.5);
+    slabThicknessBox->setSuffix(" mm");
+    positionSlider = new QSlider(Qt::Orientation::Horizontal);
+    positionSlider->setRange(0, 1000);
+    positionSlider->setValue(500);
+    positionSlider->setFocusPolicy(Qt::StrongFocus);
+
+    imageLabel = new QLabel;
+    imageLabel->setAlignment(Qt::AlignCenter);
+    imageLabel->setMinimumSize(128, 128);
+    imageLabel->setSizePolicy(QSizePolicy::Ignored, QSizePolicy::Ignored);
+    infoLabel = new QLabel;
+
+    QHBoxLayout* hBoxLayout1 = new QHBoxLayout;
+    hBoxLayout1->addWidget(orientationBox);
+    hBoxLayout1->addWidget(slabModeBox);
+    hBoxLayout1->addWidget(slabThicknessBox);
+    QVBoxLayout* vBoxLayout = new QVBoxLayout;
+    vBoxLayout->addLayout(hBoxLayout1);
+    vBoxLayout->addWidget(imageLabel, 10);
+    vBoxLayout->addWidget(positionSlider);
+    vBoxLayout->addWidget(infoLabel);
+    setLayout(vBoxLayout);
+
+    connect(orientationBox, QOverload<int>::of(&QComboBox::currentIndexChanged), this, &SliceView::updateSlice);
+    connect(slabModeBox, QOverload<int>::of(&QComboBox::currentIndexChanged), this, &SliceView::updateSlice);
+    connect(slabThicknessBox, QOverload<double>::of(&QDoubleSpinBox::valueChanged), this, &SliceView::updateSlice);
+    connect(positionSlider, &QSlider::valueChanged, this, &SliceView::updateSlice);
+}
+
+SliceView::~SliceView() {
+    delete mprEngine;
+}
+
+void SliceView::setVolumeData(VolumeData* volumeData) {
+    delete mprEngine;
+    mprEngine = volumeData ? new MprEngine(volumeData) : nullptr;
+    updateSlice();
+}
+
+void SliceView::setCamera(const Camera& camera) {
+    this->camera = camera;
+    if (orientationBox->currentIndex() == 3) updateSlice();
+}
+
+void SliceView::updateSlice() {
+    if (!mprEngine) return;
+
+    QElapsedTimer timer;
+    timer.start();
+    float position = positionSlider->value() / 1000.f;
+    SlicePlane plane;
+    if (orientationBox->currentIndex() < 3) {
+        plane = mprEngine->orthogonalPlane((SliceOrientation)orientationBox->currentIndex(), position);
+    } else {
+        // 观察方向从 view 空间变换回 model 空间，model 的 x, y, z 分别对应体数据的 dim[2], dim[1], dim[0]
+        glm::mat4 inverseView = glm::inverse(camera.viewMatrix());
+        glm::vec3 forward = glm::vec3(inverseView * glm::vec4(0, 0, -1, 0));
+        glm::vec3 up = glm::vec3(inverseView * glm::vec4(0, 1, 0, 0));
+        glm::vec3 normal{forward.z, forward.y, forward.x};
+        glm::vec3 center = mprEngine->center() + glm::normalize(normal) * ((position - 0.5f) * mprEngine->diagonal());
+        int size = std::max(imageLabel->width(), imageLabel->height());
+        plane = mprEngine->obliquePlane(center, normal, {up.z, up.y, up.x}, std::min(size, 1024));
+    }
+    auto values = mprEngine->reslice(plane, slabThicknessBox->value(), (SlabMode)slabModeBox->currentIndex());
+    double resliceMs = timer.nsecsElapsed() / 1e6;
+
+    auto gray = MprEngine::toGray(values, mprEngine->dataMin, mprEngine->dataMax);
+    image = QImage(gray.data(), plane.width, plane.height, plane.width, QImage::Format_Grayscale8).copy();
+    infoLabel->setText(QString("%1 x %2, resliced in %3 ms").arg(plane.width).arg(plane.height).arg(resliceMs, 0, 'f', 2));
+    showImage();
+}
+
+void SliceView::showImage() {
+    if (image.isNull()) return;
+    imageLabel->setPixmap(QPixmap::fromImage(image).scaled(imageLabel->size(), Qt::KeepAspectRatio, Qt::SmoothTransformation));
+}
+
+void SliceView::resizeEvent(QResizeEvent* event) {
+    QWidget::resizeEvent(event);
+    showImage();
+}
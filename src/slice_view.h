@@ -0,0 +1,37 @@
+﻿#pragma once
+#include <QtWidgets>
+
+#include "camera.h"
+#include "mpr.h"
+#include "volume_data.h"
+
+/**
+ * 显示在 3D 视图旁边的 MPR 切片视图，支持轴位、冠状位、矢状位和跟随 3D 视图方向的斜切面
+ */
+class SliceView : public QWidget {
+    Q_OBJECT
+   public:
+    explicit SliceView(QWidget* parent = nullptr);
+    ~SliceView();
+    void setVolumeData(VolumeData* volumeData);
+
+   public slots:
+    // 斜切面垂直于 3D 视图的观察方向
+    void setCamera(const Camera& camera);
+
+   protected:
+    void resizeEvent(QResizeEvent* event) override;
+
+   private:
+    void updateSlice();
+    void showImage();
+
+    MprEngine* mprEngine = nullptr;
+    Camera camera;
+
+    QComboBox *orientationBox, *slabModeBox;
+    QSlider* positionSlider;
+    QDoubleSpinBox* slabThicknessBox;
+    QLabel *imageLabel, *infoLabel;
+    QImage image;
+};
@@ -0,0 +1,51 @@
+﻿#pragma once
+#include <glm/glm.hpp>
+
+/**
+ * 一维传输函数，和 alpha_blending.fs 中的 color_transfer 保持一致
+ * 不透明度：opacityThreshold 之前为 0，之后线性上升到 MAX_VALUE 处的 1
+ * 颜色：在 0, colorThreshold, MAX_VALUE 三个控制点之间线性插值
+ */
+struct TransferFunction {
+    static constexpr float MAX_VALUE = 4946.f;
+
+    float opacityThreshold = 1800.f, colorThreshold = 2482.f;
+
+    inline glm::vec4 operator()(float intensity) const {
+        glm::vec4 ans{0, 0, 0, 0};
+        if (intensity >= opacityThreshold && intensity < MAX_VALUE) {
+            ans.a = (intensity - opacityThreshold) / (MAX_VALUE - opacityThreshold);
+        }
+        const glm::vec3 colorVal[3] = {
+            {.23f, .29f, .75f},
+            {.098f, .3176f, .7922f},
+            {.70f, .01f, .14f},
+        };
+        if (intensity >= 0 && intensity < colorThreshold) {
+            float ratio = intensity / colorThreshold;
+            ans.r = colorVal[0].r * (1 - ratio) + colorVal[1].r * ratio;
+            ans.g = colorVal[0].g * (1 - ratio) + colorVal[1].g * ratio;
+            ans.b = colorVal[0].b * (1 - ratio) + colorVal[1].b * ratio;
+        } else if (intensity >= colorThreshold && intensity < MAX_VALUE) {
+            float ratio = (intensity - colorThreshold) / (MAX_VALUE - colorThreshold);
+            ans.r = colorVal[1].r * (1 - ratio) + colorVal[2].r * ratio;
+            ans.g = colorVal[1].g * (1 - ratio) + colorVal[2].g * ratio;
+            ans.b = colorVal[1].b * (1 - ratio) + colorVal[2].b * ratio;
+        }
+        return ans;
+    }
+
+    /**
+     * [low, high] 之间的值是否全部完全透明，用来跳过空的区域
+     */
+    inline bool isTransparent(float low, float high) const {
+        return high <= opacityThreshold || low >= MAX_VALUE;
+    }
+
+    inline bool operator==(const TransferFunction& other) const {
+        return opacityThreshold == other.opacityThreshold && colorThreshold == other.colorThreshold;
+    }
+    inline bool operator!=(const TransferFunction& other) const {
+        return !(*this == other);
+    }
+};
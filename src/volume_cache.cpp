@@ -0,0 +1,187 @@
+﻿#include "volume_cache.h"
+
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+
+static const char MAGIC[8] = {'V', 'R', 'C', 'A', 'C', 'H', 'E', '\0'};
+// 各部分的起始位置按页对齐，映射之后体素的地址也是对齐的
+static const uint64_t SECTION_ALIGNMENT = 4096;
+// 计算内容哈希时读取开头、中间和结尾的各一块，不需要读完整个文件
+static const qint64 HASH_CHUNK_SIZE = 1 << 20;
+
+static uint64_t alignUp(uint64_t offset) {
+    return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+}
+
+// 64 位 FNV-1a
+static uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+bool VolumeCache::Settings::operator==(const Settings& other) const {
+    return voxelType == other.voxelType && dim == other.dim && spacing == other.spacing && denoiseMode == other.denoiseMode &&
+           resampleMode == other.resampleMode && resampleFilter == other.resampleFilter && quantizationBits == other.quantizationBits;
+}
+
+std::string VolumeCache::cachePath(const std::string& source) {
+    // DICOM 文件夹的缓存放在文件夹旁边，不会被当成序列中的文件，也不会改变文件列表的哈希
+    return QDir::cleanPath(QString::fromStdString(source)).toStdString() + ".vrcache";
+}
+
+bool VolumeCache::sourceKey(const std::string& source, SourceKey& key) {
+    QFileInfo info(QString::fromStdString(source));
+    if (info.isDir()) {
+        QFileInfoList files = QDir(info.filePath()).entryInfoList(QDir::Files, QDir::Name);
+        key = SourceKey();
+        key.hash = fnv1a(nullptr, 0);
+        for (const QFileInfo& file : files) {
+            std::string name = file.fileName().toStdString();
+            int64_t size = file.size(), time = file.lastModified().toMSecsSinceEpoch();
+            key.size += size;
+            key.time = std::max(key.time, time);
+            key.hash = fnv1a(name.data(), name.size(), key.hash);
+            key.hash = fnv1a(&size, sizeof(size), key.hash);
+            key.hash = fnv1a(&time, sizeof(time), key.hash);
+        }
+        return !files.isEmpty();
+    }
+    QFile file(info.filePath());
+    if (!file.open(QIODevice::ReadOnly)) return false;
+    key.size = file.size();
+    key.time = info.lastModified().toMSecsSinceEpoch();
+    key.hash = fnv1a(nullptr, 0);
+    const qint64 positions[3] = {0, std::max<qint64>(file.size() / 2 - HASH_CHUNK_SIZE / 2, 0), std::max<qint64>(file.size() - HASH_CHUNK_SIZE, 0)};
+    for (qint64 position : positions) {
+        file.seek(position);
+        QByteArray chunk = file.read(HASH_CHUNK_SIZE);
+        key.hash = fnv1a(chunk.constData(), chunk.size(), key.hash);
+    }
+    return true;
+}
+
+VolumeCache* VolumeCache::open(const std::string& source, const Settings& settings) {
+    static_assert(std::is_trivially_copyable_v<Header>, "Header is written to the file as is");
+    SourceKey key;
+    if (!sourceKey(source, key)) return nullptr;
+    std::string path = cachePath(source);
+    VolumeCache* cache = new VolumeCache;
+    cache->file.setFileName(QString::fromStdString(path));
+    if (!cache->file.open(QIODevice::ReadOnly) || cache->file.size() < (qint64)sizeof(Header)) {
+        delete cache;
+        return nullptr;
+    }
+    const uint64_t fileSize = cache->file.size();
+    cache->mapped = cache->file.map(0, fileSize);
+    const Header* header = reinterpret_cast<const Header*>(cache->mapped);
+    cache->header = header;
+    auto invalid = [&](const char* reason) {
+        std::cout << "Volume cache " << path << " is " << reason << ", recomputing" << std::endl;
+        delete cache;
+        return nullptr;
+    };
+    if (!header) return invalid("not mappable");
+    if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != VERSION || header->headerSize != sizeof(Header)) {
+        return invalid("from another version");
+    }
+    if (header->sourceSize != key.size || header->sourceTime != key.time || header->sourceHash != key.hash) {
+        return invalid("stale");
+    }
+    // 设置不同不算失效，只是这次用不上
+    if (!(header->settings == settings)) {
+        delete cache;
+        return nullptr;
+    }
+    const glm::ivec3 dim = header->dim;
+    const uint64_t voxels = (uint64_t)dim[0] * dim[1] * dim[2];
+    const uint64_t bricks = (uint64_t)header->brickDim[0] * header->brickDim[1] * header->brickDim[2];
+    bool valid = header->voxelType >= 0 && header->voxelType <= (int)VoxelType::Float32 && voxels > 0 &&
+                 header->voxelBytes == voxels * voxelSize((VoxelType)header->voxelType) &&
+                 header->brickSize == BrickGrid::BRICK_SIZE && header->brickDim == (dim + header->brickSize - 1) / header->brickSize &&
+                 header->brickBytes == bricks * sizeof(float) && header->voxelOffset % SECTION_ALIGNMENT == 0 &&
+                 header->voxelOffset + header->voxelBytes <= fileSize && header->brickMinOffset + header->brickBytes <= fileSize &&
+                 header->brickMaxOffset + header->brickBytes <= fileSize;
+    if (!valid) return invalid("corrupted");
+
+    cache->brickGrid = new BrickGrid(dim, header->brickSize,
+                                     reinterpret_cast<const float*>(cache->mapped + header->brickMinOffset),
+                                     reinterpret_cast<const float*>(cache->mapped + header->brickMaxOffset));
+    cache->mappedMemory.set(fileSize);
+    std::cout << "Volume cache " << path << " mapped" << std::endl;
+    return cache;
+}
+
+bool VolumeCache::write(const std::string& source, const Settings& settings, VoxelType sourceType, glm::ivec3 sourceDim, glm::vec3 sourceSpacing,
+                        const VolumeData* volumeData, const BrickGrid& brickGrid) {
+    SourceKey key;
+    if (!sourceKey(source, key)) return false;
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.headerSize = sizeof(Header);
+    header.sourceSize = key.size;
+    header.sourceTime = key.time;
+    header.sourceHash = key.hash;
+    header.settings = settings;
+    header.sourceType = (int32_t)sourceType;
+    header.sourceDim = sourceDim;
+    header.sourceSpacing = sourceSpacing;
+    header.voxelType = (int32_t)volumeData->type;
+    header.dim = volumeData->dim;
+    header.spacing = volumeData->spacing;
+    header.reverseGradientDirection = volumeData->reverseGradientDirection;
+    header.valueScale = volumeData->valueScale;
+    header.valueOffset = volumeData->valueOffset;
+    header.dataMin = (volumeData->DATA_MIN - volumeData->valueOffset) / volumeData->valueScale;
+    header.dataMax = (volumeData->DATA_MAX - volumeData->valueOffset) / volumeData->valueScale;
+    header.brickSize = brickGrid.brickSize;
+    header.brickDim = brickGrid.dim;
+    header.voxelOffset = alignUp(sizeof(Header));
+    header.voxelBytes = volumeData->size() * voxelSize(volumeData->type);
+    header.brickBytes = brickGrid.minValue.size() * sizeof(float);
+    header.brickMinOffset = alignUp(header.voxelOffset + header.voxelBytes);
+    header.brickMaxOffset = alignUp(header.brickMinOffset + header.brickBytes);
+
+    std::string path = cachePath(source);
+    QSaveFile file(QString::fromStdString(path));
+    if (!file.open(QIODevice::WriteOnly)) {
+        std::cout << "Unable to write volume cache " << path << std::endl;
+        return false;
+    }
+    auto writeAt = [&](uint64_t offset, const void* data, uint64_t size) {
+        if ((uint64_t)file.pos() < offset) file.write(QByteArray(offset - file.pos(), '\0'));
+        file.write(static_cast<const char*>(data), size);
+    };
+    writeAt(0, &header, sizeof(header));
+    writeAt(header.voxelOffset, volumeData->data, header.voxelBytes);
+    writeAt(header.brickMinOffset, brickGrid.minValue.data(), header.brickBytes);
+    writeAt(header.brickMaxOffset, brickGrid.maxValue.data(), header.brickBytes);
+    if (!file.commit()) {
+        std::cout << "Unable to write volume cache " << path << std::endl;
+        return false;
+    }
+    std::cout << "Volume cache " << path << " written" << std::endl;
+    return true;
+}
+
+VolumeCache::~VolumeCache() {
+    delete brickGrid;
+    if (mapped) file.unmap(const_cast<uchar*>(mapped));
+}
+
+VolumeData* VolumeCache::createVolumeData() const {
+    VolumeData* volumeData = new VolumeData(mapped + header->voxelOffset, (VoxelType)header->voxelType, header->dim, header->spacing,
+                                            header->reverseGradientDirection != 0, header->dataMin, header->dataMax);
+    volumeData->setValueMapping(header->valueScale, header->valueOffset);
+    volumeData->brickGrid = brickGrid;
+    return volumeData;
+}
@@ -0,0 +1,110 @@
+﻿#pragma once
+#include <QFile>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <string>
+
+#include "brick_grid.h"
+#include "memory_budget.h"
+#include "volume_data.h"
+
+/**
+ * 预处理结果的缓存文件，放在源文件（或者 DICOM 文件夹）旁边，扩展名为 .vrcache
+ * 保存预处理（降噪、重采样、量化）之后的体素、最小值和最大值以及砖块的 min/max，
+ * 各部分按页对齐，下次用同样的设置打开同一个文件时直接映射这个文件，不需要重新读取和计算
+ * 源文件的大小、修改时间、内容的哈希或者预处理的设置变了，缓存自动失效，重新计算之后覆盖
+ */
+class VolumeCache {
+   public:
+    // 格式或者预处理的算法变化时加一，旧的缓存全部失效
+    static constexpr uint32_t VERSION = 1;
+
+    /**
+     * 决定缓存内容的设置，全部都是 4 字节的字段，没有填充，可以直接比较和写入文件
+     */
+    struct Settings {
+        // raw 文件的体素类型、大小和间距；DICOM 序列由序列本身决定，这几项为 0
+        int32_t voxelType = 0;
+        glm::ivec3 dim{0};
+        glm::vec3 spacing{0.f};
+        int32_t denoiseMode = 0;
+        int32_t resampleMode = 0;
+        int32_t resampleFilter = 0;
+        int32_t quantizationBits = 0;
+
+        bool operator==(const Settings& other) const;
+    };
+
+    /**
+     * 映射 source 的缓存文件，没有缓存或者缓存已经失效时返回 nullptr
+     */
+    static VolumeCache* open(const std::string& source, const Settings& settings);
+    /**
+     * 把预处理之后的 volumeData 和它的 brickGrid 写入缓存，sourceDim 等为读入时（预处理之前）的体数据
+     * 先写到临时文件再替换，失败时只打印信息，不影响已有的缓存
+     */
+    static bool write(const std::string& source, const Settings& settings, VoxelType sourceType, glm::ivec3 sourceDim, glm::vec3 sourceSpacing,
+                      const VolumeData* volumeData, const BrickGrid& brickGrid);
+    ~VolumeCache();
+
+    /**
+     * 体素直接指向映射的文件，brickGrid 也已经设置好，VolumeCache 需要比返回的 VolumeData 活得更久
+     */
+    VolumeData* createVolumeData() const;
+
+    inline VoxelType sourceType() const {
+        return (VoxelType)header->sourceType;
+    }
+    inline glm::ivec3 sourceDim() const {
+        return header->sourceDim;
+    }
+    inline glm::vec3 sourceSpacing() const {
+        return header->sourceSpacing;
+    }
+
+   private:
+    /**
+     * 文件开头的固定大小的头，后面依次是体素、砖块的最小值、砖块的最大值，偏移都从文件开头算起
+     */
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t headerSize;
+        // 源文件的键，DICOM 文件夹为所有文件的大小之和、最新的修改时间和文件列表的哈希
+        uint64_t sourceSize;
+        int64_t sourceTime;
+        uint64_t sourceHash;
+        Settings settings;
+        // 预处理之前的体数据
+        int32_t sourceType;
+        glm::ivec3 sourceDim;
+        glm::vec3 sourceSpacing;
+        // 预处理之后的体数据，最小值和最大值为体素中保存的值，没有经过 valueScale 和 valueOffset 映射
+        int32_t voxelType;
+        glm::ivec3 dim;
+        glm::vec3 spacing;
+        int32_t reverseGradientDirection;
+        float valueScale, valueOffset;
+        float dataMin, dataMax;
+        int32_t brickSize;
+        glm::ivec3 brickDim;
+        uint64_t voxelOffset, voxelBytes;
+        uint64_t brickMinOffset, brickMaxOffset, brickBytes;
+    };
+    struct SourceKey {
+        uint64_t size = 0;
+        int64_t time = 0;
+        uint64_t hash = 0;
+    };
+    static std::string cachePath(const std::string& source);
+    static bool sourceKey(const std::string& source, SourceKey& key);
+
+    VolumeCache() = default;
+
+    QFile file;
+    const uchar* mapped = nullptr;
+    // 映射的整个文件，按文件大小记账
+    TrackedMemory mappedMemory{MemoryCategory::MappedCache};
+    const Header* header = nullptr;
+    BrickGrid* brickGrid = nullptr;
+};
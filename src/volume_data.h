@@ -1,46 +1,159 @@
 ﻿#pragma once
+#include <algorithm>
 #include <glm/glm.hpp>
+#include <iostream>
 #include <limits>
 
+#include "voxel_type.h"
+
+class BrickGrid;
+class LabelVolume;
+
 class VolumeData {
    public:
-    VolumeData(const unsigned short* data, const glm::ivec3 dim, const glm::vec3 spacing, const bool reverseGradientDirection, bool normalize = false)
+    /**
+     * 体素类型由指针类型推导，例如 const unsigned short* 对应 VoxelType::UInt16
+     */
+    template <typename T>
+    VolumeData(const T* data, const glm::ivec3 dim, const glm::vec3 spacing, const bool reverseGradientDirection)
+        : VolumeData(data, VoxelTraits<T>::type, dim, spacing, reverseGradientDirection) {}
+    /**
+     * 体素类型在运行时才知道时（例如 RawReader 读入的数据）使用，data 按 type 解释，不做任何转换
+     * VolumeData 不拥有任何体素，data 属于读入或者计算出它的对象，需要比 VolumeData 活得更久
+     */
+    VolumeData(const void* data, VoxelType type, const glm::ivec3 dim, const glm::vec3 spacing, const bool reverseGradientDirection)
         : data(data),
+          type(type),
           dim(dim),
           spacing(spacing),
           reverseGradientDirection(reverseGradientDirection) {
-        if (normalize) {
-            DATA_MIN = std::numeric_limits<unsigned short>::max();
-            DATA_MAX = std::numeric_limits<unsigned short>::min();
-            for (int i = 0; i < dim[0]; i++) {
-                for (int j = 0; j < dim[1]; j++) {
-                    for (int k = 0; k < dim[2]; k++) {
-                        DATA_MIN = std::min(DATA_MIN, data[i * dim[1] * dim[2] + j * dim[2] + k]);
-                        DATA_MAX = std::max(DATA_MAX, data[i * dim[1] * dim[2] + j * dim[2] + k]);
-                    }
-                }
-            }
-            this->normailzedData = new float[dim[0] * dim[1] * dim[2]];
-            for (int i = 0; i < dim[0]; i++) {
-                for (int j = 0; j < dim[1]; j++) {
-                    for (int k = 0; k < dim[2]; k++) {
-                        this->normailzedData[i * dim[1] * dim[2] + j * dim[2] + k] = (float)(data[i * dim[1] * dim[2] + j * dim[2] + k] - DATA_MIN) / (DATA_MAX - DATA_MIN);
-                    }
-                }
-            }
-        }
+        dispatchVoxelType(type, [&](auto zero) {
+            computeStatistics<decltype(zero)>();
+        });
 
         std::cout << "VolumeData initialized" << std::endl;
     }
-    ~VolumeData() {
-        delete[] this->normailzedData;
+    /**
+     * 最小值和最大值已经知道时（例如从缓存中读出来的）使用，不扫描体数据；dataMin 和 dataMax 为体素中保存的值
+     */
+    VolumeData(const void* data, VoxelType type, const glm::ivec3 dim, const glm::vec3 spacing, const bool reverseGradientDirection, float dataMin, float dataMax)
+        : data(data),
+          type(type),
+          DATA_MIN(dataMin),
+          DATA_MAX(dataMax),
+          dim(dim),
+          spacing(spacing),
+          reverseGradientDirection(reverseGradientDirection) {
+    }
+
+    template <typename T>
+    inline const T* voxels() const {
+        return static_cast<const T*>(data);
+    }
+    /**
+     * 量化后的体数据保存的是量化值，通过 valueScale 和 valueOffset 映射回原始值，
+     * 这样传输函数、等值面阈值等仍然使用原始数据的单位
+     */
+    void setValueMapping(float scale, float offset) {
+        DATA_MIN = (DATA_MIN - valueOffset) / valueScale * scale + offset;
+        DATA_MAX = (DATA_MAX - valueOffset) / valueScale * scale + offset;
+        valueScale = scale;
+        valueOffset = offset;
+    }
+    inline bool isQuantized() const {
+        return valueScale != 1.f || valueOffset != 0.f;
     }
 
-    const unsigned short* data;
-    unsigned short DATA_MIN, DATA_MAX;
-    // 归一化到 0-1 之间之后的数据
-    float* normailzedData = nullptr;
+    // 返回原始单位下的值
+    template <typename T>
+    inline float value(int i, int j, int k) const {
+        return (float)voxels<T>()[(size_t)i * dim[1] * dim[2] + (size_t)j * dim[2] + k] * valueScale + valueOffset;
+    }
+    // 每次调用都要按类型分发，循环中应该使用 value<T>
+    inline float value(int i, int j, int k) const {
+        return dispatchVoxelType(type, [&](auto zero) {
+            return value<decltype(zero)>(i, j, k);
+        });
+    }
+    /**
+     * 三线性插值采样，pos 为体素坐标 (i, j, k)，越界的部分 clamp 到边界，和 GL_CLAMP_TO_EDGE 一致
+     */
+    template <typename T>
+    inline float sample(glm::vec3 pos) const {
+        pos = glm::clamp(pos, glm::vec3(0.f), glm::vec3(dim - 1));
+        glm::ivec3 p0 = glm::ivec3(pos);
+        glm::ivec3 p1 = glm::min(p0 + 1, dim - 1);
+        glm::vec3 f = pos - glm::vec3(p0);
+        float c00 = value<T>(p0.x, p0.y, p0.z) * (1 - f.z) + value<T>(p0.x, p0.y, p1.z) * f.z;
+        float c01 = value<T>(p0.x, p1.y, p0.z) * (1 - f.z) + value<T>(p0.x, p1.y, p1.z) * f.z;
+        float c10 = value<T>(p1.x, p0.y, p0.z) * (1 - f.z) + value<T>(p1.x, p0.y, p1.z) * f.z;
+        float c11 = value<T>(p1.x, p1.y, p0.z) * (1 - f.z) + value<T>(p1.x, p1.y, p1.z) * f.z;
+        float c0 = c00 * (1 - f.y) + c01 * f.y;
+        float c1 = c10 * (1 - f.y) + c11 * f.y;
+        return c0 * (1 - f.x) + c1 * f.x;
+    }
+    inline float sample(glm::vec3 pos) const {
+        return dispatchVoxelType(type, [&](auto zero) {
+            return sample<decltype(zero)>(pos);
+        });
+    }
+    /**
+     * 按 3D 纹理坐标采样，和 shader 中的 texture(volume, position) 对应
+     * 纹理坐标的 x 是最里面一层 (dim[2])，z 是最外面一层 (dim[0])
+     */
+    template <typename T>
+    inline float sampleTexCoord(glm::vec3 texCoord) const {
+        return sample<T>(voxelPosition(texCoord));
+    }
+    inline float sampleTexCoord(glm::vec3 texCoord) const {
+        return sample(voxelPosition(texCoord));
+    }
+    /**
+     * 3D 纹理坐标转换为体素坐标 (i, j, k)，体素中心在整数位置上
+     */
+    inline glm::vec3 voxelPosition(glm::vec3 texCoord) const {
+        return {texCoord.z * dim[0] - 0.5f, texCoord.y * dim[1] - 0.5f, texCoord.x * dim[2] - 0.5f};
+    }
+    inline size_t size() const {
+        return (size_t)dim[0] * dim[1] * dim[2];
+    }
+
+    const void* data;
+    VoxelType type;
+    // 所有体素的最小值和最大值，构造时计算一次，其他地方不需要再扫描整个体数据
+    float DATA_MIN, DATA_MAX;
+    // 原始值 = 体素值 * valueScale + valueOffset，未量化时为恒等映射
+    float valueScale = 1.f, valueOffset = 0.f;
     glm::ivec3 dim;
     glm::vec3 spacing{1.f, 1.f, 1.f};
     bool reverseGradientDirection = false;
+    // 已经算好的砖块（例如从缓存中读出来的），为空时由 RayCasting 和 VolumeRendering 自己计算
+    const BrickGrid* brickGrid = nullptr;
+    // 和体数据对齐的分割标签，为空时没有标签；不属于 VolumeData，需要比 VolumeData 活得更久
+    const LabelVolume* labels = nullptr;
+
+   private:
+    template <typename T>
+    void computeStatistics() {
+        const T* values = voxels<T>();
+        const long long n = (long long)size();
+        T lo = std::numeric_limits<T>::max(), hi = std::numeric_limits<T>::lowest();
+        // MSVC 的 OpenMP 不支持 min/max reduction，每个线程先算自己的部分
+#pragma omp parallel
+        {
+            T threadLo = std::numeric_limits<T>::max(), threadHi = std::numeric_limits<T>::lowest();
+#pragma omp for nowait
+            for (long long i = 0; i < n; i++) {
+                threadLo = std::min(threadLo, values[i]);
+                threadHi = std::max(threadHi, values[i]);
+            }
+#pragma omp critical
+            {
+                lo = std::min(lo, threadLo);
+                hi = std::max(hi, threadHi);
+            }
+        }
+        DATA_MIN = (float)lo;
+        DATA_MAX = (float)hi;
+    }
 };
@@ -0,0 +1,179 @@
+﻿#include "volume_filter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <iostream>
+#include <limits>
+
+// 双边滤波的值域权重查找表，覆盖 [0, 3 * rangeSigma)，最后一项为 0，超出的部分都落到最后一项
+static const int RANGE_TABLE_SIZE = 1024;
+
+VolumeFilter::VolumeFilter(DenoiseFilter filter, float sigma, float rangeSigma)
+    : m_filter(filter),
+      m_sigma(sigma),
+      m_rangeSigma(rangeSigma) {
+}
+
+std::vector<float> VolumeFilter::gaussianKernel(float sigma) {
+    const int radius = (int)std::ceil(3.f * sigma);
+    if (radius <= 0) return {1.f};
+    std::vector<float> kernel(2 * radius + 1);
+    float sum = 0;
+    for (int i = -radius; i <= radius; i++) {
+        kernel[i + radius] = std::exp(-0.5f * i * i / (sigma * sigma));
+        sum += kernel[i + radius];
+    }
+    for (float& w : kernel) {
+        w /= sum;
+    }
+    return kernel;
+}
+
+void VolumeFilter::combineRows(const std::vector<float>& kernel, const float* const* rows, float* dst, int n,
+                               const std::vector<float>& rangeWeights, float rangeScale) {
+    const int size = (int)kernel.size();
+    if (rangeWeights.empty()) {
+        // 连续的整行相乘相加，编译器可以向量化
+        std::fill(dst, dst + n, 0.f);
+        for (int k = 0; k < size; k++) {
+            const float* src = rows[k];
+            const float w = kernel[k];
+            for (int x = 0; x < n; x++) {
+                dst[x] += w * src[x];
+            }
+        }
+        return;
+    }
+    const float* center = rows[size / 2];
+    const int last = (int)rangeWeights.size() - 1;
+    for (int x = 0; x < n; x++) {
+        float value = 0, weightSum = 0;
+        for (int k = 0; k < size; k++) {
+            float v = rows[k][x];
+            int index = std::min((int)(std::abs(v - center[x]) * rangeScale), last);
+            float w = kernel[k] * rangeWeights[index];
+            value += w * v;
+            weightSum += w;
+        }
+        // 中心自己的权重不为 0，weightSum 总是大于 0
+        dst[x] = value / weightSum;
+    }
+}
+
+void VolumeFilter::apply(void* data, VoxelType type, glm::ivec3 dim, glm::vec3 spacing) const {
+    dispatchVoxelType(type, [&](auto zero) {
+        filter(static_cast<decltype(zero)*>(data), dim, spacing);
+    });
+    std::cout << (m_filter == DenoiseFilter::Bilateral ? "Bilateral" : "Gaussian") << " denoising " << dim.x << " x " << dim.y << " x " << dim.z
+              << ", sigma " << m_sigma << std::endl;
+}
+
+template <typename T>
+void VolumeFilter::filter(T* data, glm::ivec3 dim, glm::vec3 spacing) const {
+    // 三个方向的核覆盖相同的物理距离
+    const float minSpacing = std::min({spacing[0], spacing[1], spacing[2]});
+    const std::vector<float> kz = gaussianKernel(m_sigma * minSpacing / spacing[0]);
+    const std::vector<float> ky = gaussianKernel(m_sigma * minSpacing / spacing[1]);
+    const std::vector<float> kx = gaussianKernel(m_sigma * minSpacing / spacing[2]);
+    const int rz = (int)kz.size() / 2, ry = (int)ky.size() / 2, rx = (int)kx.size() / 2;
+    const size_t sliceSize = (size_t)dim[1] * dim[2];
+
+    std::vector<float> rangeWeights;
+    float rangeScale = 0;
+    if (m_filter == DenoiseFilter::Bilateral) {
+        const long long n = (long long)sliceSize * dim[0];
+        T lo = std::numeric_limits<T>::max(), hi = std::numeric_limits<T>::lowest();
+        // MSVC 的 OpenMP 不支持 min/max reduction，每个线程先算自己的部分
+#pragma omp parallel
+        {
+            T threadLo = std::numeric_limits<T>::max(), threadHi = std::numeric_limits<T>::lowest();
+#pragma omp for nowait
+            for (long long i = 0; i < n; i++) {
+                threadLo = std::min(threadLo, data[i]);
+                threadHi = std::max(threadHi, data[i]);
+            }
+#pragma omp critical
+            {
+                lo = std::min(lo, threadLo);
+                hi = std::max(hi, threadHi);
+            }
+        }
+        float rangeSigma = std::max(m_rangeSigma * ((float)hi - (float)lo), std::numeric_limits<float>::min());
+        rangeScale = (RANGE_TABLE_SIZE - 1) / (3.f * rangeSigma);
+        rangeWeights.resize(RANGE_TABLE_SIZE);
+        for (int i = 0; i < RANGE_TABLE_SIZE - 1; i++) {
+            float d = i / rangeScale / rangeSigma;
+            rangeWeights[i] = std::exp(-0.5f * d * d);
+        }
+        rangeWeights.back() = 0.f;
+    }
+
+    // 只在 x 方向上滤波之后的一层
+    std::vector<float> rows(sliceSize);
+    // 在 x、y 方向上滤波之后的层，只保留当前输出层的 z 滤波窗口用到的那些
+    std::deque<std::vector<float>> window;
+    int windowFirst = 0;
+
+    for (int z = 0; z < dim[0]; z++) {
+        const int lo = std::max(z - rz, 0), hi = std::min(z + rz, dim[0] - 1);
+        while (!window.empty() && windowFirst < lo) {
+            window.pop_front();
+            windowFirst++;
+        }
+        if (window.empty()) windowFirst = lo;
+        // 第 z + rz 层在这里读进窗口，之后才会被第 z 层的输出覆盖
+        while (windowFirst + (int)window.size() <= hi) {
+            const T* slice = data + (size_t)(windowFirst + window.size()) * sliceSize;
+            window.emplace_back(sliceSize);
+            float* filtered = window.back().data();
+#pragma omp parallel
+            {
+                // 两边按 clamp to edge 补齐的一行，rows[k] 就是移动了 k 个体素的同一行
+                std::vector<float> padded(dim[2] + 2 * rx);
+                std::vector<const float*> taps(kx.size());
+#pragma omp for
+                for (int y = 0; y < dim[1]; y++) {
+                    const T* row = slice + (size_t)y * dim[2];
+                    for (int x = 0; x < (int)padded.size(); x++) {
+                        padded[x] = (float)row[std::clamp(x - rx, 0, dim[2] - 1)];
+                    }
+                    for (int k = 0; k < (int)kx.size(); k++) {
+                        taps[k] = padded.data() + k;
+                    }
+                    combineRows(kx, taps.data(), rows.data() + (size_t)y * dim[2], dim[2], rangeWeights, rangeScale);
+                }
+            }
+#pragma omp parallel
+            {
+                std::vector<const float*> taps(ky.size());
+#pragma omp for
+                for (int y = 0; y < dim[1]; y++) {
+                    for (int k = 0; k < (int)ky.size(); k++) {
+                        taps[k] = rows.data() + (size_t)std::clamp(y + k - ry, 0, dim[1] - 1) * dim[2];
+                    }
+                    combineRows(ky, taps.data(), filtered + (size_t)y * dim[2], dim[2], rangeWeights, rangeScale);
+                }
+            }
+        }
+
+        T* dstSlice = data + (size_t)z * sliceSize;
+#pragma omp parallel
+        {
+            std::vector<const float*> taps(kz.size());
+            std::vector<float> result(dim[2]);
+#pragma omp for
+            for (int y = 0; y < dim[1]; y++) {
+                for (int k = 0; k < (int)kz.size(); k++) {
+                    int zk = std::clamp(z + k - rz, 0, dim[0] - 1);
+                    taps[k] = window[zk - windowFirst].data() + (size_t)y * dim[2];
+                }
+                combineRows(kz, taps.data(), result.data(), dim[2], rangeWeights, rangeScale);
+                T* dst = dstSlice + (size_t)y * dim[2];
+                for (int x = 0; x < dim[2]; x++) {
+                    dst[x] = toVoxel<T>(result[x]);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,46 @@
+﻿#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "voxel_type.h"
+
+enum class DenoiseFilter {
+    // 各向同性的高斯模糊，噪声和边缘一起变平滑
+    Gaussian,
+    // 每个方向上分别做一维的双边滤波，值差别大的邻居权重很小，边缘基本不会被抹平
+    Bilateral,
+};
+
+/**
+ * 体数据降噪，在读入之后、创建 VolumeData 之前原地滤波，后面的梯度、光照和渲染都使用滤波后的数据
+ * 三个方向分开滤波：每一层先在 x、y 方向上滤波，z 方向只保留滤波窗口内的几层，
+ * 一层的输出在它的窗口读完之后直接写回原来的位置，所以不需要第二份完整的体数据
+ */
+class VolumeFilter {
+   public:
+    /**
+     * sigma 为空间上的标准差，单位为间距最小的方向上的体素，其他方向按间距换算成相同的物理距离
+     * rangeSigma 为 Bilateral 在值域上的标准差，是数据范围 (max - min) 的比例
+     */
+    VolumeFilter(DenoiseFilter filter, float sigma = 1.f, float rangeSigma = 0.1f);
+
+    /**
+     * data 按 type 解释，大小为 dim (z, y, x)，spacing 的顺序和 dim 相同
+     */
+    void apply(void* data, VoxelType type, glm::ivec3 dim, glm::vec3 spacing) const;
+
+   private:
+    // 一维高斯核，大小为 2 * radius + 1，和为 1
+    static std::vector<float> gaussianKernel(float sigma);
+    /**
+     * dst[x] = sum(kernel[k] * rows[k][x])，rows[kernel.size() / 2] 为中心
+     * rangeWeights 不为空时为双边滤波，权重再乘上 rangeWeights[|rows[k][x] - 中心| * rangeScale] 并归一化
+     */
+    static void combineRows(const std::vector<float>& kernel, const float* const* rows, float* dst, int n,
+                            const std::vector<float>& rangeWeights, float rangeScale);
+    template <typename T>
+    void filter(T* data, glm::ivec3 dim, glm::vec3 spacing) const;
+
+    DenoiseFilter m_filter;
+    float m_sigma, m_rangeSigma;
+};
@@ -2,11 +2,36 @@
 
 #include <array>
 #include <glm/glm.hpp>
+#include <limits>
 #include <vector>
 
+#include "brick_grid.h"
+#include "illumination_volume.h"
+#include "label_volume.h"
+#include "render_params.h"
+#include "volume_data.h"
+
+/**
+ * 渲染结果，RGB888，按行从上到下存储
+ */
+struct RenderedImage {
+    int width = 0, height = 0;
+    std::vector<unsigned char> pixels;
+};
+
+/**
+ * 等值面模式下每个像素第一次穿过 isoValue 的位置（纹理坐标），w 为 1 表示命中，0 表示没有命中
+ */
+struct IsosurfaceHits {
+    RenderParams params;
+    std::vector<glm::vec4> hits;
+    // 交点只和相机、图片大小、步长和 isoValue 有关，这些都没变时可以直接复用
+    bool matches(const RenderParams& other) const;
+};
+
 class VolumeRendering {
    public:
-    VolumeRendering(const unsigned short* data, const glm::ivec3 dim, const glm::vec3 spacing, const bool reverseGradientDirection = false, const bool front2Back = true);
+    VolumeRendering(const VolumeData* volumeData, const bool front2Back = true);
     ~VolumeRendering();
 
     /**
@@ -14,17 +39,114 @@ class VolumeRendering {
      * 最简单的情况，假定观察平面完全平行于体数据
      */
     std::vector<std::vector<glm::vec4>> runAlgorithm();
+    /**
+     * 按照和 RayCasting 的 shader (alpha_blending.fs) 相同的相机模型、传输函数和光照进行 Ray Casting
+     * 不依赖 OpenGL，可以在多个线程中同时调用
+     * params.shadows 打开时需要传入已经 update 过的 illumination
+     */
+    RenderedImage render(const RenderParams& params, const IlluminationVolume* illumination = nullptr) const;
+    /**
+     * 用 passes 个不同的 jitterFrame 各渲染一次再取平均，和 GPU 上静止时的逐帧累积一致
+     * 每一遍可以使用比不抖动时大几倍的步长，适合离线批量渲染
+     */
+    RenderedImage renderAccumulated(const RenderParams& params, int passes, const IlluminationVolume* illumination = nullptr) const;
+    /**
+     * 等值面模式的两个阶段：先沿光线找到第一个交点，再对交点着色
+     * 只有光照或者颜色变化时，可以保留 findIsosurface 的结果只调用 shadeIsosurface
+     */
+    IsosurfaceHits findIsosurface(const RenderParams& params) const;
+    RenderedImage shadeIsosurface(const IsosurfaceHits& hits, const RenderParams& params) const;
+    /**
+     * Lacroute 的 shear-warp：沿主轴按内存顺序逐层合成到和层平行的中间图像，再做一次二维变换得到最终图片
+     * 只支持 alpha blending，并且眼睛在主轴方向上要在所有层的外面；params.shearWarp 打开时 render 会自动选择
+     */
+    bool canShearWarp(const RenderParams& params) const;
+    RenderedImage renderShearWarp(const RenderParams& params, const IlluminationVolume* illumination = nullptr) const;
 
    private:
-    const unsigned short* data;
+    const VolumeData* volumeData;
     glm::ivec3 dim;
     glm::vec3 spacing;
     bool reverseGradientDirection = false;
     bool front2Back = true;
-    unsigned short DATA_MIN = std::numeric_limits<unsigned short>::max(), DATA_MAX = std::numeric_limits<unsigned short>::min();
+    // 用每个砖块的 min/max 跳过光线经过的完全透明的区域
+    BrickGrid brickGrid;
+    // 等值面交点的二分次数
+    static constexpr int ISOSURFACE_REFINE_STEPS = 6;
+    float DATA_MIN = 0, DATA_MAX = 0;
+
+    /**
+     * 一帧之内所有光线共用的参数，对应 shader 中的 uniform
+     */
+    struct FrameContext {
+        const RenderParams* params;
+        glm::vec3 top, bottom;
+        glm::mat4 inverseView;
+        glm::mat3 normalMatrix;
+        glm::vec3 rayOrigin;
+        float aspectRatio, focalLength;
+        glm::vec3 lightPosition;
+        glm::vec3 background;
+        // 为空时不计算阴影和环境光遮蔽
+        const IlluminationVolume* illumination;
+        // 当前传输函数和标签表下每个砖块是否不透明
+        std::vector<unsigned char> occupancy;
+        // 为空时不使用标签
+        const LabelVolume* labels;
+    };
+    FrameContext frameContext(const RenderParams& params, const IlluminationVolume* illumination = nullptr) const;
+    glm::vec3 rayDirection(const FrameContext& ctx, int x, int y) const;
+    /**
+     * 光线和包围盒求交，得到 [0, 1] 纹理坐标下的起点和终点，没有交点时返回 false
+     */
+    bool rayInterval(const FrameContext& ctx, glm::vec3 rayDirection, glm::vec3& rayStart, glm::vec3& rayStop) const;
+    // 采样相关的函数按体素类型特化，每一帧只在最外层按 volumeData->type 分发一次
+    // jitter 为起点沿光线方向的偏移，以步长为单位
+    template <typename T>
+    glm::vec3 castRay(const FrameContext& ctx, glm::vec3 rayDirection, float jitter = 0.f) const;
+    template <typename T>
+    void findIsosurfaceRows(const FrameContext& ctx, IsosurfaceHits& result) const;
+
+    /**
+     * shear-warp 的分解：体素坐标下的主轴、层内的两个轴、眼睛的位置，以及中间图像的范围和分辨率
+     */
+    struct ShearWarpView {
+        // 主轴 a 和层内的 u、v 轴，都是体素坐标 (z, y, x) 的下标，u 总是内存中跨度更小的那个
+        int a, u, v;
+        glm::vec3 eye;
+        // 从前往后的第一层和最后一层（已经按裁剪盒缩小），step 为 +1 或者 -1
+        int front, back, step;
+        // 中间图像的像素 (i, j) 对应基准平面（第 front 层）上的 (uMin + i / scale, vMin + j / scale)
+        float uMin, vMin, scale;
+        int width, height;
+        // 相邻两层在光线上的距离和传输函数的步长之比，用来修正不透明度
+        float opacityExponent;
+    };
+    bool shearWarpView(const FrameContext& ctx, ShearWarpView& view) const;
+    // 中间图像为预乘 alpha 的 RGBA
+    template <typename T>
+    void compositeShearWarp(const FrameContext& ctx, const ShearWarpView& view, std::vector<glm::vec4>& intermediate) const;
+    // Phong 光照，和 alpha_blending.fs 一致，illumination 为 (透过率, 环境光遮蔽)
+    glm::vec4 shade(glm::vec4 color, glm::vec3 norm, glm::vec3 position, glm::vec3 viewDir, const FrameContext& ctx, glm::vec2 illumination = glm::vec2(1.f)) const;
+    template <typename T>
+    glm::vec3 normal(glm::vec3 position, float intensity, const FrameContext& ctx) const;
+    template <typename T>
+    glm::vec3 isosurfaceNormal(glm::vec3 position, const FrameContext& ctx) const;
+    glm::vec3 normalizeGradient(glm::vec3 gradient, const FrameContext& ctx) const;
+    /**
+     * 采样点的 RGBA，voxel 为体素坐标：有标签的体素使用标签的颜色和不透明度，没有标签的使用传输函数
+     */
+    inline glm::vec4 classify(const FrameContext& ctx, glm::vec3 voxel, float intensity) const {
+        if (ctx.labels) {
+            int label = ctx.labels->labelAt(voxel);
+            if (label != 0) return ctx.params->labels(label);
+            if (!ctx.params->labels.unlabeledVisible()) return glm::vec4(0.f);
+        }
+        return ctx.params->transferFunction(intensity);
+    }
 
-    inline unsigned short getData(glm::ivec3 pos) const {
-        return data[pos.x * dim[1] * dim[2] + pos.y * dim[2] + pos.z];
+    inline float getData(glm::ivec3 pos) const {
+        return volumeData->value(pos.x, pos.y, pos.z);
     };
     /**
      * 传输函数，将体数据的值转换为 RGBA 值
@@ -0,0 +1,92 @@
+﻿#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <type_traits>
+
+/**
+ * 体素的存储类型，原始数据按这个类型直接读入内存和上传到 GPU，不做任何转换
+ */
+enum class VoxelType {
+    UInt8,
+    UInt16,
+    // 有符号的数据，例如 CT 的 Hounsfield 值
+    Int16,
+    Float32,
+};
+
+template <typename T>
+struct VoxelTraits;
+template <>
+struct VoxelTraits<uint8_t> {
+    static constexpr VoxelType type = VoxelType::UInt8;
+};
+template <>
+struct VoxelTraits<uint16_t> {
+    static constexpr VoxelType type = VoxelType::UInt16;
+};
+template <>
+struct VoxelTraits<int16_t> {
+    static constexpr VoxelType type = VoxelType::Int16;
+};
+template <>
+struct VoxelTraits<float> {
+    static constexpr VoxelType type = VoxelType::Float32;
+};
+
+/**
+ * 按运行时的体素类型调用 f(T{})，f 里面按 decltype 得到编译期的类型
+ * 每一帧或者每次扫描只分发一次，循环内部的采样都是针对具体类型特化的
+ */
+template <typename F>
+inline decltype(auto) dispatchVoxelType(VoxelType type, F&& f) {
+    switch (type) {
+        case VoxelType::UInt8:
+            return f(uint8_t{});
+        case VoxelType::Int16:
+            return f(int16_t{});
+        case VoxelType::Float32:
+            return f(float{});
+        case VoxelType::UInt16:
+        default:
+            return f(uint16_t{});
+    }
+}
+
+inline size_t voxelSize(VoxelType type) {
+    return dispatchVoxelType(type, [](auto zero) { return sizeof(zero); });
+}
+
+inline const char* voxelTypeName(VoxelType type) {
+    const char* names[] = {"uint8", "uint16", "int16", "float"};
+    return names[(int)type];
+}
+
+/**
+ * 解析 uint8, uint16, int16, float，无法识别时返回 false
+ */
+inline bool parseVoxelType(const std::string& name, VoxelType& type) {
+    for (int i = 0; i <= (int)VoxelType::Float32; i++) {
+        if (name == voxelTypeName((VoxelType)i)) {
+            type = (VoxelType)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * 滤波、重采样之后的浮点数转换回体素类型，整数类型四舍五入并截断到类型的范围内
+ */
+template <typename T>
+inline T toVoxel(float value) {
+    if constexpr (std::is_floating_point_v<T>) {
+        return (T)value;
+    } else {
+        value = std::clamp(value, (float)std::numeric_limits<T>::lowest(), (float)std::numeric_limits<T>::max());
+        return (T)std::floor(value + 0.5f);
+    }
+}